@@ -0,0 +1,185 @@
+#pragma once
+
+/*
+Per-thread pools of small blocks over another allocator.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "primitives/locks.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+// Small blocks are never handed back to Underlying. Once a reclaimer frees
+// a cell it goes on the freeing thread's list for its power of two size
+// class, and the next allocation of that class takes it, so cells keep
+// their type and the general purpose allocator is off the hot path.
+//
+// Each thread keeps two magazines of up to S_BATCH_SIZE blocks per class.
+// Freeing into a full magazine passes the spare one to a shared stack, and
+// allocating from an empty one takes a magazine from the stack before asking
+// Underlying. Threads that mostly free, such as a background reclaimer, so
+// feed the threads that mostly allocate.
+//
+// A freed block's class comes from Underlying's usable size, so blocks carry
+// no header. This relies on Underlying giving less than twice the size asked
+// for, and larger allocations are padded to at least twice S_MAX_POOLED so
+// they are never taken for a pooled block.
+template <class Underlying> struct PoolAllocator {
+private:
+  static const std::size_t S_MIN_BLOCK = 16;
+  static const std::size_t S_NUM_CLASSES = 5;
+  static const std::size_t S_MAX_POOLED = S_MIN_BLOCK << (S_NUM_CLASSES - 1);
+  static const std::size_t S_BATCH_SIZE = 64;
+
+  // Blocks link through their first word, and a magazine on the shared
+  // stack links to the next through the second word of its first block.
+  struct Block {
+    Block *next, *next_magazine;
+  };
+
+  // Magazines taken from the shared stack may be partly used, so count only
+  // bounds how full one is and allocation stops at the end of the list.
+  struct Magazine {
+    Block *head;
+    std::size_t count;
+  };
+
+  struct SharedClass {
+    concurrent_data_structures::TicketLock lock;
+    std::atomic<Block *> magazines;
+    SharedClass() : magazines(nullptr) {}
+  };
+
+  struct ThreadCache {
+    Magazine loaded[S_NUM_CLASSES], spare[S_NUM_CLASSES];
+    ThreadCache() {
+      for (std::size_t c = 0; c < S_NUM_CLASSES; c++) {
+        loaded[c] = Magazine{nullptr, 0};
+        spare[c] = Magazine{nullptr, 0};
+      }
+    }
+    // The blocks outlive the thread, for others to take.
+    ~ThreadCache() {
+      for (std::size_t c = 0; c < S_NUM_CLASSES; c++) {
+        release(c, loaded[c]);
+        release(c, spare[c]);
+      }
+    }
+  };
+
+  static SharedClass *shared() {
+    static SharedClass classes[S_NUM_CLASSES];
+    return classes;
+  }
+
+  static ThreadCache &thread_cache() {
+    static thread_local ThreadCache cache;
+    return cache;
+  }
+
+  static std::size_t request_class(const std::size_t size) {
+    return 64 - __builtin_clzll((size - 1) | (S_MIN_BLOCK - 1)) -
+           __builtin_ctzll(S_MIN_BLOCK);
+  }
+
+  static std::size_t usable_class(const std::size_t usable) {
+    return 63 - __builtin_clzll(usable) - __builtin_ctzll(S_MIN_BLOCK);
+  }
+
+  static void release(const std::size_t size_class, Magazine &magazine) {
+    if (magazine.head == nullptr) {
+      return;
+    }
+    SharedClass &shared_class = shared()[size_class];
+    shared_class.lock.lock();
+    magazine.head->next_magazine =
+        shared_class.magazines.load(std::memory_order_relaxed);
+    shared_class.magazines.store(magazine.head, std::memory_order_relaxed);
+    shared_class.lock.unlock();
+    magazine = Magazine{nullptr, 0};
+  }
+
+  static bool acquire(const std::size_t size_class, Magazine &magazine) {
+    SharedClass &shared_class = shared()[size_class];
+    if (shared_class.magazines.load(std::memory_order_relaxed) == nullptr) {
+      return false;
+    }
+    shared_class.lock.lock();
+    Block *head = shared_class.magazines.load(std::memory_order_relaxed);
+    if (head != nullptr) {
+      shared_class.magazines.store(head->next_magazine,
+                                   std::memory_order_relaxed);
+    }
+    shared_class.lock.unlock();
+    magazine = Magazine{head, S_BATCH_SIZE};
+    return head != nullptr;
+  }
+
+public:
+  static void *malloc(size_t size) {
+    if (size > S_MAX_POOLED) {
+      return Underlying::malloc(std::max(size, 2 * S_MAX_POOLED));
+    }
+    const std::size_t size_class = request_class(size);
+    ThreadCache &cache = thread_cache();
+    Magazine &loaded = cache.loaded[size_class];
+    if (loaded.head == nullptr) {
+      if (cache.spare[size_class].head != nullptr) {
+        std::swap(loaded, cache.spare[size_class]);
+      } else if (!acquire(size_class, loaded)) {
+        return Underlying::malloc(S_MIN_BLOCK << size_class);
+      }
+    }
+    Block *block = loaded.head;
+    loaded.head = block->next;
+    loaded.count--;
+    return block;
+  }
+
+  static void *aligned_alloc(size_t alignment, size_t size) {
+    return Underlying::aligned_alloc(alignment,
+                                     std::max(size, 2 * S_MAX_POOLED));
+  }
+
+  static void free(void *ptr) {
+    if (ptr == nullptr) {
+      return;
+    }
+    const std::size_t usable = Underlying::malloc_usable_size(ptr);
+    if (usable >= 2 * S_MAX_POOLED) {
+      Underlying::free(ptr);
+      return;
+    }
+    const std::size_t size_class = usable_class(usable);
+    ThreadCache &cache = thread_cache();
+    Magazine &loaded = cache.loaded[size_class];
+    if (loaded.count >= S_BATCH_SIZE) {
+      release(size_class, cache.spare[size_class]);
+      cache.spare[size_class] = loaded;
+      loaded = Magazine{nullptr, 0};
+    }
+    Block *block = static_cast<Block *>(ptr);
+    block->next = loaded.head;
+    loaded.head = block;
+    loaded.count++;
+  }
+
+  static size_t malloc_usable_size(void *ptr) {
+    return Underlying::malloc_usable_size(ptr);
+  }
+};
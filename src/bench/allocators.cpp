@@ -25,7 +25,8 @@ namespace {
 static const std::map<Allocator, std::string> allocator_map{
     std::make_pair(Allocator::JeMalloc, "Je-Malloc"),
     std::make_pair(Allocator::Glibc, "Glibc"),
-    std::make_pair(Allocator::Intel, "Intel")};
+    std::make_pair(Allocator::Intel, "Intel"),
+    std::make_pair(Allocator::Pool, "Pool (Je-Malloc)")};
 }
 
 const std::string get_allocator_name(const Allocator table) {
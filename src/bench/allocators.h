@@ -30,6 +30,7 @@ enum class Allocator {
   JeMalloc,
   Glibc,
   Intel,
+  Pool,
 };
 
 template <class GivenAllocator, typename T> class AllocatorInterface {
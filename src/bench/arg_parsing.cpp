@@ -32,20 +32,47 @@ static const std::map<std::string, HashTable> table_map{
     std::make_pair("lf_lp_node_set",
                    HashTable::LOCK_FREE_LINEAR_PROBING_NODE_SET),
     std::make_pair("mm_set", HashTable::MAGED_MICHAEL),
+    std::make_pair("rh_brown_map", HashTable::RH_BROWN_MAP),
+    std::make_pair("striped_rh_set", HashTable::STRIPED_ROBIN_HOOD_SET),
+    std::make_pair("rh_brown_paired_set", HashTable::RH_BROWN_PAIRED_SET),
+    std::make_pair("bitmap_hopscotch_set", HashTable::BITMAP_HOPSCOTCH_SET),
+    std::make_pair("hopscotch_brown_set", HashTable::HOPSCOTCH_BROWN_SET),
+};
+
+static const std::map<std::string, KCASType> kcas_map{
+    std::make_pair("brown", KCASType::BROWN),
+    std::make_pair("harris", KCASType::HARRIS),
+};
+
+static const std::map<std::string, ContentionType> contention_map{
+    std::make_pair("none", ContentionType::NONE),
+    std::make_pair("backoff", ContentionType::BACKOFF),
+    std::make_pair("karma", ContentionType::KARMA),
+    std::make_pair("help_limit", ContentionType::HELP_LIMIT),
 };
 
 static const std::map<std::string, Reclaimer> reclaimer_map{
     std::make_pair("leaky", Reclaimer::Leaky),
     std::make_pair("epoch", Reclaimer::Epoch),
+    std::make_pair("hazard", Reclaimer::HazardPointer),
+    std::make_pair("interval", Reclaimer::Interval),
 };
 
 static const std::map<std::string, Allocator> allocator_map{
     std::make_pair("je", Allocator::JeMalloc),
     std::make_pair("glibc", Allocator::Glibc),
     std::make_pair("intel", Allocator::Intel),
+    std::make_pair("pool", Allocator::Pool),
 };
 
-enum class BenchmarkType { Set };
+enum class BenchmarkType { Set, KCAS };
+
+void print_help_and_exit(BenchmarkType type) {
+  if (type == BenchmarkType::KCAS) {
+    kcas_print_help_and_exit();
+  }
+  set_print_help_and_exit();
+}
 } // namespace
 
 bool parse_base_arg(BenchmarkConfig &base, const int current_option, char *arg,
@@ -61,7 +88,7 @@ bool parse_base_arg(BenchmarkConfig &base, const int current_option, char *arg,
     auto reclaimer_res = reclaimer_map.find(std::string(optarg));
     if (reclaimer_map.end() == reclaimer_res) {
       std::cout << "Invalid reclaimer choice." << std::endl;
-      set_print_help_and_exit();
+      print_help_and_exit(type);
     } else {
       base.reclaimer = reclaimer_res->second;
     }
@@ -71,7 +98,7 @@ bool parse_base_arg(BenchmarkConfig &base, const int current_option, char *arg,
     auto allocator_res = allocator_map.find(std::string(optarg));
     if (allocator_map.end() == allocator_res) {
       std::cout << "Invalid allocator choice." << std::endl;
-      set_print_help_and_exit();
+      print_help_and_exit(type);
     } else {
       base.allocator = allocator_res->second;
     }
@@ -86,6 +113,9 @@ bool parse_base_arg(BenchmarkConfig &base, const int current_option, char *arg,
   case 'H':
     base.hyperthreading = std::string(optarg) == "true";
     return true;
+  case 'Y':
+    base.background_reclamation = std::string(optarg) == "true";
+    return true;
   }
   return false;
 }
@@ -93,10 +123,11 @@ bool parse_base_arg(BenchmarkConfig &base, const int current_option, char *arg,
 SetBenchmarkConfig parse_set_args(std::int32_t argc, char *argv[]) {
   SetBenchmarkConfig config = {
       BenchmarkConfig{1, std::chrono::seconds(1), Reclaimer::Leaky,
-                      Allocator::JeMalloc, true, false, true},
-      1 << 23, 10, 0.4, HashTable::RH_BROWN_SET};
+                      Allocator::JeMalloc, true, false, true, false},
+      1 << 23, 10, 0.4, HashTable::RH_BROWN_SET, 8, 0, 0, 1, false, true,
+      false, false, ContentionType::NONE};
   int current_option;
-  while ((current_option = getopt(argc, argv, ":L:S:D:T:U:B:M:P:V:A:H:")) !=
+  while ((current_option = getopt(argc, argv, ":L:S:D:T:U:B:M:P:V:A:H:W:G:R:Q:I:K:C:F:X:Y:")) !=
          -1) {
     if (parse_base_arg(config.base, current_option, optarg,
                        BenchmarkType::Set)) {
@@ -112,6 +143,40 @@ SetBenchmarkConfig parse_set_args(std::int32_t argc, char *argv[]) {
     case 'U':
       config.updates = std::size_t(std::atoi(optarg));
       break;
+    case 'G':
+      config.initial_size = std::size_t(1) << std::atoi(optarg);
+      break;
+    case 'R':
+      config.resize_size = std::size_t(1) << std::atoi(optarg);
+      break;
+    case 'Q':
+      config.batch_size = std::max(std::size_t(std::atoi(optarg)),
+                                   std::size_t(1));
+      break;
+    case 'I':
+      config.interleave = std::string(optarg) == "true";
+      break;
+    case 'K':
+      config.htm_kcas = std::string(optarg) == "true";
+      break;
+    case 'F':
+      config.fill_phase = std::string(optarg) == "true";
+      break;
+    case 'X':
+      config.stall = std::string(optarg) == "true";
+      break;
+    case 'C': {
+      auto contention_res = contention_map.find(std::string(optarg));
+      if (contention_map.end() == contention_res) {
+        std::cout << "Invalid contention manager choice." << std::endl;
+        set_print_help_and_exit();
+      } else {
+        config.contention = contention_res->second;
+      }
+    } break;
+    case 'W':
+      config.value_size = std::size_t(std::atoi(optarg));
+      break;
     case 'B': { // C++
       auto table_res = table_map.find(std::string(optarg));
       if (table_map.end() == table_res) {
@@ -127,6 +192,60 @@ SetBenchmarkConfig parse_set_args(std::int32_t argc, char *argv[]) {
       set_print_help_and_exit();
     }
   }
+  if (config.initial_size == 0) {
+    config.initial_size = config.table_size;
+  }
+  return config;
+}
+
+KCASBenchmarkConfig parse_kcas_args(std::int32_t argc, char *argv[]) {
+  KCASBenchmarkConfig config = {
+      BenchmarkConfig{1, std::chrono::seconds(1), Reclaimer::Leaky,
+                      Allocator::JeMalloc, true, false, true, false},
+      KCASType::BROWN, 1 << 20, 4, 100, 50, true};
+  int current_option;
+  while ((current_option = getopt(argc, argv, ":S:D:T:U:B:M:P:V:A:H:N:O:K:Y:")) !=
+         -1) {
+    if (parse_base_arg(config.base, current_option, optarg,
+                       BenchmarkType::KCAS)) {
+      continue;
+    }
+    switch (current_option) {
+    case 'S':
+      config.array_size = std::size_t(1) << std::atoi(optarg);
+      break;
+    case 'U':
+      config.updates = std::size_t(std::atoi(optarg));
+      break;
+    case 'N':
+      config.kcas_size = std::max(std::size_t(std::atoi(optarg)),
+                                  std::size_t(1));
+      break;
+    case 'O':
+      config.overlap = std::size_t(std::atoi(optarg));
+      break;
+    case 'K':
+      config.htm_kcas = std::string(optarg) == "true";
+      break;
+    case 'B': {
+      auto kcas_res = kcas_map.find(std::string(optarg));
+      if (kcas_map.end() == kcas_res) {
+        std::cout << "Invalid K-CAS choice." << std::endl;
+        kcas_print_help_and_exit();
+      } else {
+        config.kcas = kcas_res->second;
+      }
+    } break;
+    case ':':
+    default:
+      kcas_print_help_and_exit();
+    }
+  }
+  // Every thread needs a slice with room for a whole K-CAS.
+  if (config.array_size < config.kcas_size * config.base.num_threads) {
+    std::cout << "Array too small for a K-CAS per thread." << std::endl;
+    kcas_print_help_and_exit();
+  }
   return config;
 }
 
@@ -138,11 +257,62 @@ void set_print_help_and_exit() {
       << "T: Number of concurrent threads. Default = 1.\n"
       << "U: Updates as a percentage of workload. Default = 10%.\n"
       << "B: Table being benchmarked. Default = rh_brown_set.\n"
-      << "M: Memory reclaimer using within table (if needed). Default = None.\n"
-      << "A: Allocator used within the table. Default = JeMalloc.\n"
+      << "M: Memory reclaimer using within table (if needed) (leaky, epoch, "
+         "hazard or interval). Default = None.\n"
+      << "A: Allocator used within the table (je, glibc, intel or pool). "
+         "Default = JeMalloc.\n"
+      << "P: Whether PAPI is turned on or not. Default = True.\n"
+      << "H: Whether to employ HT or move to new socket. Default = True.\n"
+      << "V: Whether to run the tests on the table. Default = False.\n"
+      << "W: Value size in bytes for map tables (8, 16, 32 or 64). "
+         "Default = 8.\n"
+      << "G: Power of two initial size for growing tables. Keys still range "
+         "over S. Default = S.\n"
+      << "Q: Number of lookups each thread buffers and issues as one batch. "
+         "Default = 1 (no batching).\n"
+      << "I: Whether batched lookups run interleaved, switching lookup on "
+         "every cache miss. Default = False.\n"
+      << "K: Whether K-CAS commits try a hardware transaction before the "
+         "software protocol, where TSX is usable. Default = True.\n"
+      << "C: How K-CAS sets wait before retrying a failed update (none, "
+         "backoff, karma or help_limit). Default = none.\n"
+      << "R: Power of two size to resize to once the benchmark duration is "
+         "up, timing operations during the resize separately. Default = no "
+         "resize phase.\n"
+      << "F: Whether the threads insert the starting keys concurrently and "
+         "timed, into a table of size G, before the benchmark. Default = "
+         "False.\n"
+      << "X: Whether the first thread stalls inside an operation for the "
+         "whole benchmark while memory use is sampled. Default = False.\n"
+      << "Y: Whether a background thread frees the epoch reclaimer's safe "
+         "garbage rather than the operations. Default = False."
+      << std::endl;
+  exit(0);
+}
+
+void kcas_print_help_and_exit() {
+  std::cout
+      << "S: Power of two number of words in the array. Default = 1 << 20.\n"
+      << "N: Words per K-CAS. Default = 4.\n"
+      << "O: Percentage chance each word comes from the whole array rather "
+         "than the thread's own slice. Default = 100%.\n"
+      << "U: K-CAS operations as a percentage of workload, the rest only "
+         "read their words. Default = 50%.\n"
+      << "D: Duration of benchmark in seconds. Default = 1 second.\n"
+      << "T: Number of concurrent threads. Default = 1.\n"
+      << "B: K-CAS being benchmarked (brown or harris). Default = brown.\n"
+      << "M: Memory reclaimer used by the K-CAS (leaky, epoch, hazard or "
+         "interval). Default = leaky.\n"
+      << "A: Allocator used by the K-CAS (je, glibc, intel or pool). Default "
+         "= JeMalloc.\n"
       << "P: Whether PAPI is turned on or not. Default = True.\n"
       << "H: Whether to employ HT or move to new socket. Default = True.\n"
-      << "V: Whether to run the tests on the table. Default = False."
+      << "V: Whether to check the array against the successful K-CAS "
+         "operations afterwards. Default = False.\n"
+      << "K: Whether K-CAS commits try a hardware transaction before the "
+         "software protocol, where TSX is usable. Default = True.\n"
+      << "Y: Whether a background thread frees the epoch reclaimer's safe "
+         "garbage rather than the operations. Default = False."
       << std::endl;
   exit(0);
 }
@@ -22,6 +22,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "benchmark_config.h"
 #include "mem-reclaimer/reclaimer.h"
 #include "table.h"
+#include <algorithm>
 #include <cstdint>
 #include <getopt.h>
 #include <map>
@@ -30,4 +31,6 @@ namespace concurrent_data_structures {
 
 SetBenchmarkConfig parse_set_args(std::int32_t argc, char *argv[]);
 void set_print_help_and_exit();
+KCASBenchmarkConfig parse_kcas_args(std::int32_t argc, char *argv[]);
+void kcas_print_help_and_exit();
 } // namespace concurrent_data_structures
@@ -18,6 +18,7 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include "primitives/locks.h"
 #include <iostream>
 
 namespace concurrent_data_structures {
@@ -26,11 +27,16 @@ void BenchmarkConfig::print(std::ostream &os) const {
   os << "Number of threads: " << num_threads << "\n"
      << "Benchmark duration: " << duration.count() << "\n"
      << "Memory reclaimer: " << get_reclaimer_name(reclaimer) << "\n"
+     << "Background reclamation: "
+     << (background_reclamation ? "true" : "false") << "\n"
      << "Memory allocator: " << get_allocator_name(allocator) << "\n"
      << "PAPI Enabled: " << (papi_active ? "true" : "false") << "\n"
      << "Testing Enabled: " << (verify ? "true" : "false") << "\n"
      << "Hypthreading before socket switch: "
-     << (hyperthreading ? "true" : "false") << std::endl;
+     << (hyperthreading ? "true" : "false") << "\n"
+     << "Elided locks: "
+     << (htm_supported() ? "hardware transactions" : "ticket lock only")
+     << std::endl;
 }
 
 void SetBenchmarkConfig::print(std::ostream &os) const {
@@ -38,6 +44,32 @@ void SetBenchmarkConfig::print(std::ostream &os) const {
   os << "Load factor: " << load_factor << "\n"
      << "Table size: " << table_size << "\n"
      << "Update percentage: " << updates << "\n"
-     << "Table name: " << get_table_name(table) << "\n";
+     << "Table name: " << get_table_name(table) << "\n"
+     << "Value size: " << value_size << "\n"
+     << "Initial table size: " << initial_size << "\n"
+     << "Resize phase size: " << resize_size << "\n"
+     << "Fill phase: " << (fill_phase ? "true" : "false") << "\n"
+     << "Stalled thread: " << (stall ? "true" : "false") << "\n"
+     << "Query batch size: " << batch_size << "\n"
+     << "Interleaved lookups: " << (interleave ? "true" : "false") << "\n"
+     << "HTM K-CAS: "
+     << (htm_supported() and htm_kcas ? "hardware transactions first"
+                                      : "software only")
+     << "\n"
+     << "K-CAS contention manager: " << get_contention_name(contention)
+     << "\n";
+}
+
+void KCASBenchmarkConfig::print(std::ostream &os) const {
+  base.print(os);
+  os << "K-CAS name: " << get_kcas_name(kcas) << "\n"
+     << "Array size: " << array_size << "\n"
+     << "Words per K-CAS: " << kcas_size << "\n"
+     << "Overlap percentage: " << overlap << "\n"
+     << "Update percentage: " << updates << "\n"
+     << "HTM K-CAS: "
+     << (htm_supported() and htm_kcas ? "hardware transactions first"
+                                      : "software only")
+     << "\n";
 }
 }
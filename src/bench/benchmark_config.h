@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "allocators.h"
+#include "kcas_type.h"
 #include "mem-reclaimer/reclaimer.h"
 #include "table.h"
 #include <chrono>
@@ -32,7 +33,7 @@ struct BenchmarkConfig {
   std::chrono::seconds duration;
   Reclaimer reclaimer;
   Allocator allocator;
-  bool papi_active, verify, hyperthreading;
+  bool papi_active, verify, hyperthreading, background_reclamation;
   void print(std::ostream &os) const;
 };
 
@@ -41,6 +42,21 @@ struct SetBenchmarkConfig {
   std::size_t table_size, updates;
   double load_factor;
   HashTable table;
+  std::size_t value_size, initial_size, resize_size, batch_size;
+  bool interleave, htm_kcas, fill_phase, stall;
+  ContentionType contention;
+  void print(std::ostream &os) const;
+};
+
+// Each operation reads kcas_size distinct words of the array, and for
+// updates percent of them swaps each word for its successor in one K-CAS.
+// Words are picked from the thread's own slice of the array, or with overlap
+// percent chance from anywhere in it.
+struct KCASBenchmarkConfig {
+  BenchmarkConfig base;
+  KCASType kcas;
+  std::size_t array_size, kcas_size, overlap, updates;
+  bool htm_kcas;
   void print(std::ostream &os) const;
 };
 
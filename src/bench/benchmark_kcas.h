@@ -0,0 +1,200 @@
+#pragma once
+
+/*
+K-CAS benchmarking class.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "benchmark_config.h"
+#include "benchmark_results.h"
+#include "primitives/barrier.h"
+#include "primitives/cache_utils.h"
+#include "random/pcg_random.h"
+#include "thread_papi_wrapper.h"
+#include "thread_pinner.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace concurrent_data_structures {
+
+// Runs K-CAS operations straight on an array of words, without a table in
+// between, so the K-CAS implementations can be compared on their own.
+template <class Allocator, template <class> class Reclaimer,
+          template <class, class> class KCASSystem>
+class KCASBenchmark {
+private:
+  typedef Reclaimer<Allocator> MemReclaimer;
+  typedef KCASSystem<Allocator, MemReclaimer> KCAS;
+  typedef typename KCAS::template KCASEntry<std::size_t> Word;
+  typedef typename KCAS::KCASDescriptor Descriptor;
+
+  struct BenchmarkThreadData {
+    const std::size_t thread_id;
+    std::atomic<bool> *running;
+    ThreadBarrierWrapper *thread_barrier;
+    BenchmarkThreadData(const std::size_t thread_id,
+                        std::atomic<bool> *running,
+                        ThreadBarrierWrapper *thread_barrier)
+        : thread_id(thread_id), running(running),
+          thread_barrier(thread_barrier) {}
+  };
+
+  // Picks the distinct words of one operation.
+  class WordGenerator {
+  private:
+    pcg32 m_random_generator;
+    std::uniform_int_distribution<std::size_t> m_percent_distribution,
+        m_array_distribution, m_slice_distribution;
+    const std::size_t m_slice_base, m_overlap;
+
+  public:
+    WordGenerator(const KCASBenchmarkConfig &config,
+                  const std::size_t thread_id)
+        : m_random_generator(pcg_extras::seed_seq_from<std::random_device>()),
+          m_percent_distribution(0, 99),
+          m_array_distribution(0, config.array_size - 1),
+          m_slice_distribution(
+              0, config.array_size / config.base.num_threads - 1),
+          m_slice_base(thread_id *
+                       (config.array_size / config.base.num_threads)),
+          m_overlap(config.overlap) {}
+
+    bool generate_update(const std::size_t updates) {
+      return m_percent_distribution(m_random_generator) < updates;
+    }
+
+    void generate_words(std::vector<std::size_t> &words) {
+      for (std::size_t i = 0; i < words.size(); i++) {
+      retry:
+        words[i] = m_percent_distribution(m_random_generator) < m_overlap
+                       ? m_array_distribution(m_random_generator)
+                       : m_slice_base +
+                             m_slice_distribution(m_random_generator);
+        for (std::size_t j = 0; j < i; j++) {
+          if (words[j] == words[i]) {
+            goto retry;
+          }
+        }
+      }
+    }
+  };
+
+  const KCASBenchmarkConfig m_config;
+  KCASBenchmarkResult m_results;
+  MemReclaimer m_reclaimer;
+  KCAS m_kcas;
+  Word *m_words;
+
+  void benchmark_routine(CacheAligned<BenchmarkThreadData> *thread_data) {
+    const std::size_t thread_id = thread_data->thread_id;
+    WordGenerator word_generator(m_config, thread_id);
+    std::vector<std::size_t> words(m_config.kcas_size);
+    std::vector<std::size_t> values(m_config.kcas_size);
+    CacheAligned<KCASThreadBenchmarkResult> *result =
+        m_results.per_thread_benchmark_result + thread_id;
+    ThreadPapiWrapper papi_wrapper(m_config.base.papi_active);
+    thread_data->thread_barrier->wait();
+    assert(papi_wrapper.start());
+    while (thread_data->running->load(std::memory_order_relaxed)) {
+      word_generator.generate_words(words);
+      ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+      for (std::size_t i = 0; i < words.size(); i++) {
+        values[i] = m_kcas.read_value(thread_id, pin, &m_words[words[i]]);
+      }
+      if (!word_generator.generate_update(m_config.updates)) {
+        result->read_attempts++;
+        continue;
+      }
+      result->kcas_attempts++;
+      Descriptor *desc = m_kcas.create_descriptor(words.size(), thread_id);
+      for (std::size_t i = 0; i < words.size(); i++) {
+        desc->add_value(&m_words[words[i]], values[i], values[i] + 1);
+      }
+      if (m_kcas.cas(thread_id, pin, desc)) {
+        result->kcas_successes++;
+      }
+    }
+    assert(papi_wrapper.stop(result->papi_counters));
+  }
+
+public:
+  KCASBenchmark(const KCASBenchmarkConfig &config)
+      : m_config(config), m_results(config.base.num_threads),
+        m_reclaimer(config.base.num_threads, 4),
+        m_kcas(config.base.num_threads, &m_reclaimer),
+        m_words(static_cast<Word *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(Word) * config.array_size))) {
+    for (std::size_t i = 0; i < m_config.array_size; i++) {
+      m_kcas.write_value(0, &m_words[i], std::size_t(0));
+    }
+  }
+  ~KCASBenchmark() { Allocator::free(m_words); }
+
+  KCASBenchmarkResult bench() {
+    std::cout << "Running benchmark...." << std::endl;
+    ThreadBarrierWrapper barrier(m_config.base.num_threads + 1);
+    std::vector<CacheAligned<BenchmarkThreadData>> thread_data;
+    std::atomic<bool> running{true};
+    for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
+      thread_data.push_back(
+          CacheAligned<BenchmarkThreadData>(t, &running, &barrier));
+    }
+    const KCASStats initial_kcas_stats = m_kcas.stats();
+    ThreadPinner pinner(m_config.base.hyperthreading);
+    std::vector<std::thread *> threads;
+    std::cout << "Launching threads." << std::endl;
+    for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
+      threads.push_back(new std::thread(&KCASBenchmark::benchmark_routine,
+                                        this, &thread_data[t]));
+      assert(pinner.schedule_thread(threads[t], t));
+    }
+    std::cout << "Waiting..." << std::endl;
+    // Wait for other threads.
+    barrier.wait();
+    // Sleep.
+    std::this_thread::sleep_for(m_config.base.duration);
+    // End benchmark.
+    running.store(false);
+    std::cout << "Joining threads." << std::endl;
+    m_results.scheduling_info = pinner.join();
+    for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
+      delete threads[t];
+    }
+    m_results.kcas_stats = m_kcas.stats().since(initial_kcas_stats);
+    std::cout << "Collating benchmark data." << std::endl;
+    return m_results;
+  }
+
+  // Every successful K-CAS added one to each of its words, so the array
+  // must sum to the words they covered.
+  bool test() {
+    std::cout << "Testing array now." << std::endl;
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, 0);
+    std::size_t sum = 0;
+    for (std::size_t i = 0; i < m_config.array_size; i++) {
+      sum += m_kcas.read_value(0, pin, &m_words[i]);
+    }
+    return sum ==
+           m_results.collate_results().kcas_successes * m_config.kcas_size;
+  }
+};
+}
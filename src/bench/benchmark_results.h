@@ -19,21 +19,97 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "primitives/cache_utils.h"
+#include "primitives/contention_manager.h"
+#include "primitives/kcas_fast_path.h"
+#include "primitives/locks.h"
 #include "thread_papi_wrapper.h"
 #include "thread_pinner.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdint>
+#include <vector>
 
 namespace concurrent_data_structures {
+// Latencies in nanoseconds, with S_SUB_BUCKETS buckets per power of two, so
+// a percentile is within 1/S_SUB_BUCKETS of the true value in fixed space.
+struct LatencyHistogram {
+  static const std::size_t S_SUB_BITS = 4;
+  static const std::size_t S_SUB_BUCKETS = std::size_t(1) << S_SUB_BITS;
+  static const std::size_t S_NUM_BUCKETS = (65 - S_SUB_BITS) * S_SUB_BUCKETS;
+  std::uint64_t samples;
+  std::uint64_t counts[S_NUM_BUCKETS];
+
+  static std::size_t bucket(const std::uint64_t nanoseconds) {
+    if (nanoseconds < S_SUB_BUCKETS) {
+      return nanoseconds;
+    }
+    const std::size_t exponent = 63 - __builtin_clzll(nanoseconds);
+    return (exponent - S_SUB_BITS + 1) * S_SUB_BUCKETS +
+           ((nanoseconds >> (exponent - S_SUB_BITS)) & (S_SUB_BUCKETS - 1));
+  }
+
+  // Smallest latency that falls in the bucket.
+  static std::uint64_t bucket_floor(const std::size_t bucket) {
+    if (bucket < S_SUB_BUCKETS) {
+      return bucket;
+    }
+    const std::size_t exponent = bucket / S_SUB_BUCKETS + S_SUB_BITS - 1;
+    return (S_SUB_BUCKETS + bucket % S_SUB_BUCKETS)
+           << (exponent - S_SUB_BITS);
+  }
+
+  LatencyHistogram() : samples(0) {
+    std::fill(counts, counts + S_NUM_BUCKETS, 0);
+  }
+
+  void record(const std::chrono::nanoseconds latency) {
+    counts[bucket(latency.count())]++;
+    samples++;
+  }
+
+  void merge(const LatencyHistogram &rhs) {
+    for (std::size_t b = 0; b < S_NUM_BUCKETS; b++) {
+      counts[b] += rhs.counts[b];
+    }
+    samples += rhs.samples;
+  }
+
+  // Floor of the bucket holding the given fraction of the samples.
+  std::uint64_t percentile(const double fraction) const {
+    const std::uint64_t rank = std::max(
+        std::uint64_t(1), std::uint64_t(std::ceil(fraction * samples)));
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < S_NUM_BUCKETS; b++) {
+      seen += counts[b];
+      if (seen >= rank) {
+        return bucket_floor(b);
+      }
+    }
+    return 0;
+  }
+};
+
 struct SetThreadBenchmarkResult {
   std::uint64_t query_attempts, query_successes;
   std::uint64_t addition_attempts, addition_successes;
   std::uint64_t removal_attempts, removal_successes;
   PapiCounters papi_counters;
+  // Latencies of a sample of the operations, batched lookups aside.
+  LatencyHistogram latencies;
   SetThreadBenchmarkResult()
       : query_attempts(0), query_successes(0), addition_attempts(0),
         addition_successes(0), removal_attempts(0), removal_successes(0) {}
 };
 
+struct KCASThreadBenchmarkResult {
+  std::uint64_t read_attempts;
+  std::uint64_t kcas_attempts, kcas_successes;
+  PapiCounters papi_counters;
+  KCASThreadBenchmarkResult()
+      : read_attempts(0), kcas_attempts(0), kcas_successes(0) {}
+};
+
 struct QueueThreadBenchmarkResult {
   std::uint64_t addition_attempts, addition_successes;
   std::uint64_t removal_attempts, removal_successes;
@@ -46,11 +122,30 @@ struct QueueThreadBenchmarkResult {
 struct SetBenchmarkResult {
   std::size_t num_threads;
   CacheAligned<SetThreadBenchmarkResult> *per_thread_benchmark_result;
+  // Operations completed while the table was being resized.
+  CacheAligned<SetThreadBenchmarkResult> *per_thread_resize_result;
+  std::chrono::nanoseconds resize_duration;
+  // Starting keys inserted concurrently before the benchmark, if any.
+  std::size_t fill_inserts;
+  std::chrono::nanoseconds fill_duration;
+  // Resident set size in bytes, taken every memory_sample_period while the
+  // benchmark runs.
+  std::vector<std::size_t> memory_samples;
+  std::chrono::milliseconds memory_sample_period;
+  // Left at zero for tables without an elided lock.
+  ElisionStats elision_stats;
+  // Left at zero for tables without K-CAS.
+  KCASStats kcas_stats;
+  ContentionStats contention_stats;
   std::vector<ThreadPinner::ProcessorInfo> scheduling_info;
   SetBenchmarkResult(const std::size_t num_threads)
       : num_threads(num_threads),
         per_thread_benchmark_result(
-            new CacheAligned<SetThreadBenchmarkResult>[num_threads]) {}
+            new CacheAligned<SetThreadBenchmarkResult>[num_threads]),
+        per_thread_resize_result(
+            new CacheAligned<SetThreadBenchmarkResult>[num_threads]),
+        resize_duration(0), fill_inserts(0), fill_duration(0),
+        memory_sample_period(0) {}
 
   //  SetBenchmarkResult(const SetBenchmarkResult &rhs) {
   //    this->num_threads = rhs.num_threads;
@@ -77,6 +172,16 @@ struct SetBenchmarkResult {
   //  SetBenchmarkResult(SetBenchmarkResult &&rhs) = delete;
   //  ~SetBenchmarkResult() { delete[] per_thread_benchmark_result; }
 
+  const SetThreadBenchmarkResult collate_resize_results() const {
+    SetThreadBenchmarkResult results;
+    for (std::size_t i = 0; i < num_threads; i++) {
+      results.query_attempts += per_thread_resize_result[i].query_attempts;
+      results.addition_attempts += per_thread_resize_result[i].addition_attempts;
+      results.removal_attempts += per_thread_resize_result[i].removal_attempts;
+    }
+    return results;
+  }
+
   const SetThreadBenchmarkResult collate_results() const {
     SetThreadBenchmarkResult results;
     for (std::size_t i = 0; i < num_threads; i++) {
@@ -90,6 +195,33 @@ struct SetBenchmarkResult {
           per_thread_benchmark_result[i].removal_attempts;
       results.removal_successes +=
           per_thread_benchmark_result[i].removal_successes;
+      results.latencies.merge(per_thread_benchmark_result[i].latencies);
+      for (std::size_t event = 0; event < PAPI_EVENTS::TOTAL_PAPI_EVENTS;
+           event++) {
+        results.papi_counters.counters[event] +=
+            per_thread_benchmark_result[i].papi_counters.counters[event];
+      }
+    }
+    return results;
+  }
+};
+
+struct KCASBenchmarkResult {
+  std::size_t num_threads;
+  CacheAligned<KCASThreadBenchmarkResult> *per_thread_benchmark_result;
+  KCASStats kcas_stats;
+  std::vector<ThreadPinner::ProcessorInfo> scheduling_info;
+  KCASBenchmarkResult(const std::size_t num_threads)
+      : num_threads(num_threads),
+        per_thread_benchmark_result(
+            new CacheAligned<KCASThreadBenchmarkResult>[num_threads]) {}
+
+  const KCASThreadBenchmarkResult collate_results() const {
+    KCASThreadBenchmarkResult results;
+    for (std::size_t i = 0; i < num_threads; i++) {
+      results.read_attempts += per_thread_benchmark_result[i].read_attempts;
+      results.kcas_attempts += per_thread_benchmark_result[i].kcas_attempts;
+      results.kcas_successes += per_thread_benchmark_result[i].kcas_successes;
       for (std::size_t event = 0; event < PAPI_EVENTS::TOTAL_PAPI_EVENTS;
            event++) {
         results.papi_counters.counters[event] +=
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "mem-reclaimer/reclaimer.h"
+#include "primitives/locks.h"
 #include "table.h"
 #include <fstream>
 
@@ -46,6 +47,11 @@ void config_summary(const BenchmarkConfig &config, std::ofstream &human_file,
               get_reclaimer_name(config.reclaimer), write_keys);
   write_field(human_file, csv_key_file, csv_data_file, "Duration",
               config.duration.count(), write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Background Reclamation", config.background_reclamation,
+              write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM Elision",
+              htm_supported(), write_keys);
 }
 
 void set_config_summary(const SetBenchmarkConfig &config,
@@ -59,22 +65,57 @@ void set_config_summary(const SetBenchmarkConfig &config,
               config.load_factor, write_keys);
   write_field(human_file, csv_key_file, csv_data_file, "Updates",
               config.updates, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Value Size",
+              config.value_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Initial Size",
+              config.initial_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Resize Size",
+              config.resize_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Fill Phase",
+              config.fill_phase, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Stalled Thread",
+              config.stall, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Batch Size",
+              config.batch_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Interleaved",
+              config.interleave, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM K-CAS",
+              htm_supported() and config.htm_kcas, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Contention Manager",
+              get_contention_name(config.contention), write_keys);
+  config_summary(config.base, human_file, csv_key_file, csv_data_file,
+                 write_keys);
+}
+
+void kcas_config_summary(const KCASBenchmarkConfig &config,
+                         std::ofstream &human_file,
+                         std::ofstream &csv_key_file,
+                         std::ofstream &csv_data_file, bool write_keys) {
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS Name",
+              get_kcas_name(config.kcas), write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Array Size",
+              config.array_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS Size",
+              config.kcas_size, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Overlap",
+              config.overlap, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Updates",
+              config.updates, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM K-CAS",
+              htm_supported() and config.htm_kcas, write_keys);
   config_summary(config.base, human_file, csv_key_file, csv_data_file,
                  write_keys);
 }
 
 static const double milliseconds = 1000.0;
 static const double microseconds = 1000000.0;
+static const double megabytes = 1024.0 * 1024.0;
 
-void papi_summary(const SetThreadBenchmarkResult &result,
+void papi_summary(const std::size_t total_operations_attempted,
                   const std::chrono::seconds &duration,
                   const PapiCounters &papi_counters, std::ofstream &human_file,
                   std::ofstream &csv_key_file, std::ofstream &csv_data_file,
                   bool write_keys) {
-  std::size_t total_operations_attempted = result.query_attempts +
-                                           result.addition_attempts +
-                                           result.removal_attempts;
-
   double level1_cache_misses_per_op =
       static_cast<double>(
           papi_counters.counters[PAPI_EVENTS::L1_CACHE_MISSES]) /
@@ -124,15 +165,15 @@ void operations_per_thread_summary(const SetThreadBenchmarkResult &result,
                                    const std::chrono::seconds &duration,
                                    bool print_papi, bool write_keys,
                                    bool last = false) {
+  std::size_t total_operations_attempted = result.query_attempts +
+                                           result.addition_attempts +
+                                           result.removal_attempts;
   if (print_papi) {
-    papi_summary(result, duration, result.papi_counters, human_file,
-                 csv_key_file, csv_data_file, write_keys);
+    papi_summary(total_operations_attempted, duration, result.papi_counters,
+                 human_file, csv_key_file, csv_data_file, write_keys);
     human_file << std::endl;
   }
 
-  std::size_t total_operations_attempted = result.query_attempts +
-                                           result.addition_attempts +
-                                           result.removal_attempts;
   std::size_t total_operations_succeeded = result.query_successes +
                                            result.addition_successes +
                                            result.removal_successes;
@@ -197,6 +238,44 @@ void operations_per_thread_summary(const SetThreadBenchmarkResult &result,
               write_keys, last, true);
 }
 
+void operations_per_thread_summary(const KCASThreadBenchmarkResult &result,
+                                   std::ofstream &human_file,
+                                   std::ofstream &csv_key_file,
+                                   std::ofstream &csv_data_file,
+                                   const std::chrono::seconds &duration,
+                                   bool print_papi, bool write_keys,
+                                   bool last = false) {
+  std::size_t total_operations_attempted =
+      result.read_attempts + result.kcas_attempts;
+  if (print_papi) {
+    papi_summary(total_operations_attempted, duration, result.papi_counters,
+                 human_file, csv_key_file, csv_data_file, write_keys);
+    human_file << std::endl;
+  }
+
+  double attempted_ops_per_microsecond =
+      static_cast<double>(total_operations_attempted) /
+      static_cast<double>(duration.count()) / microseconds;
+  double kcas_success_percentage =
+      result.kcas_attempts == 0
+          ? 0.0
+          : (static_cast<double>(result.kcas_successes) /
+             static_cast<double>(result.kcas_attempts)) *
+                100.0;
+
+  write_field(human_file, csv_key_file, csv_data_file, "Reads attempted",
+              result.read_attempts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS attempted",
+              result.kcas_attempts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS succeeded",
+              result.kcas_successes, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "K-CAS Success Percentage", kcas_success_percentage, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Total Ops per microsecond", attempted_ops_per_microsecond,
+              write_keys, last, true);
+}
+
 template <class Result>
 void operations_summary(const Result &result, std::ofstream &human_file,
                         std::ofstream &csv_key_file,
@@ -226,6 +305,169 @@ void operations_summary(const Result &result, std::ofstream &human_file,
   }
 }
 
+void fill_summary(const SetBenchmarkResult &result, std::ofstream &human_file,
+                  std::ofstream &csv_key_file, std::ofstream &csv_data_file,
+                  bool write_keys) {
+  double fill_microseconds =
+      std::chrono::duration<double, std::micro>(result.fill_duration).count();
+  double inserts_per_microsecond =
+      fill_microseconds == 0.0
+          ? 0.0
+          : static_cast<double>(result.fill_inserts) / fill_microseconds;
+  write_field(human_file, csv_key_file, csv_data_file, "Fill Duration (ms)",
+              fill_microseconds / milliseconds, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Fill Inserts per microsecond", inserts_per_microsecond,
+              write_keys);
+}
+
+// Resident memory at the start and end of the benchmark, and how fast it grew
+// in between. The whole timeline goes to the human readable file only, as its
+// length varies with the duration.
+void memory_summary(const SetBenchmarkResult &result,
+                    std::ofstream &human_file, std::ofstream &csv_key_file,
+                    std::ofstream &csv_data_file, bool write_keys) {
+  const std::vector<std::size_t> &samples = result.memory_samples;
+  const double start = samples.empty() ? 0.0 : samples.front() / megabytes;
+  const double end = samples.empty() ? 0.0 : samples.back() / megabytes;
+  const double seconds =
+      samples.size() < 2
+          ? 0.0
+          : std::chrono::duration<double>(result.memory_sample_period)
+                    .count() *
+                (samples.size() - 1);
+  write_field(human_file, csv_key_file, csv_data_file, "Memory Start (MB)",
+              start, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Memory End (MB)", end,
+              write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Memory Growth (MB per second)",
+              seconds == 0.0 ? 0.0 : (end - start) / seconds, write_keys);
+  human_file << std::endl
+             << "Memory (MB) every " << result.memory_sample_period.count()
+             << "ms:";
+  for (std::size_t i = 0; i < samples.size(); i++) {
+    human_file << " " << samples[i] / megabytes;
+  }
+}
+
+// Percentiles of the sampled operation latencies, the tail showing any
+// operation that paid for freeing a batch of garbage inline.
+void latency_summary(const SetBenchmarkResult &result,
+                     std::ofstream &human_file, std::ofstream &csv_key_file,
+                     std::ofstream &csv_data_file, bool write_keys) {
+  const LatencyHistogram &latencies = result.collate_results().latencies;
+  write_field(human_file, csv_key_file, csv_data_file, "Sampled Operations",
+              latencies.samples, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Latency p50 (ns)",
+              latencies.percentile(0.5), write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Latency p99 (ns)",
+              latencies.percentile(0.99), write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Latency p99.9 (ns)",
+              latencies.percentile(0.999), write_keys);
+}
+
+void resize_summary(const SetBenchmarkResult &result,
+                    std::ofstream &human_file, std::ofstream &csv_key_file,
+                    std::ofstream &csv_data_file, bool write_keys) {
+  const SetThreadBenchmarkResult resize_result =
+      result.collate_resize_results();
+  std::size_t total_operations_attempted = resize_result.query_attempts +
+                                           resize_result.addition_attempts +
+                                           resize_result.removal_attempts;
+  double resize_microseconds =
+      std::chrono::duration<double, std::micro>(result.resize_duration)
+          .count();
+  double attempted_ops_per_microsecond =
+      resize_microseconds == 0.0
+          ? 0.0
+          : static_cast<double>(total_operations_attempted) /
+                resize_microseconds;
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Resize Duration (ms)", resize_microseconds / milliseconds,
+              write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Resize Ops per microsecond", attempted_ops_per_microsecond,
+              write_keys);
+}
+
+void elision_summary(const ElisionStats &stats, std::ofstream &human_file,
+                     std::ofstream &csv_key_file, std::ofstream &csv_data_file,
+                     bool write_keys) {
+  write_field(human_file, csv_key_file, csv_data_file, "Conflict Aborts",
+              stats.conflict_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Capacity Aborts",
+              stats.capacity_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Explicit Aborts",
+              stats.explicit_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Nested Aborts",
+              stats.nested_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Other Aborts",
+              stats.other_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Elision Fallbacks",
+              stats.fallbacks, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Final Retry Budget",
+              stats.retry_budget, write_keys);
+}
+
+void kcas_summary(const KCASStats &stats, std::ofstream &human_file,
+                  std::ofstream &csv_key_file, std::ofstream &csv_data_file,
+                  bool write_keys) {
+  const double dcas_fraction =
+      stats.operations == 0
+          ? 0.0
+          : static_cast<double>(stats.dcas_commits + stats.dcas_failures) /
+                static_cast<double>(stats.operations);
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS Operations",
+              stats.operations, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "DCAS K-CAS Commits",
+              stats.dcas_commits, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "DCAS K-CAS Failures",
+              stats.dcas_failures, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "DCAS Fraction",
+              dcas_fraction, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM K-CAS Commits",
+              stats.htm_commits, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM K-CAS Failures",
+              stats.htm_failures, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "HTM K-CAS Aborts",
+              stats.htm_aborts, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Software K-CAS Fallbacks", stats.fallbacks, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS Helps",
+              stats.helps, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "K-CAS Descriptor Reads", stats.descriptor_reads, write_keys);
+}
+
+void contention_summary(const ContentionStats &stats,
+                        std::ofstream &human_file, std::ofstream &csv_key_file,
+                        std::ofstream &csv_data_file, bool write_keys) {
+  write_field(human_file, csv_key_file, csv_data_file, "K-CAS Retries",
+              stats.retries, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file, "Contention Backoffs",
+              stats.backoffs, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Contention Backoff Spins", stats.backoff_spins, write_keys);
+}
+
+// Helping work per operation of the K-CAS benchmark.
+void kcas_per_operation_summary(const KCASStats &stats,
+                                const KCASThreadBenchmarkResult &result,
+                                std::ofstream &human_file,
+                                std::ofstream &csv_key_file,
+                                std::ofstream &csv_data_file,
+                                bool write_keys) {
+  const double operations =
+      static_cast<double>(result.read_attempts + result.kcas_attempts);
+  write_field(human_file, csv_key_file, csv_data_file, "Helps per op",
+              operations == 0.0 ? 0.0 : stats.helps / operations, write_keys);
+  write_field(human_file, csv_key_file, csv_data_file,
+              "Descriptor Reads per op",
+              operations == 0.0 ? 0.0 : stats.descriptor_reads / operations,
+              write_keys);
+}
+
 void produce_summary(const SetBenchmarkConfig &config,
                      const SetBenchmarkResult &result,
                      const std::string &human_filename,
@@ -241,6 +483,68 @@ void produce_summary(const SetBenchmarkConfig &config,
   // Setup.
   set_config_summary(config, human_file, csv_key_file, csv_data_file, true);
   human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "FILL PHASE." << std::endl;
+  fill_summary(result, human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "RESIZE PHASE." << std::endl;
+  resize_summary(result, human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "MEMORY." << std::endl;
+  memory_summary(result, human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "LATENCY." << std::endl;
+  latency_summary(result, human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "LOCK ELISION." << std::endl;
+  elision_summary(result.elision_stats, human_file, csv_key_file,
+                  csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "K-CAS." << std::endl;
+  kcas_summary(result.kcas_stats, human_file, csv_key_file, csv_data_file,
+               true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "CONTENTION." << std::endl;
+  contention_summary(result.contention_stats, human_file, csv_key_file,
+                     csv_data_file, true);
+  human_file << std::endl;
+  // Numbers produced.
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "OPERATIONS." << std::endl;
+  operations_summary(result, human_file, csv_key_file, csv_data_file,
+                     config.base.duration, config.base.papi_active);
+  csv_key_file << std::endl;
+  csv_data_file << std::endl;
+}
+
+void produce_summary(const KCASBenchmarkConfig &config,
+                     const KCASBenchmarkResult &result,
+                     const std::string &human_filename,
+                     const std::string &csv_key_filename,
+                     const std::string &csv_data_filename) {
+  std::ofstream human_file(human_filename);
+  std::ofstream csv_key_file(csv_key_filename,
+                             std::ofstream::out | std::ofstream::trunc);
+  std::ofstream csv_data_file(csv_data_filename,
+                              std::ofstream::out | std::ofstream::app);
+  human_file << "CONFIG." << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  // Setup.
+  kcas_config_summary(config, human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
+  human_file << std::string(40, '*') << std::endl;
+  human_file << "K-CAS." << std::endl;
+  kcas_summary(result.kcas_stats, human_file, csv_key_file, csv_data_file,
+               true);
+  kcas_per_operation_summary(result.kcas_stats, result.collate_results(),
+                             human_file, csv_key_file, csv_data_file, true);
+  human_file << std::endl;
   // Numbers produced.
   human_file << std::string(40, '*') << std::endl;
   human_file << "OPERATIONS." << std::endl;
@@ -28,4 +28,9 @@ void produce_summary(const SetBenchmarkConfig &config,
                      const std::string &human_filename,
                      const std::string &csv_key_filename,
                      const std::string &csv_data_filename);
+void produce_summary(const KCASBenchmarkConfig &config,
+                     const KCASBenchmarkResult &result,
+                     const std::string &human_filename,
+                     const std::string &csv_key_filename,
+                     const std::string &csv_data_filename);
 } // namespace concurrent_hash_tables
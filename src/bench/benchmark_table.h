@@ -27,18 +27,27 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "thread_papi_wrapper.h"
 #include "thread_pinner.h"
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <deque>
+#include <fstream>
+#include <memory>
 #include <papi.h>
 #include <pthread.h>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
 namespace concurrent_data_structures {
 
+static const std::chrono::milliseconds S_MEMORY_SAMPLE_PERIOD(100);
+// Only every so many operations are timed, keeping the clock reads cheap
+// next to the operations themselves.
+static const std::size_t S_LATENCY_SAMPLE_PERIOD = 32;
+
 template <class Table, class Key> class TableBenchmark {
 private:
-  enum class BenchmarkState { RUNNING, STOPPED };
+  enum class BenchmarkState { RUNNING, RESIZING, STOPPED };
 
   struct BenchmarkThreadData {
     const std::size_t thread_id;
@@ -64,21 +73,98 @@ private:
   SetBenchmarkResult m_results;
   Table *m_table;
 
+  template <class T>
+  static auto interleaved_contains(T *table, const Key *keys,
+                                   const std::size_t n, bool *found,
+                                   const std::size_t thread_id, int)
+      -> decltype(table->contains_interleaved(keys, n, found, thread_id),
+                  bool()) {
+    table->contains_interleaved(keys, n, found, thread_id);
+    return true;
+  }
+
+  template <class T>
+  static bool interleaved_contains(T *table, const Key *keys,
+                                   const std::size_t n, bool *found,
+                                   const std::size_t thread_id, long) {
+    return false;
+  }
+
+  void batch_contains(const Key *keys, const std::size_t n, bool *found,
+                      const std::size_t thread_id) {
+    if (!m_config.interleave or
+        !interleaved_contains(m_table, keys, n, found, thread_id, 0)) {
+      m_table->contains_batch(keys, n, found, thread_id);
+    }
+  }
+
+  // Looks up the buffered keys in one batch, counting each as a query.
+  void flush_queries(std::vector<Key> &keys, bool *found,
+                     SetThreadBenchmarkResult *result,
+                     const std::size_t thread_id) {
+    if (keys.empty()) {
+      return;
+    }
+    batch_contains(keys.data(), keys.size(), found, thread_id);
+    result->query_attempts += keys.size();
+    for (std::size_t i = 0; i < keys.size(); i++) {
+      if (found[i]) {
+        result->query_successes++;
+      }
+    }
+    keys.clear();
+  }
+
   void benchmark_routine(CacheAligned<BenchmarkThreadData> *thread_data) {
     SetActionGenerator<Key> action_generator(m_config);
-    CacheAligned<SetThreadBenchmarkResult> *result =
+    const std::size_t batch_size = m_config.batch_size;
+    std::vector<Key> query_keys;
+    query_keys.reserve(batch_size);
+    std::unique_ptr<bool[]> query_found(new bool[batch_size]);
+    CacheAligned<SetThreadBenchmarkResult> *benchmark_result =
         m_results.per_thread_benchmark_result + thread_data->thread_id;
+    CacheAligned<SetThreadBenchmarkResult> *resize_result =
+        m_results.per_thread_resize_result + thread_data->thread_id;
     ThreadPapiWrapper papi_wrapper(m_config.base.papi_active);
     bool init = m_table->thread_init(thread_data->thread_id);
     thread_data->thread_barrier->wait();
     assert(init);
     assert(papi_wrapper.start());
-    while (thread_data->state->load(std::memory_order_relaxed) ==
-           BenchmarkState::RUNNING) {
+    if (m_config.stall and thread_data->thread_id == 0) {
+      std::atomic<BenchmarkState> *benchmark_state = thread_data->state;
+      stall_thread(m_table, thread_data->thread_id,
+                   [benchmark_state]() {
+                     while (benchmark_state->load(std::memory_order_relaxed) ==
+                            BenchmarkState::RUNNING) {
+                       std::this_thread::sleep_for(S_MEMORY_SAMPLE_PERIOD);
+                     }
+                   },
+                   0);
+    }
+    BenchmarkState state;
+    std::size_t operations = 0;
+    while ((state = thread_data->state->load(std::memory_order_relaxed)) !=
+           BenchmarkState::STOPPED) {
+      CacheAligned<SetThreadBenchmarkResult> *result =
+          state == BenchmarkState::RUNNING ? benchmark_result : resize_result;
       const SetAction current_action = action_generator.generate_action();
       const auto key = action_generator.generate_key();
+      // A batched lookup is only buffered, or pays for the whole batch.
+      const bool timed =
+          ++operations % S_LATENCY_SAMPLE_PERIOD == 0 and
+          (current_action != SetAction::Contains or batch_size == 1);
+      const auto start = timed ? std::chrono::steady_clock::now()
+                               : std::chrono::steady_clock::time_point();
       switch (current_action) {
       case SetAction::Contains:
+        if (batch_size > 1) {
+          query_keys.push_back(key);
+          if (query_keys.size() == batch_size) {
+            flush_queries(query_keys, query_found.get(), result,
+                          thread_data->thread_id);
+          }
+          break;
+        }
         result->query_attempts++;
         if (m_table->contains(key, thread_data->thread_id)) {
           result->query_successes++;
@@ -97,8 +183,27 @@ private:
         }
         break;
       }
+      if (timed) {
+        result->latencies.record(std::chrono::steady_clock::now() - start);
+      }
+    }
+    flush_queries(query_keys, query_found.get(),
+                  state == BenchmarkState::RUNNING ? benchmark_result
+                                                   : resize_result,
+                  thread_data->thread_id);
+    assert(papi_wrapper.stop(benchmark_result->papi_counters));
+  }
+
+  void fill_routine(const std::size_t thread_id, const std::vector<Key> *keys,
+                    ThreadBarrierWrapper *barrier) {
+    bool init = m_table->thread_init(thread_id);
+    barrier->wait();
+    assert(init);
+    const std::size_t num_threads = m_config.base.num_threads;
+    for (std::size_t i = thread_id; i < keys->size(); i += num_threads) {
+      bool added = m_table->add((*keys)[i], thread_id);
+      assert(added);
     }
-    assert(papi_wrapper.stop(result->papi_counters));
   }
 
   void test_routine(CacheAligned<TestThreadData> *thread_data) {
@@ -112,8 +217,8 @@ private:
     thread_data->thread_barrier->wait();
     assert(init);
     assert(papi_wrapper.start());
-    while (thread_data->state->load(std::memory_order_relaxed) ==
-           BenchmarkState::RUNNING) {
+    while (thread_data->state->load(std::memory_order_relaxed) !=
+           BenchmarkState::STOPPED) {
       const SetAction current_action = action_generator.generate_action();
       auto key = action_generator.generate_key();
       switch (current_action) {
@@ -149,6 +254,126 @@ private:
     assert(papi_wrapper.stop(result->papi_counters));
   }
 
+  template <class T>
+  static auto resize_table(T *table, const std::size_t size, int)
+      -> decltype(table->resize(size), bool()) {
+    table->resize(size);
+    return true;
+  }
+
+  template <class T>
+  static bool resize_table(T *table, const std::size_t size, long) {
+    return false;
+  }
+
+  template <class T, typename Wait>
+  static auto stall_thread(T *table, const std::size_t thread_id, Wait wait,
+                           int) -> decltype(table->stall(thread_id, wait),
+                                            bool()) {
+    table->stall(thread_id, wait);
+    return true;
+  }
+
+  template <class T, typename Wait>
+  static bool stall_thread(T *table, const std::size_t thread_id, Wait wait,
+                           long) {
+    return false;
+  }
+
+  template <class T>
+  static auto table_elision_stats(T *table, int)
+      -> decltype(table->elision_stats()) {
+    return table->elision_stats();
+  }
+
+  template <class T> static ElisionStats table_elision_stats(T *table, long) {
+    return ElisionStats();
+  }
+
+  template <class T>
+  static auto table_kcas_stats(T *table, int) -> decltype(table->kcas_stats()) {
+    return table->kcas_stats();
+  }
+
+  template <class T> static KCASStats table_kcas_stats(T *table, long) {
+    return KCASStats();
+  }
+
+  template <class T>
+  static auto table_contention_stats(T *table, int)
+      -> decltype(table->contention_stats()) {
+    return table->contention_stats();
+  }
+
+  template <class T>
+  static ContentionStats table_contention_stats(T *table, long) {
+    return ContentionStats();
+  }
+
+  // Inserts the starting keys into the empty table from every thread at once,
+  // each taking every num_threads'th key, so a table starting smaller than
+  // its keys grows under concurrent inserts.
+  void fill_phase() {
+    if (!m_config.fill_phase) {
+      return;
+    }
+    std::cout << "Filling hash-table." << std::endl;
+    const std::vector<Key> keys = StartingKeys<Key>(m_config);
+    ThreadBarrierWrapper barrier(m_config.base.num_threads + 1);
+    ThreadPinner pinner(m_config.base.hyperthreading);
+    std::vector<std::thread *> threads;
+    for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
+      threads.push_back(new std::thread(&TableBenchmark::fill_routine, this, t,
+                                        &keys, &barrier));
+      assert(pinner.schedule_thread(threads[t], t));
+    }
+    barrier.wait();
+    const auto start = std::chrono::steady_clock::now();
+    pinner.join();
+    m_results.fill_duration = std::chrono::steady_clock::now() - start;
+    m_results.fill_inserts = keys.size();
+    for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
+      delete threads[t];
+    }
+  }
+
+  // Resident set size of the whole process, so it counts memory the
+  // reclaimer has yet to free as well as what the table holds.
+  static std::size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t total_pages = 0, resident_pages = 0;
+    statm >> total_pages >> resident_pages;
+    return resident_pages * std::size_t(sysconf(_SC_PAGESIZE));
+  }
+
+  // Sleeps out the benchmark duration, sampling memory use as it goes.
+  void sample_memory() {
+    const auto start = std::chrono::steady_clock::now();
+    const auto end = start + m_config.base.duration;
+    m_results.memory_sample_period = S_MEMORY_SAMPLE_PERIOD;
+    m_results.memory_samples.push_back(resident_bytes());
+    for (auto next = start + S_MEMORY_SAMPLE_PERIOD; next <= end;
+         next += S_MEMORY_SAMPLE_PERIOD) {
+      std::this_thread::sleep_until(next);
+      m_results.memory_samples.push_back(resident_bytes());
+    }
+    std::this_thread::sleep_until(end);
+  }
+
+  // Resizes the table, if it can be, while the threads keep running.
+  void resize_phase(std::atomic<BenchmarkState> &benchmark_state) {
+    if (m_config.resize_size == 0) {
+      return;
+    }
+    benchmark_state.store(BenchmarkState::RESIZING);
+    const auto start = std::chrono::steady_clock::now();
+    if (!resize_table(m_table, m_config.resize_size, 0)) {
+      std::cout << "Table cannot be resized, skipping resize phase."
+                << std::endl;
+    }
+    m_results.resize_duration = std::chrono::steady_clock::now() - start;
+  }
+
 public:
   TableBenchmark(const SetBenchmarkConfig &config)
       : m_config(config), m_results(config.base.num_threads) {
@@ -159,7 +384,16 @@ public:
   ~TableBenchmark() { delete m_table; }
 
   SetBenchmarkResult bench() {
+    fill_phase();
     std::cout << "Running benchmark...." << std::endl;
+    if (m_config.interleave and
+        !interleaved_contains(m_table, nullptr, 0, nullptr, 0, 0)) {
+      std::cout << "Table cannot interleave lookups, batching instead."
+                << std::endl;
+    }
+    if (m_config.stall and !stall_thread(m_table, 0, []() {}, 0)) {
+      std::cout << "Table cannot stall a thread, skipping stall." << std::endl;
+    }
     ThreadBarrierWrapper barrier(m_config.base.num_threads + 1);
     std::vector<CacheAligned<BenchmarkThreadData>> thread_data;
     std::atomic<BenchmarkState> benchmark_state{BenchmarkState::RUNNING};
@@ -167,6 +401,10 @@ public:
       thread_data.push_back(
           CacheAligned<BenchmarkThreadData>(t, &benchmark_state, &barrier));
     }
+    const ElisionStats initial_elision_stats = table_elision_stats(m_table, 0);
+    const KCASStats initial_kcas_stats = table_kcas_stats(m_table, 0);
+    const ContentionStats initial_contention_stats =
+        table_contention_stats(m_table, 0);
     ThreadPinner pinner(m_config.base.hyperthreading);
     std::vector<std::thread *> threads;
     std::cout << "Launching threads." << std::endl;
@@ -178,8 +416,9 @@ public:
     std::cout << "Waiting..." << std::endl;
     // Wait for other threads.
     barrier.wait();
-    // Sleep.
-    std::this_thread::sleep_for(m_config.base.duration);
+    // Sleep, sampling memory use.
+    sample_memory();
+    resize_phase(benchmark_state);
     // End benchmark.
     benchmark_state.store(BenchmarkState::STOPPED);
     std::cout << "Joining threads." << std::endl;
@@ -187,11 +426,18 @@ public:
     for (std::size_t t = 0; t < m_config.base.num_threads; t++) {
       delete threads[t];
     }
+    m_results.elision_stats =
+        table_elision_stats(m_table, 0).since(initial_elision_stats);
+    m_results.kcas_stats =
+        table_kcas_stats(m_table, 0).since(initial_kcas_stats);
+    m_results.contention_stats =
+        table_contention_stats(m_table, 0).since(initial_contention_stats);
     std::cout << "Collating benchmark data." << std::endl;
     return m_results;
   }
 
   bool test() {
+    fill_phase();
     std::cout << "Running tests...." << std::endl;
     // Determine what keys are in the table...
     std::deque<Key> keys;
@@ -200,6 +446,18 @@ public:
         keys.push_back(i);
       }
     }
+    if (m_config.batch_size > 1) {
+      // Check the batched lookups agree with the single key ones.
+      std::vector<Key> all_keys(m_config.table_size);
+      for (std::size_t i = 0; i < all_keys.size(); i++) {
+        all_keys[i] = i;
+      }
+      std::unique_ptr<bool[]> found(new bool[all_keys.size()]);
+      batch_contains(all_keys.data(), all_keys.size(), found.get(), 0);
+      for (std::size_t i = 0; i < all_keys.size(); i++) {
+        assert(found[i] == m_table->contains(all_keys[i], 0));
+      }
+    }
 
     const std::size_t unused_keys = keys.size();
     const std::size_t key_slice = unused_keys / m_config.base.num_threads;
@@ -231,6 +489,7 @@ public:
     barrier.wait();
     // Sleep.
     std::this_thread::sleep_for(m_config.base.duration);
+    resize_phase(benchmark_state);
     // End benchmark.
     benchmark_state.store(BenchmarkState::STOPPED);
     std::cout << "Joining threads." << std::endl;
@@ -244,6 +503,14 @@ public:
       delete threads[t];
     }
     std::cout << "Testing table now." << std::endl;
+    if (m_config.batch_size > 1) {
+      std::vector<Key> batch_keys(free_keys.begin(), free_keys.end());
+      std::unique_ptr<bool[]> found(new bool[batch_keys.size()]);
+      batch_contains(batch_keys.data(), batch_keys.size(), found.get(), 0);
+      for (std::size_t i = 0; i < batch_keys.size(); i++) {
+        assert(!found[i]);
+      }
+    }
     for (std::size_t i = 0; i < free_keys.size(); i++) {
       Key free_key = free_keys[i];
       assert(!m_table->contains(free_key, i % m_config.base.num_threads));
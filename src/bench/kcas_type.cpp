@@ -0,0 +1,56 @@
+#include "kcas_type.h"
+
+/*
+Mapping enums to string descriptions of K-CAS implementations.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <map>
+
+namespace concurrent_data_structures {
+
+namespace {
+static const std::map<KCASType, std::string> kcas_map{
+    std::make_pair(KCASType::BROWN, "Brown K-CAS"),
+    std::make_pair(KCASType::HARRIS, "Harris K-CAS"),
+};
+
+static const std::map<ContentionType, std::string> contention_map{
+    std::make_pair(ContentionType::NONE, "None"),
+    std::make_pair(ContentionType::BACKOFF, "Exponential Backoff"),
+    std::make_pair(ContentionType::KARMA, "Karma"),
+    std::make_pair(ContentionType::HELP_LIMIT, "Helping Limit"),
+};
+}
+
+const std::string get_kcas_name(const KCASType kcas) {
+  std::string kcas_name = "ERROR: Incorrect K-CAS name.";
+  auto it = kcas_map.find(kcas);
+  if (it != kcas_map.end()) {
+    kcas_name = it->second;
+  }
+  return kcas_name;
+}
+
+const std::string get_contention_name(const ContentionType contention) {
+  std::string contention_name = "ERROR: Incorrect contention manager name.";
+  auto it = contention_map.find(contention);
+  if (it != contention_map.end()) {
+    contention_name = it->second;
+  }
+  return contention_name;
+}
+}
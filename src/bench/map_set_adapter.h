@@ -0,0 +1,107 @@
+#pragma once
+
+/*
+Drives key-value maps through the set benchmark.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash-tables/hash_table_common.h"
+#include "primitives/kcas_fast_path.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+namespace concurrent_data_structures {
+
+// Value payload with a configurable number of words.
+template <std::size_t Words> struct BenchmarkValue {
+  std::uintptr_t words[Words];
+
+  template <class K> static BenchmarkValue from_key(const K &key) {
+    BenchmarkValue value;
+    for (std::size_t w = 0; w < Words; w++) {
+      value.words[w] = std::uintptr_t(key) + w;
+    }
+    return value;
+  }
+
+  template <class K> bool matches(const K &key) const {
+    for (std::size_t w = 0; w < Words; w++) {
+      if (words[w] != std::uintptr_t(key) + w) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Maps contains/add/remove onto find/insert/erase. Every value is derived
+// from its key so a torn key/value read trips the assert in contains.
+template <class Map, class K, class V> class MapSetAdapter {
+private:
+  Map m_map;
+
+public:
+  MapSetAdapter(const std::size_t size, const std::size_t threads)
+      : m_map(size, threads) {}
+
+  bool thread_init(const std::size_t thread_id) {
+    return m_map.thread_init(thread_id);
+  }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    V value;
+    if (m_map.find(key, value, thread_id)) {
+      assert(value.matches(key));
+      return true;
+    }
+    return false;
+  }
+
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    V values[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      m_map.find_batch(keys + base, batch, values, out + base, thread_id);
+      for (std::size_t i = 0; i < batch; i++) {
+        assert(!out[base + i] or values[i].matches(keys[base + i]));
+      }
+    }
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    return m_map.insert(key, V::from_key(key), thread_id);
+  }
+
+  bool remove(const K &key, const std::size_t thread_id) {
+    return m_map.erase(key, thread_id);
+  }
+
+  KCASStats kcas_stats() const { return m_map.kcas_stats(); }
+
+  void print_table() { m_map.print_table(); }
+};
+
+// Binds a map and a value size into the set template signature used by main.
+template <template <class, template <class> class, class, class> class Map,
+          std::size_t Words>
+struct MapBenchmark {
+  template <class Allocator, template <class> class Reclaimer, class K>
+  using Set = MapSetAdapter<Map<Allocator, Reclaimer, K, BenchmarkValue<Words>>,
+                            K, BenchmarkValue<Words>>;
+};
+}
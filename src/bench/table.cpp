@@ -31,6 +31,15 @@ static const std::map<HashTable, std::string> table_map{
     std::make_pair(HashTable::LOCK_FREE_LINEAR_PROBING_NODE_SET,
                    "Lock-Free Linear Probing Node"),
     std::make_pair(HashTable::MAGED_MICHAEL, "Maged Michael Separate Chaining"),
+    std::make_pair(HashTable::RH_BROWN_MAP, "Brown K-CAS Robin Hood Map"),
+    std::make_pair(HashTable::STRIPED_ROBIN_HOOD_SET,
+                   "Striped Lock Robin Hood Set"),
+    std::make_pair(HashTable::RH_BROWN_PAIRED_SET,
+                   "Brown K-CAS Robin Hood Set Paired Timestamps"),
+    std::make_pair(HashTable::BITMAP_HOPSCOTCH_SET,
+                   "Bitmap Hopscotch Hashing"),
+    std::make_pair(HashTable::HOPSCOTCH_BROWN_SET,
+                   "Brown K-CAS Hopscotch Set"),
 };
 }
 
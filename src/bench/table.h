@@ -28,6 +28,11 @@ enum class HashTable {
   HOPSCOTCH_SET,
   LOCK_FREE_LINEAR_PROBING_NODE_SET,
   MAGED_MICHAEL,
+  RH_BROWN_MAP,
+  STRIPED_ROBIN_HOOD_SET,
+  RH_BROWN_PAIRED_SET,
+  BITMAP_HOPSCOTCH_SET,
+  HOPSCOTCH_BROWN_SET,
 };
 
 const std::string get_table_name(const HashTable table);
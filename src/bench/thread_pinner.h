@@ -79,6 +79,23 @@ private:
       }
       return nullptr;
     }
+
+    bool all_taken() const {
+      for (std::uint32_t processor = 0; processor < num_processors;
+           processor++) {
+        if (!processors[processor].taken) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    void release_all() {
+      for (std::uint32_t processor = 0; processor < num_processors;
+           processor++) {
+        processors[processor].taken = false;
+      }
+    }
     friend class ThreadPinner;
   };
 
@@ -98,7 +115,8 @@ private:
 
   bool m_hyperthreading_before_socket_switch;
   std::unordered_map<const cpuinfo_cache *, std::uint32_t> m_cache_map;
-  std::unordered_map<std::thread *, const ProcessorInfo *> m_scheduled;
+  // Copies, as a processor is shared once there are more threads than cores.
+  std::unordered_map<std::thread *, ProcessorInfo> m_scheduled;
   Cluster **m_clusters;
 
 public:
@@ -136,11 +154,22 @@ public:
     }
   }
 
+  // Once every processor is taken, starts handing them out again in the same
+  // order, so oversubscribed runs spread threads evenly across processors.
   bool schedule_thread(std::thread *thread, std::int32_t user_id) {
     const std::uint32_t num_clusters = cpuinfo_get_l3_caches_count();
     const std::uint32_t total_clusters = m_hyperthreading_before_socket_switch
                                              ? num_clusters
                                              : num_clusters << 1;
+    bool all_taken = true;
+    for (std::uint32_t cluster = 0; cluster < total_clusters; cluster++) {
+      all_taken = all_taken and m_clusters[cluster]->all_taken();
+    }
+    if (all_taken) {
+      for (std::uint32_t cluster = 0; cluster < total_clusters; cluster++) {
+        m_clusters[cluster]->release_all();
+      }
+    }
     for (std::uint32_t cluster = 0; cluster < total_clusters; cluster++) {
       ProcessorInfo *proc_info = m_clusters[cluster]->get_next_processor();
 
@@ -157,7 +186,7 @@ public:
         return false;
       }
       proc_info->user_id = user_id;
-      m_scheduled.insert(std::make_pair(thread, proc_info));
+      m_scheduled.insert(std::make_pair(thread, *proc_info));
       return true;
     }
     // std::cout << "No more cores" << std::endl;
@@ -168,7 +197,7 @@ public:
     std::vector<ProcessorInfo> info;
     for (auto it : m_scheduled) {
       it.first->join();
-      info.push_back(*it.second);
+      info.push_back(it.second);
     }
     std::sort(info.begin(), info.end(),
               [](const ProcessorInfo &lhs, const ProcessorInfo &rhs) {
@@ -0,0 +1,278 @@
+#pragma once
+
+/*
+Hopscotch Hashing with hop-info bitmaps.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "hash_table_common.h"
+#include "primitives/cache_utils.h"
+#include "primitives/locks.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+namespace concurrent_data_structures {
+
+// Hopscotch set keeping its keys in one contiguous array, with a 32 bit
+// hop-info bitmap per home bucket marking which of the next S_HOP_RANGE
+// buckets hold its keys. A lookup scans the bits of its home bitmap over the
+// one or two cache lines they cover, where HopscotchHashSet follows a chain of
+// deltas through 24 bytes of metadata per bucket.
+//
+// Segments are locked and timestamped as in HopscotchHashSet. Writers lock
+// every segment from the home bucket to the furthest bucket they touch.
+// Buckets never wrap, they run on into an overflow region past the last home
+// bucket, so segments are always locked in ascending order. Moving a key
+// bumps the timestamp of its home segment before the bucket it left is
+// reused, and lookups retry if their home segment's timestamp changed.
+// The table does not grow.
+template <class Allocator, template <class> class Reclaimer, class Lock,
+          class K, class KT = KeyTraits<K>>
+class BitmapHopscotchSet {
+private:
+  typedef std::uint32_t HopInfo;
+
+  // Buckets a home bitmap covers.
+  static const std::size_t S_HOP_RANGE = sizeof(HopInfo) * 8;
+  // Buckets an add searches for an empty one, also the overflow region.
+  static const std::size_t S_ADD_RANGE = 1024 * 4;
+
+  struct Segment {
+    Lock lock;
+    std::atomic<std::uint32_t> timestamp;
+    Segment() : timestamp(0) {}
+  };
+
+  // Holds the segments from the one it was built on up to the last covered.
+  class SegmentGuard {
+  private:
+    BitmapHopscotchSet &m_set;
+    const std::size_t m_first;
+    std::size_t m_last;
+
+  public:
+    SegmentGuard(BitmapHopscotchSet &set, const std::size_t bucket)
+        : m_set(set), m_first(set.segment_index(bucket)), m_last(m_first) {
+      m_set.m_segments[m_first].lock.lock();
+    }
+    ~SegmentGuard() {
+      for (std::size_t segment = m_first; segment <= m_last; segment++) {
+        m_set.m_segments[segment].lock.unlock();
+      }
+    }
+    void cover(const std::size_t bucket) {
+      while (m_last < m_set.segment_index(bucket)) {
+        m_set.m_segments[++m_last].lock.lock();
+      }
+    }
+  };
+
+  const std::size_t m_size, m_size_mask, m_capacity, m_num_segments,
+      m_segment_shift;
+  std::atomic<K> *m_keys;
+  std::atomic<HopInfo> *m_hop_info;
+  CacheAligned<Segment> *m_segments;
+
+  static HopInfo hop_bit(const std::size_t offset) {
+    return HopInfo(1) << offset;
+  }
+
+  // The overflow region belongs to the last segment.
+  std::size_t segment_index(const std::size_t bucket) const {
+    return std::min(bucket >> m_segment_shift, m_num_segments - 1);
+  }
+
+  // With the home segments locked. Leaves slot at the key's bucket.
+  bool locked_find(const K &key, const std::size_t home, std::size_t &slot) {
+    for (HopInfo hop = m_hop_info[home].load(std::memory_order_relaxed);
+         hop != 0; hop &= hop - 1) {
+      slot = home + __builtin_ctz(hop);
+      if (m_keys[slot].load(std::memory_order_relaxed) == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Moves a key from a bucket before empty into it, so the empty bucket
+  // ends up closer to the home the add is filling. Takes the key nearest
+  // its own home, and returns false if none of them can reach.
+  bool hop_back(SegmentGuard &guard, std::size_t &empty) {
+    for (std::size_t home = empty - (S_HOP_RANGE - 1); home < empty; home++) {
+      const HopInfo hop = m_hop_info[home].load(std::memory_order_relaxed);
+      const HopInfo movable = hop & (hop_bit(empty - home) - 1);
+      if (movable == 0) {
+        continue;
+      }
+      const std::size_t moved = home + __builtin_ctz(movable);
+      m_keys[empty].store(m_keys[moved].load(std::memory_order_relaxed),
+                          std::memory_order_relaxed);
+      m_hop_info[home].store((hop | hop_bit(empty - home)) &
+                                 ~hop_bit(moved - home),
+                             std::memory_order_release);
+      std::atomic<std::uint32_t> &timestamp =
+          m_segments[segment_index(home)].timestamp;
+      timestamp.store(timestamp.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_relaxed);
+      // The bump must be visible before the bucket moved from is reused.
+      std::atomic_thread_fence(std::memory_order_release);
+      m_keys[moved].store(KT::NullKey, std::memory_order_relaxed);
+      empty = moved;
+      return true;
+    }
+    return false;
+  }
+
+  bool contains_internal(const K &key, const std::size_t hash) {
+    const std::size_t home = hash & m_size_mask;
+    const std::atomic<std::uint32_t> &timestamp =
+        m_segments[segment_index(home)].timestamp;
+    std::uint32_t start_timestamp;
+    do {
+      start_timestamp = timestamp.load(std::memory_order_acquire);
+      for (HopInfo hop = m_hop_info[home].load(std::memory_order_acquire);
+           hop != 0; hop &= hop - 1) {
+        if (m_keys[home + __builtin_ctz(hop)].load(
+                std::memory_order_relaxed) == key) {
+          return true;
+        }
+      }
+      // The keys must be read before the timestamp is checked again.
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while (start_timestamp != timestamp.load(std::memory_order_relaxed));
+    return false;
+  }
+
+public:
+  BitmapHopscotchSet(std::size_t size, const std::size_t threads)
+      : m_size(nearest_power_of_two(size)), m_size_mask(m_size - 1),
+        m_capacity(m_size + S_ADD_RANGE),
+        m_num_segments(std::min(nearest_power_of_two(threads), m_size)),
+        m_segment_shift(__builtin_ctzll(m_size / m_num_segments)),
+        m_keys(static_cast<std::atomic<K> *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(std::atomic<K>) * m_capacity))),
+        m_hop_info(static_cast<std::atomic<HopInfo> *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(std::atomic<HopInfo>) * m_size))),
+        m_segments(static_cast<CacheAligned<Segment> *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT,
+            sizeof(CacheAligned<Segment>) * m_num_segments))) {
+    for (std::size_t i = 0; i < m_capacity; i++) {
+      m_keys[i].store(KT::NullKey, std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i < m_size; i++) {
+      m_hop_info[i].store(0, std::memory_order_relaxed);
+    }
+    for (std::size_t s = 0; s < m_num_segments; s++) {
+      new (&m_segments[s]) CacheAligned<Segment>();
+    }
+  }
+
+  ~BitmapHopscotchSet() {
+    for (std::size_t s = 0; s < m_num_segments; s++) {
+      m_segments[s].~CacheAligned<Segment>();
+    }
+    Allocator::free(m_keys);
+    Allocator::free(m_hop_info);
+    Allocator::free(m_segments);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    return contains_internal(key, KT::hash(key));
+  }
+
+  // Hashes a chunk of keys and prefetches their home bitmaps and buckets,
+  // then scans each key's neighbourhood as contains does.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        prefetch(&m_hop_info[hashes[i] & m_size_mask]);
+        prefetch(&m_keys[hashes[i] & m_size_mask]);
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i]);
+      }
+    }
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    const std::size_t home = KT::hash(key) & m_size_mask;
+    SegmentGuard guard(*this, home);
+    guard.cover(home + S_HOP_RANGE - 1);
+    std::size_t slot;
+    if (locked_find(key, home, slot)) {
+      return false;
+    }
+    std::size_t empty = home;
+    for (;; empty++) {
+      if (empty == m_capacity or empty - home == S_ADD_RANGE) {
+        // No empty bucket in range, the table is full.
+        return false;
+      }
+      guard.cover(empty);
+      if (m_keys[empty].load(std::memory_order_relaxed) == KT::NullKey) {
+        break;
+      }
+    }
+    while (empty - home >= S_HOP_RANGE) {
+      if (!hop_back(guard, empty)) {
+        return false;
+      }
+    }
+    m_keys[empty].store(key, std::memory_order_relaxed);
+    m_hop_info[home].store(m_hop_info[home].load(std::memory_order_relaxed) |
+                               hop_bit(empty - home),
+                           std::memory_order_release);
+    return true;
+  }
+
+  bool remove(const K &key, const std::size_t thread_id) {
+    const std::size_t home = KT::hash(key) & m_size_mask;
+    SegmentGuard guard(*this, home);
+    guard.cover(home + S_HOP_RANGE - 1);
+    std::size_t slot;
+    if (!locked_find(key, home, slot)) {
+      return false;
+    }
+    m_hop_info[home].store(m_hop_info[home].load(std::memory_order_relaxed) &
+                               ~hop_bit(slot - home),
+                           std::memory_order_release);
+    m_keys[slot].store(KT::NullKey, std::memory_order_relaxed);
+    return true;
+  }
+
+  std::size_t size() {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < m_capacity; i++) {
+      if (m_keys[i].load(std::memory_order_relaxed) != KT::NullKey) {
+        count++;
+      }
+    }
+    return count;
+  }
+
+  void print_table() {}
+};
+
+template <class Allocator, template <class> class Reclaimer, class K>
+using SpinLockBitmapHopscotchSet =
+    BitmapHopscotchSet<Allocator, Reclaimer, PthreadSpinLock, K>;
+}
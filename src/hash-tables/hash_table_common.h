@@ -42,6 +42,18 @@ struct IntelHashCompare {
   }
 };
 
+// Batched lookups hash and prefetch this many keys before probing any.
+static const std::size_t S_PREFETCH_BATCH = 16;
+
+inline void prefetch(const void *address) { __builtin_prefetch(address); }
+
+// Probes that yield between cache lines check for the line boundary.
+static const std::size_t S_CACHE_LINE = 64;
+
+inline bool starts_cache_line(const void *address) {
+  return (reinterpret_cast<std::uintptr_t>(address) & (S_CACHE_LINE - 1)) == 0;
+}
+
 template <typename T> T nearest_power_of_two(T num) {
   std::size_t actual_size = sizeof(num);
   if (num == 0)
@@ -92,4 +104,30 @@ std::size_t distance_from_slot(std::size_t table_size,
              ? table_size - (original_slot - current_slot)
              : current_slot - original_slot;
 }
+
+// Robin Hood buckets keep how far the key sits from its home bucket in the
+// byte above the key, below the two bits K-CAS reserves, so probes compare
+// distances without rehashing their neighbours. Distances too large for the
+// byte saturate and are recomputed from the hash. Keys must stay below
+// S_KEY_MASK and the null key is stored as is.
+template <class K, class KT = KeyTraits<K>> struct RobinHoodBucket {
+  static const std::size_t S_DISTANCE_SHIFT = 54;
+  static const K S_KEY_MASK = (K(1) << S_DISTANCE_SHIFT) - 1;
+  static const std::size_t S_MAX_DISTANCE = 0xFF;
+
+  static K pack(const K key, const std::size_t distance) {
+    return key | (K(distance < S_MAX_DISTANCE ? distance : S_MAX_DISTANCE)
+                  << S_DISTANCE_SHIFT);
+  }
+  static K key(const K bucket) { return bucket & S_KEY_MASK; }
+  static std::size_t distance(const K bucket, const std::size_t table_size,
+                              const std::size_t slot) {
+    const std::size_t distance = std::size_t(bucket >> S_DISTANCE_SHIFT);
+    if (distance < S_MAX_DISTANCE) {
+      return distance;
+    }
+    return distance_from_slot(table_size,
+                              KT::hash(key(bucket)) & (table_size - 1), slot);
+  }
+};
 }
@@ -0,0 +1,77 @@
+#pragma once
+
+/*
+Interleaved lookups via asynchronous memory access chaining.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+namespace concurrent_data_structures {
+
+// Number of lookups each thread keeps in flight.
+static const std::size_t S_INTERLEAVE_WIDTH = 8;
+
+// Runs the lookups for keys as state machines, up to Width at a time. A
+// Machine describes a single lookup:
+//   State(Machine &)                   per slot state, built once per call.
+//   void start(State &, const K &)     hashes the key and prefetches the
+//                                      first line the lookup needs.
+//   bool step(State &, bool &found)    makes one dependent access. Returns
+//                                      true once found is final, otherwise
+//                                      prefetches the next line and yields.
+// Slots are stepped round robin, so by the time a slot comes round again its
+// prefetch has usually landed, and the miss was overlapped with the others.
+// A finished slot immediately takes the next key.
+template <std::size_t Width, class Machine, class K>
+void interleave_lookups(Machine &machine, const K *keys, const std::size_t n,
+                        bool *out) {
+  typedef typename Machine::State State;
+  typename std::aligned_storage<sizeof(State), alignof(State)>::type
+      storage[Width];
+  State *states = reinterpret_cast<State *>(storage);
+  std::size_t indices[Width];
+
+  const std::size_t width = std::min(Width, n);
+  std::size_t next = 0;
+  for (std::size_t s = 0; s < width; s++, next++) {
+    new (&states[s]) State(machine);
+    indices[s] = next;
+    machine.start(states[s], keys[next]);
+  }
+
+  for (std::size_t active = width; active > 0;) {
+    for (std::size_t s = 0; s < width; s++) {
+      bool found;
+      if (indices[s] == n or !machine.step(states[s], found)) {
+        continue;
+      }
+      out[indices[s]] = found;
+      if (next < n) {
+        indices[s] = next;
+        machine.start(states[s], keys[next++]);
+      } else {
+        indices[s] = n;
+        active--;
+      }
+    }
+  }
+
+  for (std::size_t s = 0; s < width; s++) {
+    states[s].~State();
+  }
+}
+}
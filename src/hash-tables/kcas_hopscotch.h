@@ -0,0 +1,280 @@
+#pragma once
+
+/*
+K-CAS Hopscotch Hashing implementation.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash_table_common.h"
+#include "primitives/brown_kcas.h"
+#include "primitives/cache_utils.h"
+#include "primitives/harris_kcas.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+
+namespace concurrent_data_structures {
+
+// Lock-free hopscotch set. Each home bucket has a bitmap of which of the next
+// S_HOP_RANGE buckets hold its keys, and the home buckets are split into
+// regions with a timestamp each, as in RHSetKCAS. Every update is one K-CAS
+// that writes the buckets and bitmap it changes and increments the timestamp
+// of the home region, so no two updates to a home can interleave unseen.
+//
+// An insert whose nearest empty bucket is out of range hops it back one K-CAS
+// at a time, moving some key from before the empty bucket into it, then
+// starts over. Lookups scan the bits of their home bitmap and retry if the
+// home region's timestamp changed meanwhile.
+//
+// Buckets never wrap, they run on into an overflow region past the last home
+// bucket. The table does not grow.
+template <class Allocator, template <class> class Reclaimer,
+          template <class, class> class KCASSystem, class K,
+          class KT = KeyTraits<K>>
+class KCASHopscotchSet {
+private:
+  typedef Reclaimer<Allocator> MemReclaimer;
+  typedef KCASSystem<Allocator, MemReclaimer> KCAS;
+  typedef typename KCAS::template KCASEntry<K> Bucket;
+  typedef typename KCAS::template KCASEntry<std::uintptr_t> HopInfo;
+  typedef typename KCAS::template KCASEntry<std::uintptr_t> Timestamp;
+  typedef typename KCAS::KCASDescriptor Descriptor;
+
+  // Buckets a home bitmap covers.
+  static const std::size_t S_HOP_RANGE = 32;
+  // Buckets an add searches for an empty one, also the overflow region.
+  static const std::size_t S_ADD_RANGE = 1024 * 4;
+
+  const std::size_t m_size, m_size_mask, m_capacity, m_num_timestamps,
+      m_timestamp_shift;
+  MemReclaimer m_reclaimer;
+  KCAS m_kcas;
+  Bucket *m_buckets;
+  HopInfo *m_hop_info;
+  CacheAligned<Timestamp> *m_timestamps;
+
+  static std::uintptr_t hop_bit(const std::size_t offset) {
+    return std::uintptr_t(1) << offset;
+  }
+
+  Timestamp *timestamp_of(const std::size_t home) {
+    return &m_timestamps[home >> m_timestamp_shift];
+  }
+
+  // Scans the buckets of a home bitmap. Leaves slot at the key's bucket.
+  bool find(const K &key, const std::size_t home, std::uintptr_t hop,
+            const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
+            std::size_t &slot) {
+    for (; hop != 0; hop &= hop - 1) {
+      slot = home + __builtin_ctzll(hop);
+      if (m_kcas.read_value(thread_id, pin, &m_buckets[slot]) == key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Tries to move a key from a bucket before empty into it, so the empty
+  // bucket ends up closer to the home an add is filling. Takes the key
+  // nearest its own home, and returns false if none of them can reach.
+  // Whether the K-CAS committed or not the add starts over.
+  bool hop_back(const std::size_t empty, const std::size_t thread_id,
+                ReclaimerPin<MemReclaimer> &pin) {
+    for (std::size_t home = empty - (S_HOP_RANGE - 1); home < empty; home++) {
+      Timestamp *timestamp = timestamp_of(home);
+      const std::uintptr_t home_timestamp =
+          m_kcas.read_value(thread_id, pin, timestamp);
+      const std::uintptr_t hop =
+          m_kcas.read_value(thread_id, pin, &m_hop_info[home]);
+      const std::uintptr_t movable = hop & (hop_bit(empty - home) - 1);
+      if (movable == 0) {
+        continue;
+      }
+      const std::size_t moved = home + __builtin_ctzll(movable);
+      const K moved_key = m_kcas.read_value(thread_id, pin, &m_buckets[moved]);
+      const K null_key = KT::NullKey;
+      Descriptor *desc = m_kcas.create_descriptor(4, thread_id);
+      desc->add_value(&m_buckets[empty], null_key, moved_key);
+      desc->add_value(&m_buckets[moved], moved_key, null_key);
+      desc->add_value(&m_hop_info[home], hop,
+                      (hop | hop_bit(empty - home)) & ~hop_bit(moved - home));
+      desc->add_value(timestamp, home_timestamp, home_timestamp + 1);
+      m_kcas.cas(thread_id, pin, desc);
+      return true;
+    }
+    return false;
+  }
+
+  bool contains_internal(const K &key, const std::size_t hash,
+                         const std::size_t thread_id,
+                         ReclaimerPin<MemReclaimer> &pin) {
+    const std::size_t home = hash & m_size_mask;
+    Timestamp *timestamp = timestamp_of(home);
+    std::uintptr_t start_timestamp;
+    do {
+      start_timestamp = m_kcas.read_value(thread_id, pin, timestamp);
+      std::size_t slot;
+      if (find(key, home, m_kcas.read_value(thread_id, pin, &m_hop_info[home]),
+               thread_id, pin, slot)) {
+        return true;
+      }
+    } while (start_timestamp != m_kcas.read_value(thread_id, pin, timestamp));
+    return false;
+  }
+
+public:
+  KCASHopscotchSet(const std::size_t size, const std::size_t threads)
+      : m_size(nearest_power_of_two(size)), m_size_mask(m_size - 1),
+        m_capacity(m_size + S_ADD_RANGE),
+        m_num_timestamps(
+            std::min(nearest_power_of_two(threads << 7), m_size)),
+        m_timestamp_shift(__builtin_ctzll(m_size / m_num_timestamps)),
+        m_reclaimer(threads, 4), m_kcas(threads, &m_reclaimer),
+        m_buckets(static_cast<Bucket *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(Bucket) * m_capacity))),
+        m_hop_info(static_cast<HopInfo *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(HopInfo) * m_size))),
+        m_timestamps(static_cast<CacheAligned<Timestamp> *>(
+            Allocator::aligned_alloc(S_CACHE_ALIGNMENT,
+                                     sizeof(CacheAligned<Timestamp>) *
+                                         m_num_timestamps))) {
+    const K null_key = KT::NullKey;
+    for (std::size_t i = 0; i < m_capacity; i++) {
+      m_kcas.write_value(0, &m_buckets[i], null_key);
+    }
+    for (std::size_t i = 0; i < m_size; i++) {
+      m_kcas.write_value(0, &m_hop_info[i], std::uintptr_t());
+    }
+    for (std::size_t i = 0; i < m_num_timestamps; i++) {
+      m_kcas.write_value(0, &m_timestamps[i], std::uintptr_t());
+    }
+  }
+  ~KCASHopscotchSet() {
+    Allocator::free(m_buckets);
+    Allocator::free(m_hop_info);
+    Allocator::free(m_timestamps);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  KCASStats kcas_stats() const { return m_kcas.stats(); }
+
+  std::size_t size() { return m_size; }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    return contains_internal(key, KT::hash(key), thread_id, pin);
+  }
+
+  // Looks up a batch of keys under one pin, prefetching each chunk's home
+  // bitmaps, buckets and timestamps before probing.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        const std::size_t home = hashes[i] & m_size_mask;
+        prefetch(&m_hop_info[home]);
+        prefetch(&m_buckets[home]);
+        prefetch(timestamp_of(home));
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] =
+            contains_internal(keys[base + i], hashes[i], thread_id, pin);
+      }
+    }
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    const std::size_t home = KT::hash(key) & m_size_mask;
+    Timestamp *timestamp = timestamp_of(home);
+    const K null_key = KT::NullKey;
+  loopBegin:
+    const std::uintptr_t home_timestamp =
+        m_kcas.read_value(thread_id, pin, timestamp);
+    const std::uintptr_t hop =
+        m_kcas.read_value(thread_id, pin, &m_hop_info[home]);
+    std::size_t slot;
+    if (find(key, home, hop, thread_id, pin, slot)) {
+      return false;
+    }
+    std::size_t empty = home;
+    for (;; empty++) {
+      if (empty == m_capacity or empty - home == S_ADD_RANGE) {
+        // No empty bucket in range, the table is full.
+        return false;
+      }
+      if (m_kcas.read_value(thread_id, pin, &m_buckets[empty]) == null_key) {
+        break;
+      }
+    }
+    if (empty - home >= S_HOP_RANGE) {
+      if (!hop_back(empty, thread_id, pin)) {
+        return false;
+      }
+      goto loopBegin;
+    }
+    Descriptor *desc = m_kcas.create_descriptor(3, thread_id);
+    desc->add_value(&m_buckets[empty], null_key, key);
+    desc->add_value(&m_hop_info[home], hop, hop | hop_bit(empty - home));
+    desc->add_value(timestamp, home_timestamp, home_timestamp + 1);
+    if (!m_kcas.cas(thread_id, pin, desc)) {
+      goto loopBegin;
+    }
+    return true;
+  }
+
+  bool remove(const K &key, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    const std::size_t home = KT::hash(key) & m_size_mask;
+    Timestamp *timestamp = timestamp_of(home);
+  loopBegin:
+    const std::uintptr_t home_timestamp =
+        m_kcas.read_value(thread_id, pin, timestamp);
+    const std::uintptr_t hop =
+        m_kcas.read_value(thread_id, pin, &m_hop_info[home]);
+    std::size_t slot;
+    if (!find(key, home, hop, thread_id, pin, slot)) {
+      if (m_kcas.read_value(thread_id, pin, timestamp) != home_timestamp) {
+        goto loopBegin;
+      }
+      return false;
+    }
+    const K null_key = KT::NullKey;
+    Descriptor *desc = m_kcas.create_descriptor(3, thread_id);
+    desc->add_value(&m_buckets[slot], key, null_key);
+    desc->add_value(&m_hop_info[home], hop, hop & ~hop_bit(slot - home));
+    desc->add_value(timestamp, home_timestamp, home_timestamp + 1);
+    if (!m_kcas.cas(thread_id, pin, desc)) {
+      goto loopBegin;
+    }
+    return true;
+  }
+};
+
+template <class Allocator, template <class> class Reclaimer, class K>
+using HopscotchSetBrownKCAS =
+    KCASHopscotchSet<Allocator, Reclaimer, BrownKCAS, K>;
+
+template <class Allocator, template <class> class Reclaimer, class K>
+using HopscotchSetHarrisKCAS =
+    KCASHopscotchSet<Allocator, Reclaimer, HarrisKCAS, K>;
+}
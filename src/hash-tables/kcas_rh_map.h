@@ -0,0 +1,456 @@
+#pragma once
+
+/*
+K-CAS Robin Hood Hashing map implementation.
+Copyright (C) 2018 Robert Kelly
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hash_table_common.h"
+#include "primitives/brown_kcas.h"
+#include "primitives/cache_utils.h"
+#include "primitives/harris_kcas.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+namespace concurrent_data_structures {
+
+// Same algorithm as RHSetKCAS but every bucket carries the words of its value
+// next to the key. Values are moved inside the same K-CAS as their key, and
+// the timestamp of a region is bumped whenever a key or value in it changes so
+// readers get a consistent key/value pair out of the usual validation.
+// Like keys, every word of a value must leave its top two bits clear.
+template <class Allocator, template <class> class Reclaimer,
+          template <class, class> class KCASSystem, class K, class V,
+          class KT = KeyTraits<K>>
+class RHMapKCAS {
+
+private:
+  typedef Reclaimer<Allocator> MemReclaimer;
+  typedef KCASSystem<Allocator, MemReclaimer> KCAS;
+  typedef typename KCAS::template KCASEntry<K> KeyEntry;
+  typedef typename KCAS::template KCASEntry<std::uintptr_t> ValueEntry;
+  typedef typename KCAS::template KCASEntry<std::uintptr_t> Timestamp;
+  typedef typename KCAS::template ReadSet<std::uintptr_t> TimestampReads;
+  typedef typename KCAS::KCASDescriptor Descriptor;
+
+  static_assert(sizeof(V) % sizeof(std::uintptr_t) == 0,
+                "Value must be a whole number of words.");
+  static_assert(std::is_trivially_copyable<V>::value,
+                "Value must be trivially copyable.");
+
+  static const std::size_t S_VALUE_WORDS = sizeof(V) / sizeof(std::uintptr_t);
+  static const std::size_t S_MAX_KCAS = 3000;
+
+  struct Bucket {
+    KeyEntry key;
+    ValueEntry value[S_VALUE_WORDS];
+  };
+
+  // Empty buckets always hold a zeroed value.
+  struct ValueWords {
+    std::uintptr_t words[S_VALUE_WORDS];
+
+    static ValueWords null() {
+      ValueWords value_words;
+      std::memset(value_words.words, 0, sizeof(value_words.words));
+      return value_words;
+    }
+
+    static ValueWords from_value(const V &value) {
+      ValueWords value_words;
+      std::memcpy(value_words.words, &value, sizeof(V));
+      return value_words;
+    }
+
+    V to_value() const {
+      V value;
+      std::memcpy(&value, words, sizeof(V));
+      return value;
+    }
+  };
+
+  std::size_t m_size, m_size_mask, m_num_timestamps;
+  std::uint8_t m_timestamp_shift;
+  CacheAligned<Timestamp> *m_timestamps;
+  Bucket *m_table;
+  MemReclaimer m_reclaimer;
+  KCAS m_kcas;
+
+  void read_value_words(const std::size_t thread_id,
+                        ReclaimerPin<MemReclaimer> &pin, const Bucket &bucket,
+                        ValueWords &value_words) {
+    for (std::size_t w = 0; w < S_VALUE_WORDS; w++) {
+      value_words.words[w] = m_kcas.read_value(thread_id, pin, &bucket.value[w]);
+    }
+  }
+
+  void add_value_words(Descriptor *desc, Bucket &bucket,
+                       const ValueWords &before, const ValueWords &desired) {
+    for (std::size_t w = 0; w < S_VALUE_WORDS; w++) {
+      if (before.words[w] != desired.words[w]) {
+        desc->add_value(&bucket.value[w], before.words[w], desired.words[w]);
+      }
+    }
+  }
+
+  bool find_internal(const K &key, const std::size_t original_hash, V &value,
+                     const std::size_t thread_id,
+                     ReclaimerPin<MemReclaimer> &pin) {
+    const std::size_t original_bucket = original_hash & m_size_mask;
+    TimestampReads timestamps;
+  loopBegin:
+    timestamps.clear();
+    std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
+    bool found = false;
+    ValueWords found_value;
+
+    for (std::size_t current_bucket = original_bucket, cur_dist = 0;;
+         current_bucket++, cur_dist++) {
+      current_bucket &= m_size_mask;
+
+      const std::size_t current_timestamp_bucket =
+          current_bucket >> m_timestamp_shift;
+
+      if (current_timestamp_bucket != last_timestamp_bucket) {
+        last_timestamp_bucket = current_timestamp_bucket;
+        m_kcas.record_value(thread_id, pin,
+                            &m_timestamps[last_timestamp_bucket], timestamps);
+      }
+
+      const K current_key =
+          m_kcas.read_value(thread_id, pin, &m_table[current_bucket].key);
+      if (current_key == KT::NullKey) {
+        break;
+      }
+      if (key == current_key) {
+        // The value is only paired with the key if the region did not move.
+        read_value_words(thread_id, pin, m_table[current_bucket], found_value);
+        found = true;
+        break;
+      }
+      const std::size_t original_bucket = KT::hash(current_key) & m_size_mask;
+      const std::size_t distance =
+          distance_from_slot(m_size, original_bucket, current_bucket);
+      if (distance < cur_dist) {
+        break;
+      }
+    }
+    if (!m_kcas.validate(thread_id, pin, timestamps)) {
+      goto loopBegin;
+    }
+    if (found) {
+      value = found_value.to_value();
+    }
+    return found;
+  }
+
+  enum class InsertMode { Insert, Assign };
+
+  bool insert_internal(const K &key, const V &value,
+                       const std::size_t thread_id, const InsertMode mode) {
+    const std::size_t original_hash = KT::hash(key);
+    const std::size_t original_bucket = original_hash & m_size_mask;
+    const ValueWords value_words = ValueWords::from_value(value);
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+  loopBegin:
+    K active_key = key;
+    ValueWords active_value = value_words;
+    std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
+    bool inced_active = false;
+    std::uintptr_t active_timestamp =
+        std::numeric_limits<std::uintptr_t>::max();
+    Descriptor *desc = m_kcas.create_descriptor(S_MAX_KCAS, thread_id);
+
+    for (std::size_t current_bucket = original_bucket, active_dist = 0;;
+         current_bucket++, active_dist++) {
+      current_bucket &= m_size_mask;
+      const std::size_t current_timestamp_bucket =
+          current_bucket >> m_timestamp_shift;
+      if (current_timestamp_bucket != last_timestamp_bucket) {
+        last_timestamp_bucket = current_timestamp_bucket;
+        active_timestamp = m_kcas.read_value(
+            thread_id, pin, &m_timestamps[last_timestamp_bucket]);
+        inced_active = false;
+      }
+      const K current_key =
+          m_kcas.read_value(thread_id, pin, &m_table[current_bucket].key);
+      if (current_key == KT::NullKey) { // Found an empty slot
+        desc->add_value(&m_table[current_bucket].key, current_key, active_key);
+        add_value_words(desc, m_table[current_bucket], ValueWords::null(),
+                        active_value);
+        if (!inced_active) {
+          desc->add_value(&m_timestamps[last_timestamp_bucket],
+                          active_timestamp, active_timestamp + 1);
+          inced_active = true;
+        }
+        bool result = m_kcas.cas(thread_id, pin, desc);
+        if (!result) {
+          goto loopBegin;
+        }
+        return true;
+      }
+
+      if (current_key == key) {
+        if (mode == InsertMode::Insert) {
+          m_kcas.free_descriptor(desc);
+          return false;
+        }
+        // Overwrite the value in place, throwing away any displacements.
+        m_kcas.free_descriptor(desc);
+        desc = m_kcas.create_descriptor(S_MAX_KCAS, thread_id);
+        const std::uintptr_t current_timestamp = m_kcas.read_value(
+            thread_id, pin, &m_timestamps[current_timestamp_bucket]);
+        ValueWords current_value;
+        read_value_words(thread_id, pin, m_table[current_bucket],
+                         current_value);
+        desc->add_value(&m_table[current_bucket].key, current_key, current_key);
+        add_value_words(desc, m_table[current_bucket], current_value,
+                        value_words);
+        desc->add_value(&m_timestamps[current_timestamp_bucket],
+                        current_timestamp, current_timestamp + 1);
+        bool result = m_kcas.cas(thread_id, pin, desc);
+        if (!result) {
+          goto loopBegin;
+        }
+        return false;
+      }
+
+      // Concurrent addition moved our stuff.
+      if (current_key == active_key) {
+        m_kcas.free_descriptor(desc);
+        goto loopBegin;
+      }
+
+      const std::size_t original_bucket = KT::hash(current_key) & m_size_mask;
+      const std::size_t current_dist =
+          distance_from_slot(m_size, original_bucket, current_bucket);
+      // SWAP!
+      if (current_dist < active_dist) {
+        ValueWords current_value;
+        read_value_words(thread_id, pin, m_table[current_bucket],
+                         current_value);
+        desc->add_value(&m_table[current_bucket].key, current_key, active_key);
+        add_value_words(desc, m_table[current_bucket], current_value,
+                        active_value);
+        if (!inced_active) {
+          desc->add_value(&m_timestamps[last_timestamp_bucket],
+                          active_timestamp, active_timestamp + 1);
+          inced_active = true;
+        }
+        active_key = current_key;
+        active_value = current_value;
+        active_dist = current_dist;
+      }
+    }
+  }
+
+public:
+  RHMapKCAS(const std::size_t size, const std::size_t threads)
+      : m_size(nearest_power_of_two(size)), m_size_mask(m_size - 1),
+        m_timestamps(static_cast<CacheAligned<Timestamp> *>(
+            Allocator::malloc(sizeof(CacheAligned<Timestamp>) *
+                              nearest_power_of_two(threads << 7)))),
+        m_table(
+            static_cast<Bucket *>(Allocator::malloc(sizeof(Bucket) * m_size))),
+        m_reclaimer(threads, 4), m_kcas(threads, &m_reclaimer) {
+
+    std::size_t num_timestamps = nearest_power_of_two(threads << 7);
+    const K null_key = KT::NullKey;
+    const ValueWords null_value = ValueWords::null();
+
+    std::uint8_t num_timestamp_bits = 0;
+    for (std::size_t timestamp = num_timestamps; timestamp > 0;
+         timestamp >>= 1, num_timestamp_bits++) {
+    }
+    std::uint8_t num_size_bits = 0;
+    for (std::size_t size = m_size; size > 0; size >>= 1, num_size_bits++) {
+    }
+    std::uint8_t timestamp_shift = num_size_bits - num_timestamp_bits;
+    m_timestamp_shift = timestamp_shift;
+
+    for (std::size_t i = 0; i < m_size; i++) {
+      m_kcas.write_value(0, &m_table[i].key, null_key);
+      for (std::size_t w = 0; w < S_VALUE_WORDS; w++) {
+        m_kcas.write_value(0, &m_table[i].value[w], null_value.words[w]);
+      }
+    }
+    for (std::size_t i = 0; i < num_timestamps; i++) {
+      m_kcas.write_value(0, &m_timestamps[i], std::uintptr_t());
+    }
+  }
+  ~RHMapKCAS() {
+    Allocator::free(m_timestamps);
+    Allocator::free(m_table);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  KCASStats kcas_stats() const { return m_kcas.stats(); }
+
+  bool find(const K &key, V &value, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    return find_internal(key, KT::hash(key), value, thread_id, pin);
+  }
+
+  // Looks up a batch of keys under one pin, prefetching each chunk's home
+  // buckets and timestamps before probing. Values are only written for keys
+  // found.
+  void find_batch(const K *keys, const std::size_t n, V *values, bool *out,
+                  const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        const std::size_t bucket = hashes[i] & m_size_mask;
+        prefetch(&m_table[bucket]);
+        prefetch(&m_timestamps[bucket >> m_timestamp_shift]);
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = find_internal(keys[base + i], hashes[i],
+                                      values[base + i], thread_id, pin);
+      }
+    }
+  }
+
+  bool insert(const K &key, const V &value, const std::size_t thread_id) {
+    return insert_internal(key, value, thread_id, InsertMode::Insert);
+  }
+
+  // Returns true if the key was inserted, false if an existing value was
+  // overwritten.
+  bool insert_or_assign(const K &key, const V &value,
+                        const std::size_t thread_id) {
+    return insert_internal(key, value, thread_id, InsertMode::Assign);
+  }
+
+  bool erase(const K &key, const std::size_t thread_id) {
+
+    const std::size_t original_hash = KT::hash(key);
+    const std::size_t original_bucket = original_hash & m_size_mask;
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    TimestampReads timestamps;
+  loopBegin:
+    timestamps.clear();
+    std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
+    Descriptor *desc = m_kcas.create_descriptor(S_MAX_KCAS, thread_id);
+
+    for (std::size_t current_bucket = original_bucket, active_dist = 0;;
+         current_bucket++, active_dist++) {
+      current_bucket &= m_size_mask;
+      const std::size_t current_timestamp_bucket =
+          current_bucket >> m_timestamp_shift;
+      if (current_timestamp_bucket != last_timestamp_bucket) {
+        last_timestamp_bucket = current_timestamp_bucket;
+        m_kcas.record_value(thread_id, pin,
+                            &m_timestamps[last_timestamp_bucket], timestamps);
+      }
+
+      const K current_key =
+          m_kcas.read_value(thread_id, pin, &m_table[current_bucket].key);
+      if (current_key == KT::NullKey) {
+        goto counter_check;
+      }
+
+      if (current_key == key) {
+        bool inced_active = false;
+        std::size_t dest_bucket = current_bucket;
+        K dest_key = current_key;
+        ValueWords dest_value;
+        read_value_words(thread_id, pin, m_table[dest_bucket], dest_value);
+        std::uintptr_t dest_timestamp = timestamps.back().value;
+        std::size_t dest_timestamp_bucket =
+            std::numeric_limits<std::size_t>::max();
+        for (std::size_t shuffle_bucket = dest_bucket + 1;; shuffle_bucket++) {
+          shuffle_bucket &= m_size_mask;
+          const std::size_t shuffle_timestamp_bucket =
+              shuffle_bucket >> m_timestamp_shift;
+          if (dest_timestamp_bucket != shuffle_timestamp_bucket) {
+            dest_timestamp_bucket = shuffle_timestamp_bucket;
+            dest_timestamp = m_kcas.read_value(
+                thread_id, pin, &m_timestamps[dest_timestamp_bucket]);
+            inced_active = false;
+          }
+
+          const K shuffle_key =
+              m_kcas.read_value(thread_id, pin, &m_table[shuffle_bucket].key);
+          if (shuffle_key == KT::NullKey) {
+            break;
+          }
+          const std::size_t shuffle_idx = KT::hash(shuffle_key) & m_size_mask;
+          const std::size_t shuffle_dist =
+              distance_from_slot(m_size, shuffle_idx, shuffle_bucket);
+          if (shuffle_dist == 0) {
+            break;
+          }
+          ValueWords shuffle_value;
+          read_value_words(thread_id, pin, m_table[shuffle_bucket],
+                           shuffle_value);
+          desc->add_value(&m_table[dest_bucket].key, dest_key, shuffle_key);
+          add_value_words(desc, m_table[dest_bucket], dest_value,
+                          shuffle_value);
+          if (!inced_active) {
+            desc->add_value(&m_timestamps[dest_timestamp_bucket],
+                            dest_timestamp, dest_timestamp + 1);
+            inced_active = true;
+          }
+
+          dest_key = shuffle_key;
+          dest_value = shuffle_value;
+          dest_bucket = shuffle_bucket;
+        }
+        if (!inced_active) {
+          desc->add_value(&m_timestamps[dest_timestamp_bucket], dest_timestamp,
+                          dest_timestamp + 1);
+          inced_active = true;
+        }
+        const K null_key = KT::NullKey;
+        desc->add_value(&m_table[dest_bucket].key, dest_key, null_key);
+        add_value_words(desc, m_table[dest_bucket], dest_value,
+                        ValueWords::null());
+        bool result = m_kcas.cas(thread_id, pin, desc);
+        if (!result) {
+          goto loopBegin;
+        }
+        return true;
+      }
+      const std::size_t original_idx = KT::hash(current_key) & m_size_mask;
+      const std::size_t current_dist =
+          distance_from_slot(m_size, original_idx, current_bucket);
+      if (current_dist < active_dist) {
+        goto counter_check;
+      }
+    }
+  counter_check:
+    m_kcas.free_descriptor(desc);
+    if (!m_kcas.validate(thread_id, pin, timestamps)) {
+      goto loopBegin;
+    }
+    return false;
+  }
+
+  void print_table() {}
+};
+
+template <class Allocator, template <class> class Reclaimer, class K, class V>
+using RHMapHarrisKCAS = RHMapKCAS<Allocator, Reclaimer, HarrisKCAS, K, V>;
+
+template <class Allocator, template <class> class Reclaimer, class K, class V>
+using RHMapBrownKCAS = RHMapKCAS<Allocator, Reclaimer, BrownKCAS, K, V>;
+}
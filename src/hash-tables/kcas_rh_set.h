@@ -19,10 +19,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "hash_table_common.h"
+#include "interleaved_lookup.h"
 #include "primitives/brown_kcas.h"
 #include "primitives/cache_utils.h"
+#include "primitives/contention_manager.h"
 #include "primitives/harris_kcas.h"
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <fstream>
 #include <iostream>
 #include <mutex>
@@ -31,40 +35,113 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 namespace concurrent_data_structures {
 
+// The table grows cooperatively. An insert that probes too far on a half full
+// table allocates a table twice the size and hangs it off the current one.
+// Writers that notice then migrate timestamp regions a chunk at a time: the
+// region's timestamp is frozen so no K-CAS can commit into it, its keys are
+// copied over and the timestamp is marked migrated. Once every region is
+// migrated the next table is swapped in and the old one retired. Readers keep
+// probing the old table throughout, as it stays authoritative until the swap.
+//
+// An update whose K-CAS fails tells the ContentionManager, which decides how
+// long to wait before the update probes again.
 template <class Allocator, template <class> class Reclaimer,
           template <class, class> class KCASSystem, class K,
-          class KT = KeyTraits<K>>
+          class KT = KeyTraits<K>, bool PairedTimestamps = false,
+          class ContentionManager = NoContentionManager>
 class RHSetKCAS {
 
 private:
   typedef Reclaimer<Allocator> MemReclaimer;
+  typedef typename MemReclaimer::RecordHandle RecordHandle;
+  typedef typename MemReclaimer::RecordBase RecordBase;
   typedef KCASSystem<Allocator, MemReclaimer> KCAS;
   typedef typename KCAS::template KCASEntry<K> Bucket;
   typedef typename KCAS::template KCASEntry<std::uintptr_t> Timestamp;
   typedef typename KCAS::KCASDescriptor Descriptor;
+  typedef typename KCAS::template ReadSet<std::uintptr_t> TimestampReads;
+  typedef RobinHoodBucket<K, KT> PackedBucket;
 
   static const std::size_t S_MAX_KCAS = 3000;
   //  static const std::size_t S_MAX_THREADS = 144;
-  static const std::size_t S_MAX_TIMESTAMPS = 2048;
 
-  std::size_t m_size, m_size_mask, m_num_timestamps;
-  std::uint8_t m_timestamp_shift;
-  CacheAligned<Timestamp> *m_timestamps;
-  Bucket *m_table;
+  // Timestamp states during a resize. K-CAS entries lose their top two bits
+  // so stay below them.
+  static const std::uintptr_t S_FROZEN = std::uintptr_t(1) << 60;
+  static const std::uintptr_t S_MIGRATED = std::uintptr_t(1) << 59;
+  // Inserts probing this far check whether the table is worth growing.
+  static const std::size_t S_RESIZE_PROBE = 128;
+  // Regions an interleaved lookup remembers before handing over to
+  // contains_internal.
+  static const std::size_t S_INTERLEAVE_TIMESTAMPS = 4;
+
+  enum class AddResult { Added, Present, Resizing };
+
+  // With paired timestamps every bucket is a region of its own and shares a
+  // 16 byte cell with its timestamp. An insert into an empty bucket is then a
+  // K-CAS of two adjacent words, which the K-CAS layer commits with a single
+  // cmpxchg16b.
+  struct alignas(16) Cell {
+    Bucket bucket;
+    Timestamp timestamp;
+  };
+
+  // A single version of the table, held in one allocation so the reclaimer
+  // can free it in one go.
+  struct Table : public RecordBase {
+    std::size_t size, size_mask, num_timestamps;
+    std::uint8_t timestamp_shift;
+    CacheAligned<Timestamp> *timestamps;
+    Bucket *buckets;
+    Cell *cells;
+    std::atomic<Table *> next;
+    std::atomic_size_t next_region;
+  };
+
+  const std::size_t m_num_threads, m_num_timestamps;
+  CacheAligned<std::atomic<std::intptr_t>> *m_thread_counts;
   MemReclaimer m_reclaimer;
   KCAS m_kcas;
+  ContentionManager m_contention;
+  std::atomic<Table *> m_table;
+
+  static std::size_t align_up(const std::size_t bytes) {
+    return (bytes + S_CACHE_ALIGNMENT - 1) & ~(S_CACHE_ALIGNMENT - 1);
+  }
+
+  static Bucket *bucket_at(const Table *table, const std::size_t i) {
+    return PairedTimestamps ? &table->cells[i].bucket : &table->buckets[i];
+  }
+
+  static Timestamp *timestamp_at(const Table *table, const std::size_t region) {
+    return PairedTimestamps ? &table->cells[region].timestamp
+                            : &table->timestamps[region];
+  }
+
+  Table *create_table(const std::size_t size) {
+    const std::size_t num_timestamps =
+        PairedTimestamps ? size : std::min(m_num_timestamps, size);
+    const std::size_t header_bytes = align_up(sizeof(Table));
+    const std::size_t timestamp_bytes =
+        PairedTimestamps
+            ? 0
+            : align_up(sizeof(CacheAligned<Timestamp>) * num_timestamps);
+    const std::size_t bucket_bytes =
+        PairedTimestamps ? sizeof(Cell) * size : sizeof(Bucket) * size;
+    char *raw = static_cast<char *>(
+        Allocator::malloc(header_bytes + timestamp_bytes + bucket_bytes));
+    Table *table = new (raw) Table();
+    table->size = size;
+    table->size_mask = size - 1;
+    table->num_timestamps = num_timestamps;
+    table->timestamps =
+        reinterpret_cast<CacheAligned<Timestamp> *>(raw + header_bytes);
+    table->buckets =
+        reinterpret_cast<Bucket *>(raw + header_bytes + timestamp_bytes);
+    table->cells = reinterpret_cast<Cell *>(raw + header_bytes);
+    table->next.store(nullptr, std::memory_order_relaxed);
+    table->next_region.store(0, std::memory_order_relaxed);
 
-public:
-  RHSetKCAS(const std::size_t size, const std::size_t threads)
-      : m_size(nearest_power_of_two(size)), m_size_mask(m_size - 1),
-        m_timestamps(static_cast<CacheAligned<Timestamp> *>(
-            Allocator::malloc(sizeof(CacheAligned<Timestamp>) *
-                              nearest_power_of_two(threads << 7)))),
-        m_table(
-            static_cast<Bucket *>(Allocator::malloc(sizeof(Bucket) * m_size))),
-        m_reclaimer(threads, 4), m_kcas(threads, &m_reclaimer) {
-
-    std::size_t num_timestamps = nearest_power_of_two(threads << 7);
     const K null_key = KT::NullKey;
 
     std::uint8_t num_timestamp_bits = 0;
@@ -72,87 +149,134 @@ public:
          timestamp >>= 1, num_timestamp_bits++) {
     }
     std::uint8_t num_size_bits = 0;
-    for (std::size_t size = m_size; size > 0; size >>= 1, num_size_bits++) {
+    for (std::size_t size = table->size; size > 0;
+         size >>= 1, num_size_bits++) {
     }
     std::uint8_t timestamp_shift = num_size_bits - num_timestamp_bits;
-    m_timestamp_shift = timestamp_shift;
+    table->timestamp_shift = timestamp_shift;
 
-    for (std::size_t i = 0; i < m_size; i++) {
-      m_kcas.write_value(KT::NullKey, &m_table[i], null_key);
+    for (std::size_t i = 0; i < table->size; i++) {
+      m_kcas.write_value(0, bucket_at(table, i), null_key);
     }
     for (std::size_t i = 0; i < num_timestamps; i++) {
-      m_kcas.write_value(0, &m_timestamps[i], std::uintptr_t());
+      m_kcas.write_value(0, timestamp_at(table, i), std::uintptr_t());
     }
-  }
-  ~RHSetKCAS() {
-    Allocator::free(m_timestamps);
-    Allocator::free(m_table);
+    return table;
   }
 
-  bool thread_init(const std::size_t thread_id) { return true; }
-
-  bool contains(const K &key, const std::size_t thread_id) {
-
-    const std::size_t original_hash = KT::hash(key);
-    const std::size_t original_bucket = original_hash & m_size_mask;
-    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
-  loopBegin:
-    std::size_t timestamp_index = 0;
-    std::uintptr_t timestamps[S_MAX_TIMESTAMPS];
-    std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
+  Table *load_table(RecordHandle &handle) {
+    Table *table = m_table.load(std::memory_order_acquire);
+    while (!handle.try_protect(table, m_table)) {
+      table = m_table.load(std::memory_order_acquire);
+    }
+    return table;
+  }
 
-    for (std::size_t current_bucket = original_bucket, cur_dist = 0;;
-         current_bucket++, cur_dist++) {
-      current_bucket &= m_size_mask;
+  // Adds an increment of the region's timestamp unless the descriptor already
+  // has one. Shifts visit regions in order, so the last one bumped is enough.
+  void bump_timestamp(Descriptor *desc, Table *table, const std::size_t region,
+                      const std::uintptr_t timestamp,
+                      std::size_t &bumped_region) {
+    if (region != bumped_region) {
+      desc->add_value(timestamp_at(table, region), timestamp, timestamp + 1);
+      bumped_region = region;
+    }
+  }
 
-      const std::size_t current_timestamp_bucket =
-          current_bucket >> m_timestamp_shift;
+  bool should_grow(const Table *table) {
+    std::intptr_t count = 0;
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      count += m_thread_counts[t].load(std::memory_order_relaxed);
+    }
+    return count > std::intptr_t(table->size >> 1);
+  }
 
-      if (current_timestamp_bucket != last_timestamp_bucket) {
-        last_timestamp_bucket = current_timestamp_bucket;
-        timestamps[timestamp_index++] = m_kcas.read_value(
-            thread_id, pin, &m_timestamps[last_timestamp_bucket]);
+  // Freezes a region then copies its keys over. Every copy is guarded on the
+  // frozen timestamp so once a region is marked migrated a slow helper can no
+  // longer bring back keys removed from the next table.
+  void migrate_region(Table *table, Table *next, const std::size_t region,
+                      const std::size_t thread_id,
+                      ReclaimerPin<MemReclaimer> &pin) {
+    std::uintptr_t timestamp;
+    while (true) {
+      timestamp = m_kcas.read_value(thread_id, pin, timestamp_at(table, region));
+      if (timestamp & S_MIGRATED) {
+        return;
       }
-
-      const K current_key =
-          m_kcas.read_value(thread_id, pin, &m_table[current_bucket]);
-      if (current_key == KT::NullKey) {
-        goto counter_check;
+      if (timestamp & S_FROZEN) {
+        break;
       }
-      if (key == current_key) {
-        return true;
+      Descriptor *desc = m_kcas.create_descriptor(1, thread_id);
+      desc->add_value(timestamp_at(table, region), timestamp,
+                      timestamp | S_FROZEN);
+      if (m_kcas.cas(thread_id, pin, desc)) {
+        timestamp |= S_FROZEN;
+        break;
       }
-      const std::size_t original_bucket = KT::hash(current_key) & m_size_mask;
-      const std::size_t distance =
-          distance_from_slot(m_size, original_bucket, current_bucket);
-      if (distance < cur_dist) {
-        goto counter_check;
+    }
+    const std::size_t region_begin = region << table->timestamp_shift;
+    const std::size_t region_end = (region + 1) << table->timestamp_shift;
+    for (std::size_t i = region_begin; i < region_end; i++) {
+      const K bucket = m_kcas.read_value(thread_id, pin, bucket_at(table, i));
+      if (bucket == KT::NullKey) {
+        continue;
+      }
+      if (add_internal(next, PackedBucket::key(bucket), thread_id, pin, timestamp_at(table, region),
+                       timestamp) == AddResult::Resizing) {
+        // Someone else finished the region.
+        return;
       }
     }
-  counter_check:
-    last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
-    for (std::size_t current_bucket = original_bucket, check_index = 0;
-         check_index < timestamp_index; current_bucket++) {
-      current_bucket &= m_size_mask;
-      const std::size_t current_timestamp_bucket =
-          current_bucket >> m_timestamp_shift;
-      if (current_timestamp_bucket != last_timestamp_bucket) {
-        last_timestamp_bucket = current_timestamp_bucket;
-        if (timestamps[check_index++] !=
-            m_kcas.read_value(thread_id, pin,
-                              &m_timestamps[last_timestamp_bucket])) {
-          goto loopBegin;
-        }
+    Descriptor *desc = m_kcas.create_descriptor(1, thread_id);
+    desc->add_value(timestamp_at(table, region), timestamp,
+                    timestamp | S_MIGRATED);
+    m_kcas.cas(thread_id, pin, desc);
+  }
+
+  // Claims regions a chunk at a time, then helps any stragglers so a stalled
+  // thread cannot hold up the swap.
+  void help_resize(Table *table, const std::size_t thread_id,
+                   ReclaimerPin<MemReclaimer> &pin) {
+    Table *next = table->next.load(std::memory_order_acquire);
+    for (std::size_t region = table->next_region.fetch_add(1);
+         region < table->num_timestamps;
+         region = table->next_region.fetch_add(1)) {
+      migrate_region(table, next, region, thread_id, pin);
+    }
+    for (std::size_t region = 0; region < table->num_timestamps; region++) {
+      migrate_region(table, next, region, thread_id, pin);
+    }
+    Table *expected = table;
+    if (m_table.compare_exchange_strong(expected, next)) {
+      RecordHandle handle = pin.get_rec();
+      handle.set(table);
+      pin.retire(handle);
+    }
+  }
+
+  void start_resize(Table *table, const std::size_t thread_id,
+                    ReclaimerPin<MemReclaimer> &pin) {
+    if (table->next.load(std::memory_order_acquire) == nullptr) {
+      Table *next = create_table(table->size << 1);
+      Table *expected = nullptr;
+      if (!table->next.compare_exchange_strong(expected, next)) {
+        Allocator::free(next);
       }
     }
-    return false;
+    help_resize(table, thread_id, pin);
   }
 
-  bool add(const K &key, const std::size_t thread_id) {
+  // Inserts a key into the given table. Migration passes the frozen timestamp
+  // of the region being copied as a guard, user inserts pass nullptr.
+  AddResult add_internal(Table *table, const K &key,
+                         const std::size_t thread_id,
+                         ReclaimerPin<MemReclaimer> &pin,
+                         Timestamp *guard = nullptr,
+                         const std::uintptr_t guard_timestamp = 0) {
 
     const std::size_t original_hash = KT::hash(key);
-    const std::size_t original_bucket = original_hash & m_size_mask;
-    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    const std::size_t original_bucket = original_hash & table->size_mask;
+    assert(key < PackedBucket::S_KEY_MASK);
   loopBegin:
     K active_key = key;
     std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
@@ -161,164 +285,448 @@ public:
         std::numeric_limits<std::uintptr_t>::max();
     Descriptor *desc = m_kcas.create_descriptor(S_MAX_KCAS, thread_id);
 
-    for (std::size_t current_bucket = original_bucket, active_dist = 0;;
-         current_bucket++, active_dist++) {
-      current_bucket &= m_size_mask;
+    for (std::size_t current_bucket = original_bucket, active_dist = 0,
+                     probe_length = 0;
+         ; current_bucket++, active_dist++, probe_length++) {
+      current_bucket &= table->size_mask;
       const std::size_t current_timestamp_bucket =
-          current_bucket >> m_timestamp_shift;
+          current_bucket >> table->timestamp_shift;
       if (current_timestamp_bucket != last_timestamp_bucket) {
+        // A region probed but not written is checked unchanged by the same
+        // K-CAS, else a remove could shift the key back past the probe.
+        if (last_timestamp_bucket != std::numeric_limits<std::size_t>::max() and
+            !inced_active) {
+          desc->add_value(timestamp_at(table, last_timestamp_bucket),
+                          active_timestamp, active_timestamp);
+        }
         last_timestamp_bucket = current_timestamp_bucket;
         active_timestamp = m_kcas.read_value(
-            thread_id, pin, &m_timestamps[last_timestamp_bucket]);
+            thread_id, pin, timestamp_at(table, last_timestamp_bucket));
         inced_active = false;
+        // A late migration copy can find the next table already resizing,
+        // in which case its own region has long been migrated.
+        if (active_timestamp & S_FROZEN) {
+          m_kcas.free_descriptor(desc);
+          return AddResult::Resizing;
+        }
+      }
+      if (guard == nullptr and probe_length == S_RESIZE_PROBE and
+          should_grow(table)) {
+        m_kcas.free_descriptor(desc);
+        start_resize(table, thread_id, pin);
+        return AddResult::Resizing;
       }
       const K current_key =
-          m_kcas.read_value(thread_id, pin, &m_table[current_bucket]);
+          m_kcas.read_value(thread_id, pin, bucket_at(table, current_bucket));
       if (current_key == KT::NullKey) { // Found an empty slot
-        desc->add_value(&m_table[current_bucket], current_key, active_key);
+        desc->add_value(bucket_at(table, current_bucket), current_key,
+                        PackedBucket::pack(active_key, active_dist));
         if (!inced_active) {
-          desc->add_value(&m_timestamps[last_timestamp_bucket],
+          desc->add_value(timestamp_at(table, last_timestamp_bucket),
                           active_timestamp, active_timestamp + 1);
           inced_active = true;
         }
+        if (guard != nullptr) {
+          desc->add_value(guard, guard_timestamp, guard_timestamp);
+        }
         bool result = m_kcas.cas(thread_id, pin, desc);
         if (!result) {
+          m_contention.failed(thread_id, m_kcas.helps(thread_id));
+          if (guard != nullptr and
+              m_kcas.read_value(thread_id, pin, guard) != guard_timestamp) {
+            return AddResult::Resizing;
+          }
           goto loopBegin;
         }
-        return true;
+        m_contention.succeeded(thread_id, m_kcas.helps(thread_id));
+        return AddResult::Added;
       }
 
-      if (current_key == key) {
+      if (PackedBucket::key(current_key) == key) {
         m_kcas.free_descriptor(desc);
-        return false;
+        return AddResult::Present;
       }
 
       // Concurrent addition moved our stuff.
-      if (current_key == active_key) {
+      if (PackedBucket::key(current_key) == active_key) {
         m_kcas.free_descriptor(desc);
         goto loopBegin;
       }
 
-      const std::size_t original_bucket = KT::hash(current_key) & m_size_mask;
       const std::size_t current_dist =
-          distance_from_slot(m_size, original_bucket, current_bucket);
+          PackedBucket::distance(current_key, table->size, current_bucket);
       // SWAP!
       if (current_dist < active_dist) {
-        desc->add_value(&m_table[current_bucket], current_key, active_key);
+        desc->add_value(bucket_at(table, current_bucket), current_key,
+                        PackedBucket::pack(active_key, active_dist));
         if (!inced_active) {
-          desc->add_value(&m_timestamps[last_timestamp_bucket],
+          desc->add_value(timestamp_at(table, last_timestamp_bucket),
                           active_timestamp, active_timestamp + 1);
           inced_active = true;
         }
-        active_key = current_key;
+        active_key = PackedBucket::key(current_key);
         active_dist = current_dist;
       }
     }
   }
 
+  bool contains_internal(const K &key, const std::size_t original_hash,
+                         const std::size_t thread_id,
+                         ReclaimerPin<MemReclaimer> &pin,
+                         RecordHandle &table_handle) {
+    TimestampReads timestamps;
+  loopBegin:
+    Table *table = load_table(table_handle);
+    const std::size_t original_bucket = original_hash & table->size_mask;
+    timestamps.clear();
+    std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
+
+    for (std::size_t current_bucket = original_bucket, cur_dist = 0;;
+         current_bucket++, cur_dist++) {
+      current_bucket &= table->size_mask;
+
+      const std::size_t current_timestamp_bucket =
+          current_bucket >> table->timestamp_shift;
+
+      if (current_timestamp_bucket != last_timestamp_bucket) {
+        last_timestamp_bucket = current_timestamp_bucket;
+        m_kcas.record_value(thread_id, pin,
+                            timestamp_at(table, last_timestamp_bucket),
+                            timestamps);
+      }
+
+      const K current_key =
+          m_kcas.read_value(thread_id, pin, bucket_at(table, current_bucket));
+      if (current_key == KT::NullKey) {
+        goto counter_check;
+      }
+      if (key == PackedBucket::key(current_key)) {
+        // Only trust the old table if it was still current.
+        if (m_table.load() != table) {
+          goto loopBegin;
+        }
+        return true;
+      }
+      const std::size_t distance =
+          PackedBucket::distance(current_key, table->size, current_bucket);
+      if (distance < cur_dist) {
+        goto counter_check;
+      }
+    }
+  counter_check:
+    if (!m_kcas.validate(thread_id, pin, timestamps)) {
+      goto loopBegin;
+    }
+    if (m_table.load() != table) {
+      goto loopBegin;
+    }
+    return false;
+  }
+
+  // Drives one probe per slot for interleave_lookups, a cache line per step.
+  // All lookups of a call probe the table current when it began. Any that
+  // sees the table change, or spans more regions than it can remember, is
+  // finished by contains_internal instead.
+  class Lookup {
+  public:
+    struct State {
+      K key;
+      std::size_t hash, bucket, distance, num_regions;
+      std::size_t regions[S_INTERLEAVE_TIMESTAMPS];
+      std::uintptr_t timestamps[S_INTERLEAVE_TIMESTAMPS];
+      State(Lookup &lookup) {}
+    };
+
+  private:
+    RHSetKCAS *m_set;
+    const std::size_t m_thread_id;
+    ReclaimerPin<MemReclaimer> &m_pin;
+    RecordHandle m_table_handle, m_retry_handle;
+    Table *m_table;
+
+    void restart(State &state) {
+      state.bucket = state.hash & m_table->size_mask;
+      state.distance = 0;
+      state.num_regions = 0;
+      prefetch(bucket_at(m_table, state.bucket));
+      prefetch(timestamp_at(m_table, state.bucket >> m_table->timestamp_shift));
+    }
+
+    bool hand_over(State &state, bool &found) {
+      found = m_set->contains_internal(state.key, state.hash, m_thread_id,
+                                       m_pin, m_retry_handle);
+      return true;
+    }
+
+    bool validate(State &state, bool &found) {
+      for (std::size_t i = 0; i < state.num_regions; i++) {
+        if (state.timestamps[i] !=
+            m_set->m_kcas.read_value(m_thread_id, m_pin,
+                                     timestamp_at(m_table, state.regions[i]))) {
+          restart(state);
+          return false;
+        }
+      }
+      if (m_set->m_table.load() != m_table) {
+        return hand_over(state, found);
+      }
+      found = false;
+      return true;
+    }
+
+  public:
+    Lookup(RHSetKCAS *set, const std::size_t thread_id,
+           ReclaimerPin<MemReclaimer> &pin)
+        : m_set(set), m_thread_id(thread_id), m_pin(pin),
+          m_table_handle(pin.get_rec()), m_retry_handle(pin.get_rec()),
+          m_table(set->load_table(m_table_handle)) {}
+
+    void start(State &state, const K &key) {
+      state.key = key;
+      state.hash = KT::hash(key);
+      restart(state);
+    }
+
+    bool step(State &state, bool &found) {
+      while (true) {
+        const std::size_t region = state.bucket >> m_table->timestamp_shift;
+        if (state.num_regions == 0 or
+            state.regions[state.num_regions - 1] != region) {
+          if (state.num_regions == S_INTERLEAVE_TIMESTAMPS) {
+            return hand_over(state, found);
+          }
+          state.regions[state.num_regions] = region;
+          state.timestamps[state.num_regions++] = m_set->m_kcas.read_value(
+              m_thread_id, m_pin, timestamp_at(m_table, region));
+        }
+        const K current_key = m_set->m_kcas.read_value(
+            m_thread_id, m_pin, bucket_at(m_table, state.bucket));
+        if (current_key == KT::NullKey) {
+          return validate(state, found);
+        }
+        if (state.key == PackedBucket::key(current_key)) {
+          if (m_set->m_table.load() != m_table) {
+            return hand_over(state, found);
+          }
+          found = true;
+          return true;
+        }
+        if (PackedBucket::distance(current_key, m_table->size, state.bucket) <
+            state.distance) {
+          return validate(state, found);
+        }
+        state.bucket = (state.bucket + 1) & m_table->size_mask;
+        state.distance++;
+        if (starts_cache_line(bucket_at(m_table, state.bucket))) {
+          prefetch(bucket_at(m_table, state.bucket));
+          return false;
+        }
+      }
+    }
+  };
+
+public:
+  RHSetKCAS(const std::size_t size, const std::size_t threads)
+      : m_num_threads(threads),
+        m_num_timestamps(nearest_power_of_two(threads << 7)),
+        m_thread_counts(static_cast<CacheAligned<std::atomic<std::intptr_t>> *>(
+            Allocator::malloc(sizeof(CacheAligned<std::atomic<std::intptr_t>>) *
+                              threads))),
+        m_reclaimer(threads, 4), m_kcas(threads, &m_reclaimer),
+        m_contention(threads) {
+    for (std::size_t t = 0; t < threads; t++) {
+      m_thread_counts[t].store(0, std::memory_order_relaxed);
+    }
+    m_table.store(create_table(nearest_power_of_two(size)));
+  }
+  ~RHSetKCAS() {
+    Allocator::free(m_table.load());
+    Allocator::free(m_thread_counts);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  KCASStats kcas_stats() const { return m_kcas.stats(); }
+
+  ContentionStats contention_stats() const { return m_contention.stats(); }
+
+  std::size_t size() { return m_table.load()->size; }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle table_handle = pin.get_rec();
+    return contains_internal(key, KT::hash(key), thread_id, pin,
+                             table_handle);
+  }
+
+  // Looks up a batch of keys under one pin, prefetching each chunk's home
+  // buckets and timestamps before probing.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle table_handle = pin.get_rec();
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      Table *table = load_table(table_handle);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        const std::size_t bucket = hashes[i] & table->size_mask;
+        prefetch(bucket_at(table, bucket));
+        prefetch(timestamp_at(table, bucket >> table->timestamp_shift));
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i], thread_id,
+                                          pin, table_handle);
+      }
+    }
+  }
+
+  // Probes up to S_INTERLEAVE_WIDTH keys at once, switching to another probe
+  // whenever one moves onto a new cache line.
+  void contains_interleaved(const K *keys, const std::size_t n, bool *out,
+                            const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    Lookup lookup(this, thread_id, pin);
+    interleave_lookups<S_INTERLEAVE_WIDTH>(lookup, keys, n, out);
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle table_handle = pin.get_rec();
+    m_contention.begin(thread_id, m_kcas.helps(thread_id));
+    while (true) {
+      Table *table = load_table(table_handle);
+      if (table->next.load(std::memory_order_acquire) != nullptr) {
+        help_resize(table, thread_id, pin);
+        continue;
+      }
+      switch (add_internal(table, key, thread_id, pin)) {
+      case AddResult::Added:
+        m_thread_counts[thread_id].fetch_add(1, std::memory_order_relaxed);
+        return true;
+      case AddResult::Present:
+        // Only trust the old table if it was still current.
+        if (m_table.load() != table) {
+          continue;
+        }
+        return false;
+      case AddResult::Resizing:
+        continue;
+      }
+    }
+  }
+
   bool remove(const K &key, const std::size_t thread_id) {
 
     const std::size_t original_hash = KT::hash(key);
-    const std::size_t original_bucket = original_hash & m_size_mask;
     ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle table_handle = pin.get_rec();
+    m_contention.begin(thread_id, m_kcas.helps(thread_id));
+    TimestampReads timestamps;
   loopBegin:
-    std::size_t timestamp_index = 0;
-    std::uintptr_t timestamps[S_MAX_TIMESTAMPS];
+    Table *table = load_table(table_handle);
+    if (table->next.load(std::memory_order_acquire) != nullptr) {
+      help_resize(table, thread_id, pin);
+      goto loopBegin;
+    }
+    const std::size_t original_bucket = original_hash & table->size_mask;
+    timestamps.clear();
     std::size_t last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
     Descriptor *desc = m_kcas.create_descriptor(S_MAX_KCAS, thread_id);
 
     for (std::size_t current_bucket = original_bucket, active_dist = 0;;
          current_bucket++, active_dist++) {
-      current_bucket &= m_size_mask;
+      current_bucket &= table->size_mask;
       const std::size_t current_timestamp_bucket =
-          current_bucket >> m_timestamp_shift;
+          current_bucket >> table->timestamp_shift;
       if (current_timestamp_bucket != last_timestamp_bucket) {
         last_timestamp_bucket = current_timestamp_bucket;
-        timestamps[timestamp_index++] = m_kcas.read_value(
-            thread_id, pin, &m_timestamps[last_timestamp_bucket]);
+        if (m_kcas.record_value(thread_id, pin,
+                                timestamp_at(table, last_timestamp_bucket),
+                                timestamps) &
+            S_FROZEN) {
+          m_kcas.free_descriptor(desc);
+          help_resize(table, thread_id, pin);
+          goto loopBegin;
+        }
       }
 
       const K current_key =
-          m_kcas.read_value(thread_id, pin, &m_table[current_bucket]);
+          m_kcas.read_value(thread_id, pin, bucket_at(table, current_bucket));
       if (current_key == KT::NullKey) {
         goto counter_check;
       }
 
-      if (current_key == key) {
-        bool inced_active = false;
+      if (PackedBucket::key(current_key) == key) {
+        // Every region written to is bumped, as is the region of the bucket
+        // ending the shift so no insert can land there unseen.
         std::size_t dest_bucket = current_bucket;
         K dest_key = current_key;
-        std::uintptr_t dest_timestamp = timestamps[timestamp_index - 1];
-        std::size_t dest_timestamp_bucket =
-            std::numeric_limits<std::size_t>::max();
+        std::size_t dest_region = dest_bucket >> table->timestamp_shift;
+        std::uintptr_t dest_timestamp = timestamps.back().value;
+        std::size_t shuffle_region = dest_region;
+        std::uintptr_t shuffle_timestamp = dest_timestamp;
+        std::size_t bumped_region = std::numeric_limits<std::size_t>::max();
         for (std::size_t shuffle_bucket = dest_bucket + 1;; shuffle_bucket++) {
-          shuffle_bucket &= m_size_mask;
-          const std::size_t shuffle_timestamp_bucket =
-              shuffle_bucket >> m_timestamp_shift;
-          if (dest_timestamp_bucket != shuffle_timestamp_bucket) {
-            dest_timestamp_bucket = shuffle_timestamp_bucket;
-            dest_timestamp = m_kcas.read_value(
-                thread_id, pin, &m_timestamps[dest_timestamp_bucket]);
-            inced_active = false;
+          shuffle_bucket &= table->size_mask;
+          if ((shuffle_bucket >> table->timestamp_shift) != shuffle_region) {
+            shuffle_region = shuffle_bucket >> table->timestamp_shift;
+            shuffle_timestamp = m_kcas.read_value(
+                thread_id, pin, timestamp_at(table, shuffle_region));
+            if (shuffle_timestamp & S_FROZEN) {
+              m_kcas.free_descriptor(desc);
+              help_resize(table, thread_id, pin);
+              goto loopBegin;
+            }
           }
 
-          const K shuffle_key =
-              m_kcas.read_value(thread_id, pin, &m_table[shuffle_bucket]);
+          const K shuffle_key = m_kcas.read_value(
+              thread_id, pin, bucket_at(table, shuffle_bucket));
           if (shuffle_key == KT::NullKey) {
             break;
           }
-          const std::size_t shuffle_idx = KT::hash(shuffle_key) & m_size_mask;
           const std::size_t shuffle_dist =
-              distance_from_slot(m_size, shuffle_idx, shuffle_bucket);
+              PackedBucket::distance(shuffle_key, table->size, shuffle_bucket);
           if (shuffle_dist == 0) {
             break;
           }
-          desc->add_value(&m_table[dest_bucket], dest_key, shuffle_key);
-          if (!inced_active) {
-            desc->add_value(&m_timestamps[dest_timestamp_bucket],
-                            dest_timestamp, dest_timestamp + 1);
-            inced_active = true;
-          }
+          desc->add_value(
+              bucket_at(table, dest_bucket), dest_key,
+              PackedBucket::pack(PackedBucket::key(shuffle_key),
+                                 shuffle_dist - 1));
+          bump_timestamp(desc, table, dest_region, dest_timestamp,
+                         bumped_region);
 
           dest_key = shuffle_key;
           dest_bucket = shuffle_bucket;
-        }
-        if (!inced_active) {
-          desc->add_value(&m_timestamps[dest_timestamp_bucket], dest_timestamp,
-                          dest_timestamp + 1);
-          inced_active = true;
+          dest_region = shuffle_region;
+          dest_timestamp = shuffle_timestamp;
         }
         const K null_key = KT::NullKey;
-        desc->add_value(&m_table[dest_bucket], dest_key, null_key);
+        desc->add_value(bucket_at(table, dest_bucket), dest_key, null_key);
+        bump_timestamp(desc, table, dest_region, dest_timestamp, bumped_region);
+        bump_timestamp(desc, table, shuffle_region, shuffle_timestamp,
+                       bumped_region);
         bool result = m_kcas.cas(thread_id, pin, desc);
         if (!result) {
+          m_contention.failed(thread_id, m_kcas.helps(thread_id));
           goto loopBegin;
         }
+        m_contention.succeeded(thread_id, m_kcas.helps(thread_id));
+        m_thread_counts[thread_id].fetch_sub(1, std::memory_order_relaxed);
         return true;
       }
-      const std::size_t original_idx = KT::hash(current_key) & m_size_mask;
       const std::size_t current_dist =
-          distance_from_slot(m_size, original_idx, current_bucket);
+          PackedBucket::distance(current_key, table->size, current_bucket);
       if (current_dist < active_dist) {
         goto counter_check;
       }
     }
   counter_check:
     m_kcas.free_descriptor(desc);
-    last_timestamp_bucket = std::numeric_limits<std::size_t>::max();
-    for (std::size_t current_bucket = original_bucket, check_index = 0;
-         check_index < timestamp_index; current_bucket++) {
-      current_bucket &= m_size_mask;
-      const std::size_t current_timestamp_bucket =
-          current_bucket >> m_timestamp_shift;
-      if (current_timestamp_bucket != last_timestamp_bucket) {
-        last_timestamp_bucket = current_timestamp_bucket;
-        if (timestamps[check_index++] !=
-            m_kcas.read_value(thread_id, pin,
-                              &m_timestamps[last_timestamp_bucket])) {
-          goto loopBegin;
-        }
-      }
+    if (!m_kcas.validate(thread_id, pin, timestamps)) {
+      goto loopBegin;
     }
     return false;
   }
@@ -329,4 +737,16 @@ using RHSetHarrisKCAS = RHSetKCAS<Allocator, Reclaimer, HarrisKCAS, K>;
 
 template <class Allocator, template <class> class Reclaimer, class K>
 using RHSetBrownKCAS = RHSetKCAS<Allocator, Reclaimer, BrownKCAS, K>;
+
+template <class Allocator, template <class> class Reclaimer, class K>
+using RHSetPairedBrownKCAS =
+    RHSetKCAS<Allocator, Reclaimer, BrownKCAS, K, KeyTraits<K>, true>;
+
+// Brown K-CAS sets retrying under the given contention manager.
+template <class ContentionManager, bool PairedTimestamps = false>
+struct RHSetBrownKCASWith {
+  template <class Allocator, template <class> class Reclaimer, class K>
+  using Set = RHSetKCAS<Allocator, Reclaimer, BrownKCAS, K, KeyTraits<K>,
+                        PairedTimestamps, ContentionManager>;
+};
 }
@@ -36,6 +36,7 @@
 #include "hash_table_common.h"
 #include "math.h"
 #include "primitives/locks.h"
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <limits.h>
@@ -49,10 +50,19 @@
 
 namespace concurrent_data_structures {
 
+// Adds that find no free bucket within _INSERT_RANGE of their home grow the
+// table by _RESIZE_FACTOR. Growing locks every segment in order, so no update
+// is in flight, and rebuilds the neighbourhoods in a new table that is then
+// published through m_table. Lookups stay lock-free: they read the table
+// once per attempt and retry if it was replaced. A replaced table no longer
+// changes, but a lookup may still be walking it, so it is kept until the set
+// is destroyed.
 template <class Allocator, template <class> class Reclaimer, class Lock,
           class K, class KT = KeyTraits<K>>
 class HopscotchHashSet {
   static const std::int32_t _NULL_DELTA = INT_MIN;
+  // Free buckets have a zero hash, so stored hashes always have this set.
+  static const std::size_t _OCCUPIED_HASH = std::size_t(1) << 63;
 
 private:
   // Inner Classes ............................................................
@@ -79,6 +89,15 @@ private:
     }
   };
 
+  // One size of the table. Lookups reach everything through one pointer, so
+  // the mask, shift and buckets they use always belong together.
+  struct Table {
+    std::size_t size_mask;
+    std::uint32_t segment_shift;
+    Bucket *buckets;
+    Table *previous;
+  };
+
   inline int first_msb_bit_indx(std::uint32_t x) {
     if (0 == x)
       return -1;
@@ -86,10 +105,9 @@ private:
   }
 
   // Fields ...................................................................
-  std::size_t m_size_mask;
-  std::uint32_t m_segment_shift;
+  std::uint32_t m_num_segments;
   CacheAligned<Segment> *volatile _segments;
-  Bucket *volatile _table;
+  std::atomic<Table *> m_table;
 
   const int _cache_mask;
   const bool _is_cacheline_alignment;
@@ -101,8 +119,40 @@ private:
   static const std::uint32_t _RESIZE_FACTOR = 2;
 
   // Small Utilities ..........................................................
-  Bucket *get_start_cacheline_bucket(Bucket *const bucket) {
-    return (bucket - ((bucket - _table) & _cache_mask)); // can optimize
+  static std::size_t stored_hash(const unsigned int hash) {
+    return std::size_t(hash) | _OCCUPIED_HASH;
+  }
+
+  static std::size_t num_buckets(const Table *table) {
+    return table->size_mask + _INSERT_RANGE + 2;
+  }
+
+  Segment &segment_of(const Table *table, const unsigned int hash) {
+    return _segments[(hash & table->size_mask) >> table->segment_shift];
+  }
+
+  Bucket *get_start_cacheline_bucket(const Table *table,
+                                     Bucket *const bucket) {
+    return (bucket - ((bucket - table->buckets) & _cache_mask)); // can optimize
+  }
+
+  Table *create_table(const std::size_t size) {
+    Table *table = static_cast<Table *>(Allocator::malloc(sizeof(Table)));
+    table->size_mask = size - 1;
+    table->segment_shift =
+        __builtin_ctzll(size) - __builtin_ctzll(m_num_segments);
+    table->previous = nullptr;
+    table->buckets = static_cast<Bucket *>(
+        Allocator::malloc(sizeof(Bucket) * num_buckets(table)));
+    for (std::size_t i = 0; i < num_buckets(table); ++i) {
+      table->buckets[i].init();
+    }
+    return table;
+  }
+
+  void destroy_table(Table *table) {
+    Allocator::free(table->buckets);
+    Allocator::free(table);
   }
 
   void remove_key(Segment &segment, Bucket *const from_bucket,
@@ -181,9 +231,10 @@ private:
                                      std::memory_order_relaxed);
   }
 
-  void optimize_cacheline_use(Segment &segment, Bucket *const free_bucket) {
+  void optimize_cacheline_use(const Table *table, Segment &segment,
+                              Bucket *const free_bucket) {
     Bucket *const start_cacheline_bucket =
-        get_start_cacheline_bucket(free_bucket);
+        get_start_cacheline_bucket(table, free_bucket);
     Bucket *const end_cacheline_bucket(start_cacheline_bucket + _cache_mask);
     Bucket *opt_bucket = start_cacheline_bucket;
 
@@ -244,74 +295,16 @@ private:
     } while (opt_bucket <= end_cacheline_bucket);
   }
 
-public
-    : // Ctors ................................................................
-  HopscotchHashSet(
-      std::uint32_t inCapacity = 32 * 1024, // init capacity
-      std::uint32_t concurrencyLevel =
-          std::thread::hardware_concurrency(), // num of updating threads
-      std::uint32_t cache_line_size = 64,      // Cache-line size of machine
-      bool is_optimize_cacheline = true)
-      : _cache_mask((cache_line_size / sizeof(Bucket)) - 1),
-        _is_cacheline_alignment(is_optimize_cacheline) {
-    concurrencyLevel = nearest_power_of_two(concurrencyLevel);
-
-    std::size_t num_timestamps = concurrencyLevel;
-
-    std::uint8_t num_timestamp_bits = 0;
-    for (std::size_t timestamp = num_timestamps; timestamp > 0;
-         timestamp >>= 1, num_timestamp_bits++) {
-    }
-    std::uint8_t num_size_bits = 0;
-    for (std::size_t size = inCapacity; size > 0; size >>= 1, num_size_bits++) {
-    }
-    std::uint8_t timestamp_shift = num_size_bits - num_timestamp_bits;
-    m_segment_shift = timestamp_shift;
-
-    // ADJUST INPUT ............................
-    const std::uint32_t adjInitCap = (inCapacity);
-    m_size_mask = inCapacity - 1;
-    //    const std::uint32_t adjConcurrencyLevel =
-    //        NearestPowerOfTwo(concurrencyLevel);
-    const std::uint32_t num_buckets(adjInitCap + _INSERT_RANGE + 1);
-    // ALLOCATE THE SEGMENTS ...................
-    _segments = static_cast<CacheAligned<Segment> *>(
-        Allocator::malloc(sizeof(CacheAligned<Segment>) * concurrencyLevel));
-    _table =
-        static_cast<Bucket *>(Allocator::malloc(sizeof(Bucket) * num_buckets));
-
-    CacheAligned<Segment> *curr_seg = _segments;
-    for (std::uint32_t iSeg = 0; iSeg < concurrencyLevel; ++iSeg, ++curr_seg) {
-      curr_seg->init();
-    }
-
-    Bucket *curr_bucket = _table;
-    for (std::uint32_t iElm = 0; iElm < num_buckets; ++iElm, ++curr_bucket) {
-      curr_bucket->init();
-    }
-  }
-
-  ~HopscotchHashSet() {
-    Allocator::free(_table);
-    Allocator::free(_segments);
-  }
-
-  bool thread_init(const std::size_t thread_id) { return true; }
-
-  // Query Operations .........................................................
-  bool contains(const K &key, const std::size_t thread_id) {
-
-    // CALCULATE HASH ..........................
-    const unsigned int hash(KT::hash(key));
-
-    // CHECK IF ALREADY CONTAIN ................
-    const Segment &segment(_segments[(hash & m_size_mask) >> m_segment_shift]);
-
+  bool contains_internal(const K &key, const unsigned int hash) {
     // go over the list and look for key
+    const Table *table;
+    const Segment *segment;
     unsigned int start_timestamp;
     do {
-      start_timestamp = segment._timestamp;
-      const Bucket *curr_bucket(&(_table[hash & m_size_mask]));
+      table = m_table.load(std::memory_order_acquire);
+      segment = &segment_of(table, hash);
+      start_timestamp = segment->_timestamp;
+      const Bucket *curr_bucket(&(table->buckets[hash & table->size_mask]));
       std::int32_t next_delta(
           curr_bucket->_first_delta.load(std::memory_order_relaxed));
       while (_NULL_DELTA != next_delta) {
@@ -321,45 +314,63 @@ public
         }
         next_delta = curr_bucket->_next_delta;
       }
-    } while (start_timestamp != segment._timestamp);
+    } while (start_timestamp != segment->_timestamp or
+             table != m_table.load(std::memory_order_acquire));
     return false;
   }
 
-  // modification Operations ...................................................
-  inline bool add(const K &key, const std::size_t thread_id) {
-    const unsigned int hash(KT::hash(key));
-    //    Segment &segment(_segments[(hash & m_size_mask) >> m_segment_shift]);
-
-    // go over the list and look for key
-    std::lock_guard<Lock> guard(
-        this->_segments[(hash & m_size_mask) >> m_segment_shift]._lock);
-    Bucket *const start_bucket(&(_table[hash & m_size_mask]));
+  // Locks the home segment of the current table, which cannot be replaced
+  // while it is held.
+  Table *lock_home(const unsigned int hash, std::unique_lock<Lock> &guard) {
+    while (true) {
+      Table *const table = m_table.load(std::memory_order_acquire);
+      guard = std::unique_lock<Lock>(segment_of(table, hash)._lock);
+      if (table == m_table.load(std::memory_order_relaxed)) {
+        return table;
+      }
+      guard.unlock();
+    }
+  }
 
-    Bucket *last_bucket(NULL);
+  // Walks the home bucket's list for the key, leaving last_bucket at the end
+  // of the list.
+  bool find_key(Bucket *const start_bucket, const unsigned int hash,
+                const K &key, Bucket *&last_bucket) {
+    last_bucket = NULL;
     Bucket *compare_bucket = start_bucket;
     std::int32_t next_delta(
         compare_bucket->_first_delta.load(std::memory_order_relaxed));
     while (_NULL_DELTA != next_delta) {
       compare_bucket += next_delta;
-      if (hash == compare_bucket->_hash.load(std::memory_order_acquire) &&
+      if (stored_hash(hash) ==
+              compare_bucket->_hash.load(std::memory_order_acquire) &&
           key == compare_bucket->_key.load(std::memory_order_relaxed)) {
-        return false;
+        return true;
       }
       last_bucket = compare_bucket;
       next_delta = compare_bucket->_next_delta.load(std::memory_order_relaxed);
     }
+    return false;
+  }
 
+  // Links a key that is not in the table into its home bucket's list, in the
+  // home cache line if it has a free bucket, else in the nearest free bucket
+  // within _INSERT_RANGE. Returns false if there is none.
+  bool insert_key(Table *const table, Bucket *const start_bucket,
+                  const unsigned int hash, const K &key,
+                  Bucket *const last_bucket) {
     // try to place the key in the same cache-line
     if (_is_cacheline_alignment) {
       Bucket *free_bucket = start_bucket;
-      Bucket *start_cacheline_bucket = get_start_cacheline_bucket(start_bucket);
+      Bucket *start_cacheline_bucket =
+          get_start_cacheline_bucket(table, start_bucket);
       Bucket *end_cacheline_bucket(start_cacheline_bucket + _cache_mask);
       do {
         std::size_t cur_hash =
             free_bucket->_hash.load(std::memory_order_acquire);
         if (0 == cur_hash) {
           if (!free_bucket->_hash.compare_exchange_weak(
-                  cur_hash, hash, std::memory_order_acquire,
+                  cur_hash, stored_hash(hash), std::memory_order_acquire,
                   std::memory_order_acquire)) {
             continue;
           }
@@ -373,8 +384,8 @@ public
     }
 
     // place key in arbitrary free forward bucket
-    Bucket *max_bucket(start_bucket + (INT_MAX - 1));
-    Bucket *last_table_bucket(_table + m_size_mask);
+    Bucket *max_bucket(start_bucket + _INSERT_RANGE);
+    Bucket *last_table_bucket(table->buckets + num_buckets(table) - 1);
     if (max_bucket > last_table_bucket)
       max_bucket = last_table_bucket;
     Bucket *free_max_bucket(start_bucket + (_cache_mask + 1));
@@ -383,7 +394,7 @@ public
           free_max_bucket->_hash.load(std::memory_order_acquire);
       if (0 == cur_hash) {
         if (!free_max_bucket->_hash.compare_exchange_weak(
-                cur_hash, hash, std::memory_order_acquire,
+                cur_hash, stored_hash(hash), std::memory_order_acquire,
                 std::memory_order_acquire)) {
           continue;
         }
@@ -394,16 +405,16 @@ public
     }
 
     // place key in arbitrary free backward bucket
-    Bucket *min_bucket(start_bucket - (INT_MAX - 1));
-    if (min_bucket < _table)
-      min_bucket = _table;
+    Bucket *min_bucket(table->buckets);
+    if (start_bucket - min_bucket > std::ptrdiff_t(_INSERT_RANGE))
+      min_bucket = start_bucket - _INSERT_RANGE;
     Bucket *free_min_bucket(start_bucket - (_cache_mask + 1));
     while (free_min_bucket >= min_bucket) {
       std::size_t cur_hash =
           free_min_bucket->_hash.load(std::memory_order_relaxed);
       if (0 == cur_hash) {
         if (!free_min_bucket->_hash.compare_exchange_weak(
-                cur_hash, hash, std::memory_order_acquire,
+                cur_hash, stored_hash(hash), std::memory_order_acquire,
                 std::memory_order_acquire)) {
           continue;
         }
@@ -412,21 +423,149 @@ public
       }
       --free_min_bucket;
     }
-
-    // NEED TO RESIZE ..........................
-    fprintf(stderr, "ERROR - RESIZE is not implemented - size %u\n", size());
-    exit(1);
     return false;
   }
 
+  // Rebuilds the neighbourhoods of every key in a table of the given size,
+  // or returns NULL if they do not all fit. Every segment must be locked.
+  Table *rebuild(Table *const table, const std::size_t size) {
+    Table *next = create_table(size);
+    for (std::size_t i = 0; i < num_buckets(table); ++i) {
+      if (0 == table->buckets[i]._hash.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      const K key = table->buckets[i]._key.load(std::memory_order_relaxed);
+      const unsigned int hash(KT::hash(key));
+      Bucket *const start_bucket = &next->buckets[hash & next->size_mask];
+      Bucket *last_bucket;
+      find_key(start_bucket, hash, key, last_bucket);
+      if (!insert_key(next, start_bucket, hash, key, last_bucket)) {
+        destroy_table(next);
+        return NULL;
+      }
+    }
+    return next;
+  }
+
+  // Locks every segment in order and replaces the table with one of the
+  // given size, unless another thread replaced it first. Growing doubles
+  // the size again until every key fits, otherwise sizes too small to hold
+  // the keys are ignored.
+  void resize_table(Table *const table, std::size_t size, const bool growing) {
+    for (std::uint32_t iSeg = 0; iSeg < m_num_segments; ++iSeg) {
+      _segments[iSeg]._lock.lock();
+    }
+    if (table == m_table.load(std::memory_order_relaxed)) {
+      Table *next = rebuild(table, size);
+      while (NULL == next && growing) {
+        size *= _RESIZE_FACTOR;
+        next = rebuild(table, size);
+      }
+      if (NULL != next) {
+        next->previous = table;
+        m_table.store(next, std::memory_order_release);
+      }
+    }
+    for (std::uint32_t iSeg = m_num_segments; iSeg > 0; --iSeg) {
+      _segments[iSeg - 1]._lock.unlock();
+    }
+  }
+
+public
+    : // Ctors ................................................................
+  HopscotchHashSet(
+      std::uint32_t inCapacity = 32 * 1024, // init capacity
+      std::uint32_t concurrencyLevel =
+          std::thread::hardware_concurrency(), // num of updating threads
+      std::uint32_t cache_line_size = 64,      // Cache-line size of machine
+      bool is_optimize_cacheline = true)
+      : _cache_mask((cache_line_size / sizeof(Bucket)) - 1),
+        _is_cacheline_alignment(is_optimize_cacheline) {
+    concurrencyLevel = nearest_power_of_two(concurrencyLevel);
+
+    // ADJUST INPUT ............................
+    const std::uint32_t adjInitCap =
+        std::max(nearest_power_of_two(inCapacity), concurrencyLevel);
+    m_num_segments = concurrencyLevel;
+    // ALLOCATE THE SEGMENTS ...................
+    _segments = static_cast<CacheAligned<Segment> *>(
+        Allocator::malloc(sizeof(CacheAligned<Segment>) * concurrencyLevel));
+
+    CacheAligned<Segment> *curr_seg = _segments;
+    for (std::uint32_t iSeg = 0; iSeg < concurrencyLevel; ++iSeg, ++curr_seg) {
+      curr_seg->init();
+    }
+
+    m_table.store(create_table(adjInitCap), std::memory_order_relaxed);
+  }
+
+  ~HopscotchHashSet() {
+    Table *table = m_table.load(std::memory_order_relaxed);
+    while (NULL != table) {
+      Table *previous = table->previous;
+      destroy_table(table);
+      table = previous;
+    }
+    Allocator::free(_segments);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  // Query Operations .........................................................
+  bool contains(const K &key, const std::size_t thread_id) {
+    return contains_internal(key, KT::hash(key));
+  }
+
+  // Hashes a chunk of keys and prefetches their home buckets and segment
+  // timestamps, then walks each key's neighbourhood as contains does.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    unsigned int hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      const Table *table = m_table.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        prefetch(&table->buckets[hashes[i] & table->size_mask]);
+        prefetch(&segment_of(table, hashes[i]));
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i]);
+      }
+    }
+  }
+
+  // modification Operations ...................................................
+  inline bool add(const K &key, const std::size_t thread_id) {
+    const unsigned int hash(KT::hash(key));
+
+    while (true) {
+      // go over the list and look for key
+      std::unique_lock<Lock> guard;
+      Table *const table = lock_home(hash, guard);
+      Bucket *const start_bucket(&(table->buckets[hash & table->size_mask]));
+      Bucket *last_bucket;
+      if (find_key(start_bucket, hash, key, last_bucket)) {
+        return false;
+      }
+      if (insert_key(table, start_bucket, hash, key, last_bucket)) {
+        return true;
+      }
+      guard.unlock();
+      // NEED TO RESIZE ..........................
+      resize_table(table, (table->size_mask + 1) * _RESIZE_FACTOR, true);
+    }
+  }
+
   inline bool remove(const K &key, const std::size_t thread_id) {
     // CALCULATE HASH ..........................
     const unsigned int hash(KT::hash(key));
 
     // CHECK IF ALREADY CONTAIN ................
-    std::lock_guard<Lock> guard(
-        this->_segments[(hash & m_size_mask) >> m_segment_shift]._lock);
-    Bucket *const start_bucket = &_table[hash & m_size_mask];
+    std::unique_lock<Lock> guard;
+    Table *const table = lock_home(hash, guard);
+    Segment &segment = segment_of(table, hash);
+    Bucket *const start_bucket = &table->buckets[hash & table->size_mask];
     Bucket *last_bucket(NULL);
     Bucket *curr_bucket = start_bucket;
     std::int32_t next_delta =
@@ -437,14 +576,12 @@ public
       }
       curr_bucket += next_delta;
 
-      if (hash == curr_bucket->_hash.load(std::memory_order_acquire) &&
+      if (stored_hash(hash) ==
+              curr_bucket->_hash.load(std::memory_order_acquire) &&
           (key == curr_bucket->_key.load(std::memory_order_relaxed))) {
-        remove_key(this->_segments[(hash & m_size_mask) >> m_segment_shift],
-                   start_bucket, curr_bucket, last_bucket, hash);
+        remove_key(segment, start_bucket, curr_bucket, last_bucket, hash);
         if (_is_cacheline_alignment)
-          optimize_cacheline_use(
-              this->_segments[(hash & m_size_mask) >> m_segment_shift],
-              curr_bucket);
+          optimize_cacheline_use(table, segment, curr_bucket);
         return true;
       }
       last_bucket = curr_bucket;
@@ -453,12 +590,21 @@ public
     return false;
   }
 
+  // Resizes to the given power of two while updates wait. Lookups carry on.
+  void resize(const std::size_t size) {
+    resize_table(
+        m_table.load(std::memory_order_acquire),
+        std::max(nearest_power_of_two(size), std::size_t(m_num_segments)),
+        false);
+  }
+
   // status Operations .........................................................
   unsigned int size() {
+    const Table *table = m_table.load(std::memory_order_acquire);
     std::uint32_t counter = 0;
-    const std::uint32_t num_elm(m_size_mask + _INSERT_RANGE);
+    const std::uint32_t num_elm(num_buckets(table));
     for (std::uint32_t iElm = 0; iElm < num_elm; ++iElm) {
-      if (0 != _table[iElm]._hash) {
+      if (0 != table->buckets[iElm]._hash) {
         ++counter;
       }
     }
@@ -469,12 +615,13 @@ public
     unsigned int total_in_cache(0);
     unsigned int total(0);
 
-    Bucket *curr_bucket(_table);
-    for (int iElm(0); iElm <= m_size_mask; ++iElm, ++curr_bucket) {
+    const Table *table = m_table.load(std::memory_order_acquire);
+    Bucket *curr_bucket(table->buckets);
+    for (std::size_t iElm(0); iElm <= table->size_mask; ++iElm, ++curr_bucket) {
 
       if (_NULL_DELTA != curr_bucket->_first_delta) {
         Bucket *const startCacheLineBucket =
-            get_start_cacheline_bucket(curr_bucket);
+            get_start_cacheline_bucket(table, curr_bucket);
         Bucket *check_bucket = curr_bucket + curr_bucket->_first_delta;
         int currDist(curr_bucket->_first_delta);
         do {
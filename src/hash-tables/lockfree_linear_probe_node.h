@@ -21,6 +21,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "hash_table_common.h"
 #include "mem-reclaimer/reclaimer.h"
+#include <algorithm>
 #include <atomic>
 
 namespace concurrent_data_structures {
@@ -149,8 +150,15 @@ private:
         if (current_key == upgrade_key) {
           found_non_flagged = true;
           if (found_closest_flagged) {
+            RecordHandle remove_handle = pin.get_rec();
+          removeBegin:
             Cell *to_remove =
-                m_table[closest_flagged_slot].load(std::memory_order_relaxed);
+                m_table[closest_flagged_slot].load(std::memory_order_consume);
+            if (!remove_handle.try_protect(
+                    to_remove, m_table[closest_flagged_slot],
+                    [](Cell *ptr) { return Cell::get_ptr(ptr); })) {
+              goto removeBegin;
+            }
             if (to_remove == TOMBSTONE)
               continue;
             if (Cell::get_ptr(to_remove)->key.load(std::memory_order_relaxed) !=
@@ -169,10 +177,36 @@ private:
     }
   }
 
+  bool contains_internal(const K &key, const std::size_t original_hash,
+                         ReclaimerPin<MemReclaimer> &pin) {
+    const std::size_t size_mask = m_size_mask.load(std::memory_order_relaxed);
+    const std::size_t original_slot = original_hash & size_mask;
+
+    for (std::size_t i = original_slot;; i++) {
+      i &= size_mask;
+    loadBegin:
+      RecordHandle handle = pin.get_rec();
+      Cell *current_cell = m_table[i].load(std::memory_order_consume);
+      if (!handle.try_protect(current_cell, m_table[i],
+                              [](Cell *ptr) { return Cell::get_ptr(ptr); })) {
+        goto loadBegin;
+      }
+      if (current_cell == nullptr) {
+        return false;
+      } else if (current_cell == TOMBSTONE or Cell::is_flagged(current_cell)) {
+        continue;
+      }
+      K current_key = current_cell->key.load(std::memory_order_relaxed);
+      if (current_key == key) {
+        return true;
+      }
+    }
+  }
+
 public:
   LockFreeLinearProbingNodeSet(const std::size_t size,
                                const std::size_t threads)
-      : m_reclaimer(threads, 3), m_size(nearest_power_of_two(size)),
+      : m_reclaimer(threads, 4), m_size(nearest_power_of_two(size)),
         m_size_mask(m_size.load(std::memory_order_relaxed) - 1),
         m_table(static_cast<std::atomic<Cell *> *>(
             Allocator::malloc(m_size.load(std::memory_order_relaxed) *
@@ -199,26 +233,37 @@ public:
 
   bool contains(const K &key, const std::size_t thread_id) {
     ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
-    const std::size_t size_mask = m_size_mask.load(std::memory_order_relaxed);
-    const std::size_t original_slot = KT::hash(key) & size_mask;
+    return contains_internal(key, KT::hash(key), pin);
+  }
 
-    for (std::size_t i = original_slot;; i++) {
-      i &= size_mask;
-    loadBegin:
-      RecordHandle handle = pin.get_rec();
-      Cell *current_cell = m_table[i].load(std::memory_order_consume);
-      if (!handle.try_protect(current_cell, m_table[i],
-                              [](Cell *ptr) { return Cell::get_ptr(ptr); })) {
-        goto loadBegin;
-      }
-      if (current_cell == nullptr) {
-        return false;
-      } else if (current_cell == TOMBSTONE or Cell::is_flagged(current_cell)) {
-        continue;
+  // Holds the cell in the first slot until wait returns, as a thread
+  // descheduled mid-lookup would.
+  template <typename Wait>
+  void stall(const std::size_t thread_id, Wait wait) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle handle = pin.get_rec();
+    Cell *current_cell = m_table[0].load(std::memory_order_consume);
+    while (!handle.try_protect(current_cell, m_table[0],
+                               [](Cell *ptr) { return Cell::get_ptr(ptr); }))
+      ;
+    wait();
+  }
+
+  // Looks up a batch of keys under one pin, prefetching each chunk's home
+  // slots before probing any of them.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    const std::size_t size_mask = m_size_mask.load(std::memory_order_relaxed);
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        prefetch(&m_table[hashes[i] & size_mask]);
       }
-      K current_key = current_cell->key.load(std::memory_order_relaxed);
-      if (current_key == key) {
-        return true;
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i], pin);
       }
     }
   }
@@ -20,7 +20,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "hash_table_common.h"
+#include "interleaved_lookup.h"
 #include "mem-reclaimer/reclaimer.h"
+#include <algorithm>
 #include <atomic>
 
 namespace concurrent_data_structures {
@@ -58,7 +60,10 @@ private:
     std::atomic<Cell *> m_head;
 
   public:
-    void init(MemReclaimer *reclaimer) { m_reclaimer = reclaimer; }
+    void init(MemReclaimer *reclaimer) {
+      m_reclaimer = reclaimer;
+      m_head.store(nullptr, std::memory_order_relaxed);
+    }
     ~LinkedList() {
       Cell *current = m_head.load(std::memory_order_consume);
       while (current != nullptr) {
@@ -73,8 +78,18 @@ private:
       std::atomic<Cell *> *previous;
       Cell *current, *next;
       ListVars(RecordHandle *h0, RecordHandle *h1, RecordHandle *h2)
-          : h0(h2), h1(h1), h2(h2), previous(nullptr), current(nullptr),
+          : h0(h0), h1(h1), h2(h2), previous(nullptr), current(nullptr),
             next(nullptr) {}
+
+      // Steps to the next cell by rotating the handles, so h2 keeps the cell
+      // previous points into and h1 the new current. Each cell stays in the
+      // slot that protected it, as copying it to another slot could let a
+      // concurrent scan miss both.
+      void advance() {
+        std::swap(h2, h1);
+        std::swap(h1, h0);
+        current = next;
+      }
     };
 
     enum SearchResult {
@@ -125,10 +140,55 @@ private:
           }
         }
         vars.previous = &Cell::get_ptr(vars.current)->next;
-        vars.h2->set(vars.current);
-        vars.current = vars.next;
-        vars.h1->set(vars.next);
+        vars.advance();
+      }
+    }
+
+    // A read-only search split into steps, one cell per step, so it can be
+    // interleaved with other lookups. begin restarts it from the head.
+    void begin(ListVars &vars) {
+    try_again:
+      vars.previous = &m_head;
+      vars.current = vars.previous->load(std::memory_order_consume);
+      if (!vars.h1->try_protect(vars.current, m_head,
+                                [](Cell *ptr) { return Cell::get_ptr(ptr); })) {
+        goto try_again;
+      }
+      prefetch(vars.current);
+    }
+
+    // Returns true once found is known. Marked cells are left to search to
+    // unlink, so meeting one finishes the lookup with find.
+    bool step(ListVars &vars, const K &key, ReclaimerPin<MemReclaimer> &pin,
+              bool &found) {
+      Cell *current = vars.current;
+      if (current == nullptr) {
+        found = false;
+        return true;
+      }
+      vars.next = current->next.load(std::memory_order_consume);
+      if (Cell::is_marked(vars.next)) {
+        found = this->find(key, pin);
+        return true;
+      }
+      if (!vars.h0->try_protect(vars.next, current->next,
+                                [](Cell *ptr) { return Cell::get_ptr(ptr); })) {
+        begin(vars);
+        return false;
+      }
+      const K current_key = current->key.load(std::memory_order_relaxed);
+      if (vars.previous->load(std::memory_order_consume) != current) {
+        begin(vars);
+        return false;
+      }
+      if (current_key >= key) {
+        found = current_key == key;
+        return true;
       }
+      vars.previous = &current->next;
+      vars.advance();
+      prefetch(vars.current);
+      return false;
     }
 
     bool find(const K &key, ReclaimerPin<MemReclaimer> &pin) {
@@ -186,9 +246,47 @@ private:
   std::size_t m_size, m_size_mask;
   LinkedList *m_table;
 
+  // Drives one chain walk per slot for interleave_lookups.
+  class Lookup {
+    MagedMichael *m_set;
+    ReclaimerPin<MemReclaimer> &m_pin;
+
+  public:
+    struct State {
+      RecordHandle h0, h1, h2;
+      typename LinkedList::ListVars vars;
+      LinkedList *list;
+      K key;
+      bool started;
+      State(Lookup &lookup)
+          : h0(lookup.m_pin.get_rec()), h1(lookup.m_pin.get_rec()),
+            h2(lookup.m_pin.get_rec()), vars(&h0, &h1, &h2) {}
+    };
+
+    Lookup(MagedMichael *set, ReclaimerPin<MemReclaimer> &pin)
+        : m_set(set), m_pin(pin) {}
+
+    void start(State &state, const K &key) {
+      state.key = key;
+      state.list = &m_set->m_table[KT::hash(key) & m_set->m_size_mask];
+      state.started = false;
+      prefetch(state.list);
+    }
+
+    bool step(State &state, bool &found) {
+      if (!state.started) {
+        state.started = true;
+        state.list->begin(state.vars);
+        return false;
+      }
+      return state.list->step(state.vars, state.key, m_pin, found);
+    }
+  };
+
 public:
   MagedMichael(const std::size_t size, const std::size_t threads)
-      : m_reclaimer(threads, 3), m_size(nearest_power_of_two(size)),
+      : m_reclaimer(threads, 3 * (S_INTERLEAVE_WIDTH + 1)),
+        m_size(nearest_power_of_two(size)),
         m_size_mask(m_size - 1),
         m_table(static_cast<LinkedList *>(
             Allocator::malloc(sizeof(LinkedList) * m_size))) {
@@ -214,6 +312,33 @@ public:
     return m_table[i].find(key, pin);
   }
 
+  // Looks up a batch of keys under one pin, prefetching each chunk's list
+  // heads before walking any of them.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    std::size_t slots[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        slots[i] = KT::hash(keys[base + i]) & m_size_mask;
+        prefetch(&m_table[slots[i]]);
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = m_table[slots[i]].find(keys[base + i], pin);
+      }
+    }
+  }
+
+  // Walks up to S_INTERLEAVE_WIDTH chains at once, switching chains after
+  // each cell so that one lookup's miss overlaps the others' work.
+  void contains_interleaved(const K *keys, const std::size_t n, bool *out,
+                            const std::size_t thread_id) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    Lookup lookup(this, pin);
+    interleave_lookups<S_INTERLEAVE_WIDTH>(lookup, keys, n, out);
+  }
+
   bool add(const K &key, const std::size_t thread_id) {
     ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
     std::size_t i = KT::hash(key) & m_size_mask;
@@ -231,6 +356,17 @@ public:
     return m_table[i].remove(key, pin);
   }
 
+  // Starts a lookup in the first bucket and holds it at the first cell
+  // until wait returns, as a thread descheduled mid-operation would.
+  template <typename Wait>
+  void stall(const std::size_t thread_id, Wait wait) {
+    ReclaimerPin<MemReclaimer> pin(&m_reclaimer, thread_id);
+    RecordHandle h0 = pin.get_rec(), h1 = pin.get_rec(), h2 = pin.get_rec();
+    typename LinkedList::ListVars vars(&h0, &h1, &h2);
+    m_table[0].begin(vars);
+    wait();
+  }
+
   void print_table() {}
 };
 } // namespace concurrent_data_structures
@@ -2,16 +2,24 @@
 #include "allocators/glib_allocator.h"
 #include "allocators/intel_allocator.h"
 #include "allocators/jemalloc_allocator.h"
+#include "allocators/pool_allocator.h"
 #include "bench/arg_parsing.h"
 #include "bench/benchmark_config.h"
 #include "bench/benchmark_summary.h"
 #include "bench/benchmark_table.h"
+#include "bench/map_set_adapter.h"
+#include "hash-tables/bitmap_hopscotch.h"
+#include "hash-tables/kcas_hopscotch.h"
+#include "hash-tables/kcas_rh_map.h"
 #include "hash-tables/kcas_rh_set.h"
 #include "hash-tables/locked_hopscotch.h"
 #include "hash-tables/lockfree_linear_probe_node.h"
 #include "hash-tables/maged_michael.h"
+#include "hash-tables/striped_robin_hood_set.h"
 #include "hash-tables/transactional_robin_hood_set.h"
 #include "mem-reclaimer/epoch.h"
+#include "mem-reclaimer/hazard_pointer.h"
+#include "mem-reclaimer/interval.h"
 #include "mem-reclaimer/leaky.h"
 #include <atomic>
 #include <cassert>
@@ -45,6 +53,12 @@ const std::string generate_file_name(const SetBenchmarkConfig &config) {
             << " A:" << get_allocator_name(config.base.allocator)
             << " T:" << config.base.num_threads << " S:" << config.table_size
             << " U:" << config.updates << " L:" << config.load_factor
+            << " W:" << config.value_size << " G:" << config.initial_size
+            << " R:" << config.resize_size << " Q:" << config.batch_size
+            << " I:" << config.interleave << " K:" << config.htm_kcas
+            << " C:" << get_contention_name(config.contention)
+            << " F:" << config.fill_phase << " X:" << config.stall
+            << " Y:" << config.base.background_reclamation
             << std::string(".txt");
   std::string human_file_name = file_name.str();
   replaceAll(human_file_name, " ", "_");
@@ -68,11 +82,56 @@ bool run_and_save(const SetBenchmarkConfig &config) {
   return true;
 }
 
+template <class Allocator, template <class> class Reclaimer>
+bool fix_value_size(const SetBenchmarkConfig &config) {
+  switch (config.value_size) {
+  case 8:
+    return run_and_save<MapBenchmark<RHMapBrownKCAS, 1>::Set, Allocator,
+                        Reclaimer>(config);
+  case 16:
+    return run_and_save<MapBenchmark<RHMapBrownKCAS, 2>::Set, Allocator,
+                        Reclaimer>(config);
+  case 32:
+    return run_and_save<MapBenchmark<RHMapBrownKCAS, 4>::Set, Allocator,
+                        Reclaimer>(config);
+  case 64:
+    return run_and_save<MapBenchmark<RHMapBrownKCAS, 8>::Set, Allocator,
+                        Reclaimer>(config);
+  default:
+    return false;
+  }
+}
+
+template <bool PairedTimestamps, class Allocator,
+          template <class> class Reclaimer>
+bool fix_contention(const SetBenchmarkConfig &config) {
+  switch (config.contention) {
+  case ContentionType::NONE:
+    return run_and_save<RHSetBrownKCASWith<NoContentionManager,
+                                           PairedTimestamps>::template Set,
+                        Allocator, Reclaimer>(config);
+  case ContentionType::BACKOFF:
+    return run_and_save<RHSetBrownKCASWith<ExponentialBackoffManager,
+                                           PairedTimestamps>::template Set,
+                        Allocator, Reclaimer>(config);
+  case ContentionType::KARMA:
+    return run_and_save<RHSetBrownKCASWith<KarmaManager,
+                                           PairedTimestamps>::template Set,
+                        Allocator, Reclaimer>(config);
+  case ContentionType::HELP_LIMIT:
+    return run_and_save<RHSetBrownKCASWith<HelpingLimitManager,
+                                           PairedTimestamps>::template Set,
+                        Allocator, Reclaimer>(config);
+  default:
+    return false;
+  }
+}
+
 template <class Allocator, template <class> class Reclaimer>
 bool fix_table(const SetBenchmarkConfig &config) {
   switch (config.table) {
   case HashTable::RH_BROWN_SET:
-    return run_and_save<RHSetBrownKCAS, Allocator, Reclaimer>(config);
+    return fix_contention<false, Allocator, Reclaimer>(config);
   case HashTable::TRANS_ROBIN_HOOD_SET:
     return run_and_save<TransactionalRobinHoodSet, Allocator, Reclaimer>(
         config);
@@ -83,6 +142,17 @@ bool fix_table(const SetBenchmarkConfig &config) {
         config);
   case HashTable::MAGED_MICHAEL:
     return run_and_save<MagedMichael, Allocator, Reclaimer>(config);
+  case HashTable::RH_BROWN_MAP:
+    return fix_value_size<Allocator, Reclaimer>(config);
+  case HashTable::RH_BROWN_PAIRED_SET:
+    return fix_contention<true, Allocator, Reclaimer>(config);
+  case HashTable::STRIPED_ROBIN_HOOD_SET:
+    return run_and_save<StripedRobinHoodSet, Allocator, Reclaimer>(config);
+  case HashTable::BITMAP_HOPSCOTCH_SET:
+    return run_and_save<SpinLockBitmapHopscotchSet, Allocator, Reclaimer>(
+        config);
+  case HashTable::HOPSCOTCH_BROWN_SET:
+    return run_and_save<HopscotchSetBrownKCAS, Allocator, Reclaimer>(config);
   default:
     return false;
   }
@@ -97,6 +167,8 @@ bool fix_allocator(const SetBenchmarkConfig &config) {
     return fix_table<JeMallocAllocator, Reclaimer>(config);
   case Allocator::Intel:
     return fix_table<IntelAllocator, Reclaimer>(config);
+  case Allocator::Pool:
+    return fix_table<PoolAllocator<JeMallocAllocator>, Reclaimer>(config);
   default:
     return false;
   }
@@ -108,6 +180,10 @@ bool run(const SetBenchmarkConfig &config) {
     return fix_allocator<LeakyReclaimer>(config);
   case Reclaimer::Epoch:
     return fix_allocator<EpochReclaimer>(config);
+  case Reclaimer::HazardPointer:
+    return fix_allocator<HazardPointerReclaimer>(config);
+  case Reclaimer::Interval:
+    return fix_allocator<IntervalReclaimer>(config);
   default:
     return false;
   }
@@ -121,6 +197,8 @@ std::int32_t main(std::int32_t argc, char *argv[]) {
            "Couldn't initialise PAPI library. Check installation.");
   }
   config.print(std::cout);
+  htm_kcas_enabled().store(config.htm_kcas);
+  background_reclamation_enabled().store(config.base.background_reclamation);
   if (!run(config)) {
     set_print_help_and_exit();
   }
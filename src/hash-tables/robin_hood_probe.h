@@ -0,0 +1,165 @@
+#pragma once
+
+/*
+Vectorised Robin Hood lookups over packed buckets.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "hash_table_common.h"
+#include <cstdint>
+#include <immintrin.h>
+
+namespace concurrent_data_structures {
+
+// Looks a key up in a table of RobinHoodBucket words. A bucket holding the
+// key at the current probe distance is exactly pack(key, distance), so a
+// vector of candidates is compared against the key packed with each lane's
+// distance, against the null key and, for the early exit, against each lane's
+// distance. The kernel is picked once at runtime: AVX-512 covers a cache line
+// per step, AVX2 half of one, and CPUs with neither probe one bucket at a
+// time. Only these loops are compiled for the wider instruction sets, the rest
+// of the program is left alone. Buckets must be aligned to S_ALIGNMENT. Probes
+// fall back to the scalar loop once distances reach the saturated range.
+template <class K, class KT = KeyTraits<K>> class RobinHoodProbe {
+private:
+  typedef RobinHoodBucket<K, KT> Bucket;
+  typedef bool (*ContainsFunction)(const K *, const std::size_t, const K &,
+                                   const std::size_t);
+
+  static_assert(sizeof(K) == sizeof(std::int64_t),
+                "Vectorised probes compare 64-bit buckets.");
+
+  static bool scalar_contains(const K *buckets, const std::size_t size,
+                              const K &key, std::size_t i,
+                              std::size_t cur_dist) {
+    const std::size_t size_mask = size - 1;
+    for (;; i++, cur_dist++) {
+      i &= size_mask;
+      K current_bucket = buckets[i];
+      if (current_bucket == KT::NullKey) {
+        return false;
+      }
+      if (key == Bucket::key(current_bucket)) {
+        return true;
+      }
+      if (Bucket::distance(current_bucket, size, i) < cur_dist) {
+        return false;
+      }
+    }
+  }
+
+  static bool scalar(const K *buckets, const std::size_t size, const K &key,
+                     const std::size_t hash) {
+    return scalar_contains(buckets, size, key, hash & (size - 1), 0);
+  }
+
+  // The vector loops walk aligned groups of buckets from the one holding the
+  // home bucket, ignoring the lanes before it. Each lane's distance is kept
+  // shifted into place, so the wanted bucket is the key or'd with it and a
+  // bucket below it is closer to home than the lane, which ends the probe.
+  __attribute__((target("avx512f"))) static bool
+  avx512(const K *buckets, const std::size_t size, const K &key,
+         const std::size_t hash) {
+    const std::size_t home = hash & (size - 1);
+    if (size < 8) {
+      return scalar_contains(buckets, size, key, home, 0);
+    }
+    const std::int64_t unit = std::int64_t(1) << Bucket::S_DISTANCE_SHIFT;
+    const __m512i null_keys = _mm512_set1_epi64(std::int64_t(KT::NullKey));
+    const __m512i keys = _mm512_set1_epi64(std::int64_t(key));
+    const __m512i step = _mm512_set1_epi64(unit * 8);
+    std::size_t base = home & ~std::size_t(7);
+    std::int64_t first_dist = std::int64_t(base) - std::int64_t(home);
+    __m512i dists = _mm512_add_epi64(
+        _mm512_set1_epi64(first_dist * unit),
+        _mm512_set_epi64(unit * 7, unit * 6, unit * 5, unit * 4, unit * 3,
+                         unit * 2, unit, 0));
+    std::uint32_t valid = ~std::uint32_t(0) << (home - base);
+    while (first_dist + 8 < std::int64_t(Bucket::S_MAX_DISTANCE)) {
+      const __m512i lanes = _mm512_load_si512(buckets + base);
+      const std::uint32_t found =
+          _mm512_cmpeq_epi64_mask(lanes, _mm512_or_si512(keys, dists));
+      const std::uint32_t stop =
+          (found | _mm512_cmpeq_epi64_mask(lanes, null_keys) |
+           _mm512_cmplt_epi64_mask(lanes, dists)) &
+          valid;
+      if (stop != 0) {
+        return (found >> __builtin_ctz(stop)) & 1;
+      }
+      base = (base + 8) & (size - 1);
+      first_dist += 8;
+      dists = _mm512_add_epi64(dists, step);
+      valid = ~std::uint32_t(0);
+    }
+    return scalar_contains(buckets, size, key, base, std::size_t(first_dist));
+  }
+
+  __attribute__((target("avx2"))) static bool
+  avx2(const K *buckets, const std::size_t size, const K &key,
+       const std::size_t hash) {
+    const std::size_t home = hash & (size - 1);
+    if (size < 4) {
+      return scalar_contains(buckets, size, key, home, 0);
+    }
+    const std::int64_t unit = std::int64_t(1) << Bucket::S_DISTANCE_SHIFT;
+    const __m256i null_keys = _mm256_set1_epi64x(std::int64_t(KT::NullKey));
+    const __m256i keys = _mm256_set1_epi64x(std::int64_t(key));
+    const __m256i step = _mm256_set1_epi64x(unit * 4);
+    std::size_t base = home & ~std::size_t(3);
+    std::int64_t first_dist = std::int64_t(base) - std::int64_t(home);
+    __m256i dists =
+        _mm256_add_epi64(_mm256_set1_epi64x(first_dist * unit),
+                         _mm256_set_epi64x(unit * 3, unit * 2, unit, 0));
+    std::uint32_t valid = ~std::uint32_t(0) << (home - base);
+    while (first_dist + 4 < std::int64_t(Bucket::S_MAX_DISTANCE)) {
+      const __m256i lanes =
+          _mm256_load_si256(reinterpret_cast<const __m256i *>(buckets + base));
+      const std::uint32_t found = _mm256_movemask_pd(_mm256_castsi256_pd(
+          _mm256_cmpeq_epi64(lanes, _mm256_or_si256(keys, dists))));
+      const __m256i ends =
+          _mm256_or_si256(_mm256_cmpeq_epi64(lanes, null_keys),
+                          _mm256_cmpgt_epi64(dists, lanes));
+      const std::uint32_t stop =
+          (found | _mm256_movemask_pd(_mm256_castsi256_pd(ends))) & valid;
+      if (stop != 0) {
+        return (found >> __builtin_ctz(stop)) & 1;
+      }
+      base = (base + 4) & (size - 1);
+      first_dist += 4;
+      dists = _mm256_add_epi64(dists, step);
+      valid = ~std::uint32_t(0);
+    }
+    return scalar_contains(buckets, size, key, base, std::size_t(first_dist));
+  }
+
+  static ContainsFunction select() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      return &avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      return &avx2;
+    }
+    return &scalar;
+  }
+
+public:
+  static const std::size_t S_ALIGNMENT = 64;
+
+  static bool contains(const K *buckets, const std::size_t size, const K &key,
+                       const std::size_t hash) {
+    static const ContainsFunction contains_function = select();
+    return contains_function(buckets, size, key, hash);
+  }
+};
+}
@@ -0,0 +1,289 @@
+#pragma once
+
+/*
+Striped lock Robin Hood Hashing algorithm.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "hash_table_common.h"
+#include "primitives/cache_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+
+namespace concurrent_data_structures {
+
+// Robin Hood set guarded by a lock per fixed-size stripe of buckets, needing
+// neither HTM nor K-CAS. Writers lock every stripe their probe or shift
+// touches. Probes never wrap, they run on into an overflow region past the
+// last home bucket, so stripes are always locked in ascending order. Each lock
+// is a version that is odd while held, and lookups validate the versions of
+// the stripes they read instead of locking them. The table does not grow.
+template <class Allocator, template <class> class Reclaimer, class K,
+          class KT = KeyTraits<K>>
+class StripedRobinHoodSet {
+private:
+  typedef RobinHoodBucket<K, KT> Bucket;
+
+  // Buckets covered by one lock.
+  static const std::size_t S_STRIPE_SHIFT = 8;
+  static const std::size_t S_STRIPE_SIZE = std::size_t(1) << S_STRIPE_SHIFT;
+  // Buckets past the end of the table that probes may run into.
+  static const std::size_t S_OVERFLOW = S_STRIPE_SIZE;
+  // Stripes a lookup validates before it locks them instead.
+  static const std::size_t S_MAX_READ_STRIPES = 4;
+  static const std::size_t S_SPINS_BEFORE_YIELD = 1 << 8;
+
+  struct Stripe {
+    std::atomic<std::uint64_t> version;
+  };
+
+  // Holds the stripes from the one it was built on up to the last one covered.
+  class StripeGuard {
+  private:
+    StripedRobinHoodSet &m_set;
+    const std::size_t m_first;
+    std::size_t m_last;
+
+  public:
+    StripeGuard(StripedRobinHoodSet &set, const std::size_t slot)
+        : m_set(set), m_first(slot >> S_STRIPE_SHIFT), m_last(m_first) {
+      m_set.lock(m_first);
+    }
+    ~StripeGuard() {
+      for (std::size_t stripe = m_first; stripe <= m_last; stripe++) {
+        m_set.unlock(stripe);
+      }
+    }
+    void cover(const std::size_t slot) {
+      while (m_last < (slot >> S_STRIPE_SHIFT)) {
+        m_set.lock(++m_last);
+      }
+    }
+  };
+
+  const std::size_t m_size, m_size_mask, m_capacity, m_num_stripes;
+  std::atomic<K> *m_buckets;
+  CacheAligned<Stripe> *m_stripes;
+
+  static void backoff(std::size_t &spins) {
+    if (spins++ < S_SPINS_BEFORE_YIELD) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+      asm volatile("yield");
+#endif
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  void lock(const std::size_t stripe) {
+    std::atomic<std::uint64_t> &version = m_stripes[stripe].version;
+    for (std::size_t spins = 0;; backoff(spins)) {
+      std::uint64_t current = version.load(std::memory_order_relaxed);
+      if ((current & 1) == 0 and
+          version.compare_exchange_weak(current, current + 1,
+                                        std::memory_order_acquire,
+                                        std::memory_order_relaxed)) {
+        // The odd version must be visible before any bucket changes.
+        std::atomic_thread_fence(std::memory_order_release);
+        return;
+      }
+    }
+  }
+
+  void unlock(const std::size_t stripe) {
+    std::atomic<std::uint64_t> &version = m_stripes[stripe].version;
+    version.store(version.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+  }
+
+  // Probes from slot with the stripes locked. Leaves slot and cur_dist where
+  // the key is, or where it would go.
+  bool locked_find(StripeGuard &guard, const K &key, std::size_t &slot,
+                   std::size_t &cur_dist) {
+    for (cur_dist = 0; slot < m_capacity; slot++, cur_dist++) {
+      guard.cover(slot);
+      K current_bucket = m_buckets[slot].load(std::memory_order_relaxed);
+      if (current_bucket == KT::NullKey) {
+        return false;
+      }
+      if (key == Bucket::key(current_bucket)) {
+        return true;
+      }
+      if (Bucket::distance(current_bucket, m_size, slot) < cur_dist) {
+        return false;
+      }
+    }
+    return false;
+  }
+
+  bool contains_locked(const K &key, const std::size_t hash) {
+    std::size_t slot = hash & m_size_mask, cur_dist;
+    StripeGuard guard(*this, slot);
+    return locked_find(guard, key, slot, cur_dist);
+  }
+
+  bool contains_internal(const K &key, const std::size_t hash) {
+    std::size_t stripes[S_MAX_READ_STRIPES];
+    std::uint64_t versions[S_MAX_READ_STRIPES];
+    std::size_t spins = 0;
+  retry:
+    std::size_t num_stripes = 0;
+    bool found = false;
+    for (std::size_t i = hash & m_size_mask, cur_dist = 0; i < m_capacity;
+         i++, cur_dist++) {
+      const std::size_t stripe = i >> S_STRIPE_SHIFT;
+      if (num_stripes == 0 or stripes[num_stripes - 1] != stripe) {
+        if (num_stripes == S_MAX_READ_STRIPES) {
+          return contains_locked(key, hash);
+        }
+        const std::uint64_t version =
+            m_stripes[stripe].version.load(std::memory_order_acquire);
+        if ((version & 1) != 0) {
+          backoff(spins);
+          goto retry;
+        }
+        stripes[num_stripes] = stripe;
+        versions[num_stripes++] = version;
+      }
+      K current_bucket = m_buckets[i].load(std::memory_order_relaxed);
+      if (current_bucket == KT::NullKey) {
+        break;
+      }
+      if (key == Bucket::key(current_bucket)) {
+        found = true;
+        break;
+      }
+      if (Bucket::distance(current_bucket, m_size, i) < cur_dist) {
+        break;
+      }
+    }
+    // The buckets must be read before the versions are checked again.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    for (std::size_t s = 0; s < num_stripes; s++) {
+      if (m_stripes[stripes[s]].version.load(std::memory_order_relaxed) !=
+          versions[s]) {
+        goto retry;
+      }
+    }
+    return found;
+  }
+
+public:
+  StripedRobinHoodSet(std::size_t size, const std::size_t threads)
+      : m_size(nearest_power_of_two(size)), m_size_mask(m_size - 1),
+        m_capacity(m_size + S_OVERFLOW),
+        m_num_stripes((m_capacity + S_STRIPE_SIZE - 1) >> S_STRIPE_SHIFT),
+        m_buckets(static_cast<std::atomic<K> *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(std::atomic<K>) * m_capacity))),
+        m_stripes(static_cast<CacheAligned<Stripe> *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(CacheAligned<Stripe>) * m_num_stripes))) {
+    for (std::size_t i = 0; i < m_capacity; i++) {
+      m_buckets[i].store(KT::NullKey, std::memory_order_relaxed);
+    }
+    for (std::size_t s = 0; s < m_num_stripes; s++) {
+      m_stripes[s].version.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  ~StripedRobinHoodSet() {
+    Allocator::free(m_buckets);
+    Allocator::free(m_stripes);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    return contains_internal(key, KT::hash(key));
+  }
+
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        prefetch(&m_buckets[hashes[i] & m_size_mask]);
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i]);
+      }
+    }
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    assert(key < Bucket::S_KEY_MASK);
+    std::size_t slot = KT::hash(key) & m_size_mask, cur_dist;
+    StripeGuard guard(*this, slot);
+    if (locked_find(guard, key, slot, cur_dist)) {
+      return false;
+    }
+    // Find the empty bucket that ends the shift before moving anything.
+    std::size_t empty = slot;
+    for (;; empty++) {
+      if (empty == m_capacity) {
+        // Overflow region exhausted, the table is full.
+        return false;
+      }
+      guard.cover(empty);
+      if (m_buckets[empty].load(std::memory_order_relaxed) == KT::NullKey) {
+        break;
+      }
+    }
+    K carried = key;
+    for (; slot < empty; slot++, cur_dist++) {
+      K current_bucket = m_buckets[slot].load(std::memory_order_relaxed);
+      const std::size_t current_dist =
+          Bucket::distance(current_bucket, m_size, slot);
+      if (current_dist < cur_dist) {
+        m_buckets[slot].store(Bucket::pack(carried, cur_dist),
+                              std::memory_order_relaxed);
+        carried = Bucket::key(current_bucket);
+        cur_dist = current_dist;
+      }
+    }
+    m_buckets[empty].store(Bucket::pack(carried, cur_dist),
+                           std::memory_order_relaxed);
+    return true;
+  }
+
+  bool remove(const K &key, const std::size_t thread_id) {
+    std::size_t slot = KT::hash(key) & m_size_mask, cur_dist;
+    StripeGuard guard(*this, slot);
+    if (!locked_find(guard, key, slot, cur_dist)) {
+      return false;
+    }
+    // Backward shift the keys after it until one is home or a bucket is empty.
+    for (std::size_t next = slot + 1; next < m_capacity; slot++, next++) {
+      guard.cover(next);
+      K next_bucket = m_buckets[next].load(std::memory_order_relaxed);
+      if (next_bucket == KT::NullKey) {
+        break;
+      }
+      const std::size_t next_dist = Bucket::distance(next_bucket, m_size, next);
+      if (next_dist == 0) {
+        break;
+      }
+      m_buckets[slot].store(Bucket::pack(Bucket::key(next_bucket), next_dist - 1),
+                            std::memory_order_relaxed);
+    }
+    m_buckets[slot].store(KT::NullKey, std::memory_order_relaxed);
+    return true;
+  }
+};
+}
@@ -6,9 +6,9 @@
 
 namespace concurrent_data_structures {
 
-template <class Table, class Key>
-static Table *TableInit(const SetBenchmarkConfig &config) {
-  Table *table = new Table(config.table_size, config.base.num_threads);
+// The keys a table starts the benchmark with, in the order they are added.
+template <class Key>
+static std::vector<Key> StartingKeys(const SetBenchmarkConfig &config) {
   std::size_t amount =
       static_cast<std::size_t>(config.table_size * config.load_factor);
   std::vector<Key> keys(config.table_size);
@@ -17,7 +17,19 @@ static Table *TableInit(const SetBenchmarkConfig &config) {
   }
   pcg32 random(0); // pcg_extras::seed_seq_from<std::random_device>()
   std::shuffle(keys.begin(), keys.end(), random);
-  for (std::size_t i = 0; i < amount; i++) {
+  keys.resize(amount);
+  return keys;
+}
+
+// Left empty when the benchmark fills it in a timed phase of its own.
+template <class Table, class Key>
+static Table *TableInit(const SetBenchmarkConfig &config) {
+  Table *table = new Table(config.initial_size, config.base.num_threads);
+  if (config.fill_phase) {
+    return table;
+  }
+  std::vector<Key> keys = StartingKeys<Key>(config);
+  for (std::size_t i = 0; i < keys.size(); i++) {
     //    std::cout << "Adding key: " << keys[i] << std::endl;
     if (!table->add(keys[i], i % config.base.num_threads)) {
       // Shouldn't be here anymore...
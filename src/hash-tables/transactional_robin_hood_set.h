@@ -16,8 +16,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
 #include "hash_table_common.h"
+#include "interleaved_lookup.h"
+#include "primitives/cache_utils.h"
 #include "primitives/locks.h"
+#include "robin_hood_probe.h"
+#include <algorithm>
 #include <atomic>
+#include <cassert>
 #include <cstdint>
 #include <iostream>
 #include <mutex>
@@ -25,124 +30,502 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 namespace concurrent_data_structures {
 
+// Resizing runs outside the elided critical section. A resize hangs a new
+// table off the current one and then migrates it S_MIGRATION_STEP buckets at a
+// time, each step in its own short critical section so hardware transactions
+// stay well inside capacity. Migrated buckets are emptied out of the old table
+// and probes of the old table skip over that prefix, scanning to an empty
+// slot rather than trusting the Robin Hood early exit. The table grows when an
+// insert probes too far on a half full table and shrinks (never below its
+// starting size) when an eighth full.
 template <class Allocator, template <class> class Reclaimer,
           class K = std::uint64_t, class KT = KeyTraits<K>>
 class TransactionalRobinHoodSet {
 private:
+  static const std::size_t S_MIGRATION_STEP = 32;
+  static const std::size_t S_RESIZE_PROBE = 128;
+  static const std::size_t S_SHRINK_CHECK = 1024;
+
+  typedef RobinHoodBucket<K, KT> Bucket;
+
+  enum class AddResult { Added, Present, Grow };
+
+  struct Table {
+    std::size_t size, size_mask;
+    K *buckets;
+  };
+
+  struct ThreadCount {
+    std::atomic<std::intptr_t> count;
+    std::size_t removals;
+  };
+
   ElidedLock m_lock;
-  std::atomic<std::size_t> m_size;
-  K *m_table;
+  std::atomic<Table *> m_table, m_next;
+  // Buckets of m_table already moved into m_next.
+  std::size_t m_progress;
+  const std::size_t m_min_size, m_num_threads;
+  CacheAligned<ThreadCount> *m_thread_counts;
 
-public:
-  TransactionalRobinHoodSet(std::size_t size, const std::size_t threads)
-      : m_size(nearest_power_of_two(size)),
-        m_table(
-            static_cast<K *>(Allocator::malloc(sizeof(K) * m_size.load()))) {
+  // Buckets start on a cache line so vectorised probes can load whole lines.
+  static Table *create_table(const std::size_t size) {
+    const std::size_t header_bytes =
+        (sizeof(Table) + S_CACHE_ALIGNMENT - 1) & ~(S_CACHE_ALIGNMENT - 1);
+    char *raw = static_cast<char *>(Allocator::aligned_alloc(
+        S_CACHE_ALIGNMENT, header_bytes + sizeof(K) * size));
+    Table *table = reinterpret_cast<Table *>(raw);
+    table->size = size;
+    table->size_mask = size - 1;
+    table->buckets = reinterpret_cast<K *>(raw + header_bytes);
     K null_key = KT::NullKey;
-    for (std::size_t i = 0; i < m_size.load(std::memory_order_relaxed); i++) {
-      m_table[i] = null_key;
+    for (std::size_t i = 0; i < size; i++) {
+      table->buckets[i] = null_key;
     }
+    return table;
   }
 
-  ~TransactionalRobinHoodSet() { Allocator::free(m_table); }
+  // Next slot of the old table during a migration, skipping the emptied
+  // prefix.
+  std::size_t next_slot(const Table *table, const std::size_t slot) {
+    std::size_t next = (slot + 1) & table->size_mask;
+    return next < m_progress ? m_progress : next;
+  }
 
-  bool thread_init(const std::size_t thread_id) { return true; }
+  std::size_t old_home(const Table *table, const std::size_t home) {
+    return home < m_progress ? m_progress : home;
+  }
 
-  bool contains(const K &key, const std::size_t thread_id) {
-    std::size_t size = m_size.load(std::memory_order_relaxed);
-    std::size_t size_mask = size - 1;
-    std::size_t original_slot = KT::hash(key);
-    std::lock_guard<ElidedLock> m_lock_guard(m_lock);
-    for (std::size_t i = original_slot, cur_dist = 0;; i++, cur_dist++) {
-      i &= size_mask;
-      K current_key = m_table[i];
-      if (current_key == KT::NullKey) {
+  bool old_contains(const Table *table, const K &key, const std::size_t hash,
+                    std::size_t &slot) {
+    for (std::size_t i = old_home(table, hash & table->size_mask);;
+         i = next_slot(table, i)) {
+      K current_bucket = table->buckets[i];
+      if (current_bucket == KT::NullKey) {
         return false;
       }
-      if (key == current_key) {
+      if (key == Bucket::key(current_bucket)) {
+        slot = i;
         return true;
       }
-      std::size_t current_original_slot = KT::hash(current_key) & size_mask;
-      if (distance_from_slot(size, current_original_slot, i) < cur_dist) {
-        return false;
+    }
+  }
+
+  void old_remove(Table *table, std::size_t i) {
+    const std::size_t size = table->size;
+    for (std::size_t current = next_slot(table, i); true;
+         current = next_slot(table, current)) {
+      K current_bucket = table->buckets[current];
+      if (current_bucket == KT::NullKey) {
+        break;
+      }
+      const std::size_t home =
+          (current - Bucket::distance(current_bucket, size, current)) &
+          table->size_mask;
+      if (old_home(table, home) == current) {
+        break;
       }
+      table->buckets[i] = Bucket::pack(Bucket::key(current_bucket),
+                                       distance_from_slot(size, home, i));
+      i = current;
     }
+    table->buckets[i] = KT::NullKey;
   }
 
-  bool add(const K &key, const std::size_t thread_id) {
+  bool table_contains(const Table *table, const K &key,
+                      const std::size_t hash) {
+    return RobinHoodProbe<K, KT>::contains(table->buckets, table->size, key,
+                                           hash);
+  }
 
-    std::size_t size = m_size.load(std::memory_order_relaxed);
-    std::size_t size_mask = size - 1;
+  AddResult table_add(Table *table, const K &key, const std::size_t hash,
+                      const bool can_grow) {
+    const std::size_t size = table->size;
+    const std::size_t size_mask = table->size_mask;
+    std::size_t active_slot = hash & size_mask;
+    assert(key < Bucket::S_KEY_MASK);
 
-    std::size_t original_bucket = KT::hash(key) & size_mask;
-    std::lock_guard<ElidedLock> m_lock_guard(m_lock);
-    K active_key = key;
-    std::size_t active_slot = original_bucket;
+    // The insertion only touches buckets up to the first empty one, so check
+    // there is one close enough before writing anything.
+    for (std::size_t i = active_slot, probe_length = 0;; i++, probe_length++) {
+      i &= size_mask;
+      if (probe_length == size or
+          (can_grow and probe_length == S_RESIZE_PROBE)) {
+        return AddResult::Grow;
+      }
+      K current_bucket = table->buckets[i];
+      if (current_bucket == KT::NullKey) {
+        break;
+      }
+      if (key == Bucket::key(current_bucket)) {
+        return AddResult::Present;
+      }
+    }
 
+    K active_key = key;
     for (std::size_t i = active_slot, active_dist = 0;; i++, active_dist++) {
       i &= size_mask;
-      K current_key = m_table[i];
+      K current_bucket = table->buckets[i];
 
       // Found an empty slot
-      if (current_key == KT::NullKey) {
-        m_table[i] = active_key;
-        return true;
-      }
-      if (active_key == current_key) {
-        return false;
+      if (current_bucket == KT::NullKey) {
+        table->buckets[i] = Bucket::pack(active_key, active_dist);
+        return AddResult::Added;
       }
 
-      std::size_t current_original_slot = KT::hash(current_key) & size_mask;
-      std::size_t current_dist =
-          distance_from_slot(size, current_original_slot, i);
+      std::size_t current_dist = Bucket::distance(current_bucket, size, i);
       if (current_dist < active_dist) {
-        std::swap(active_key, m_table[i]);
+        table->buckets[i] = Bucket::pack(active_key, active_dist);
+        active_key = Bucket::key(current_bucket);
         active_dist = current_dist;
       }
     }
   }
 
-  bool remove(K key, const std::size_t thread_id) {
-    std::size_t size = m_size.load(std::memory_order_relaxed);
-    std::size_t size_mask = size - 1;
-    std::size_t original_slot = KT::hash(key);
-
-    std::lock_guard<ElidedLock> m_lock_guard(m_lock);
-
-    for (std::size_t i = original_slot, cur_dist = 0;; i++, cur_dist++) {
+  bool table_remove(Table *table, const K &key, const std::size_t hash) {
+    const std::size_t size = table->size;
+    const std::size_t size_mask = table->size_mask;
+    for (std::size_t i = hash, cur_dist = 0;; i++, cur_dist++) {
       i &= size_mask;
-      K current_key = m_table[i];
-      if (current_key == KT::NullKey) {
+      K current_bucket = table->buckets[i];
+      if (current_bucket == KT::NullKey) {
         return false;
       }
-      if (key == current_key) {
+      if (key == Bucket::key(current_bucket)) {
         for (std::size_t current = i + 1; true; current++, i++) {
           current &= size_mask;
           i &= size_mask;
-          current_key = m_table[current];
-          if (current_key == KT::NullKey or
-              distance_from_slot(size, KT::hash(current_key) & size_mask,
-                                 current) == 0) {
+          current_bucket = table->buckets[current];
+          if (current_bucket == KT::NullKey) {
+            break;
+          }
+          const std::size_t current_dist =
+              Bucket::distance(current_bucket, size, current);
+          if (current_dist == 0) {
             break;
           }
-          m_table[i] = current_key;
+          table->buckets[i] =
+              Bucket::pack(Bucket::key(current_bucket), current_dist - 1);
         }
-        m_table[i] = KT::NullKey;
+        table->buckets[i] = KT::NullKey;
         return true;
       }
-      std::size_t current_original_slot = KT::hash(current_key) & size_mask;
-      if (distance_from_slot(size, current_original_slot, i) < cur_dist) {
+      if (Bucket::distance(current_bucket, size, i) < cur_dist) {
+        return false;
+      }
+    }
+  }
+
+  bool contains_locked(const K &key, const std::size_t hash) {
+    Table *table = m_table.load(std::memory_order_relaxed);
+    Table *next = m_next.load(std::memory_order_relaxed);
+    if (next == nullptr) {
+      return table_contains(table, key, hash);
+    }
+    std::size_t slot;
+    return old_contains(table, key, hash, slot) or
+           table_contains(next, key, hash);
+  }
+
+  bool contains_internal(const K &key, const std::size_t hash) {
+    std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+    return contains_locked(key, hash);
+  }
+
+  // Drives one probe per slot for interleave_lookups, a cache line per step.
+  // Only used with the lock held and no migration running.
+  class Lookup {
+    const Table *m_table;
+
+  public:
+    struct State {
+      K key;
+      std::size_t bucket, distance;
+      State(Lookup &lookup) {}
+    };
+
+    Lookup(const Table *table) : m_table(table) {}
+
+    void start(State &state, const K &key) {
+      state.key = key;
+      state.bucket = KT::hash(key) & m_table->size_mask;
+      state.distance = 0;
+      prefetch(&m_table->buckets[state.bucket]);
+    }
+
+    bool step(State &state, bool &found) {
+      while (true) {
+        const K current_bucket = m_table->buckets[state.bucket];
+        if (current_bucket == KT::NullKey) {
+          found = false;
+          return true;
+        }
+        if (state.key == Bucket::key(current_bucket)) {
+          found = true;
+          return true;
+        }
+        if (Bucket::distance(current_bucket, m_table->size, state.bucket) <
+            state.distance) {
+          found = false;
+          return true;
+        }
+        state.bucket = (state.bucket + 1) & m_table->size_mask;
+        state.distance++;
+        if (starts_cache_line(&m_table->buckets[state.bucket])) {
+          prefetch(&m_table->buckets[state.bucket]);
+          return false;
+        }
+      }
+    }
+  };
+
+  std::intptr_t count() {
+    std::intptr_t count = 0;
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      count += m_thread_counts[t].count.load(std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  // Hangs a table of the given size off the current one unless a migration
+  // is already under way.
+  void start_resize(const std::size_t size) {
+    Table *next = create_table(size);
+    bool installed = false;
+    {
+      std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+      if (m_next.load(std::memory_order_relaxed) == nullptr and
+          m_table.load(std::memory_order_relaxed)->size != size) {
+        m_next.store(next, std::memory_order_relaxed);
+        m_progress = 0;
+        installed = true;
+      }
+    }
+    if (!installed) {
+      Allocator::free(next);
+    }
+  }
+
+  // Moves one step of buckets over, swapping tables after the last one.
+  // Returns false once there is no migration left to help with.
+  bool migrate_step() {
+    Table *retired = nullptr;
+    {
+      std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+      Table *next = m_next.load(std::memory_order_relaxed);
+      if (next == nullptr) {
         return false;
       }
+      Table *table = m_table.load(std::memory_order_relaxed);
+      const std::size_t end = std::min(m_progress + S_MIGRATION_STEP,
+                                       table->size);
+      for (std::size_t i = m_progress; i < end; i++) {
+        K current_bucket = table->buckets[i];
+        if (current_bucket != KT::NullKey) {
+          const K current_key = Bucket::key(current_bucket);
+          AddResult result =
+              table_add(next, current_key, KT::hash(current_key), false);
+          assert(result == AddResult::Added);
+          table->buckets[i] = KT::NullKey;
+        }
+      }
+      m_progress = end;
+      if (end == table->size) {
+        m_table.store(next, std::memory_order_relaxed);
+        m_next.store(nullptr, std::memory_order_relaxed);
+        m_progress = 0;
+        retired = table;
+      }
+    }
+    if (retired != nullptr) {
+      Allocator::free(retired);
+    }
+    return true;
+  }
+
+  void help_migration() {
+    if (m_next.load(std::memory_order_relaxed) != nullptr) {
+      migrate_step();
+    }
+  }
+
+public:
+  TransactionalRobinHoodSet(std::size_t size, const std::size_t threads)
+      : m_table(create_table(nearest_power_of_two(size))), m_next(nullptr),
+        m_progress(0), m_min_size(nearest_power_of_two(size)),
+        m_num_threads(threads),
+        m_thread_counts(static_cast<CacheAligned<ThreadCount> *>(
+            Allocator::malloc(sizeof(CacheAligned<ThreadCount>) * threads))) {
+    for (std::size_t t = 0; t < threads; t++) {
+      m_thread_counts[t].count.store(0, std::memory_order_relaxed);
+      m_thread_counts[t].removals = 0;
+    }
+  }
+
+  ~TransactionalRobinHoodSet() {
+    while (migrate_step()) {
+    }
+    Allocator::free(m_table.load());
+    Allocator::free(m_thread_counts);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  std::size_t size() { return m_table.load()->size; }
+
+  ElisionStats elision_stats() const { return m_lock.stats(); }
+
+  // Resizes to the given power of two, driving the migration to completion.
+  // Sizes that would leave the table over half full are ignored.
+  void resize(const std::size_t size) {
+    const std::size_t new_size = nearest_power_of_two(size);
+    if (count() <= std::intptr_t(new_size >> 1)) {
+      start_resize(new_size);
+    }
+    while (migrate_step()) {
     }
   }
+
+  bool contains(const K &key, const std::size_t thread_id) {
+    return contains_internal(key, KT::hash(key));
+  }
+
+  // Prefetches each chunk's home buckets outside the critical section, then
+  // looks the keys up one transaction at a time so each stays small. A stale
+  // table pointer only costs a useless prefetch.
+  void contains_batch(const K *keys, const std::size_t n, bool *out,
+                      const std::size_t thread_id) {
+    std::size_t hashes[S_PREFETCH_BATCH];
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      const Table *table = m_table.load(std::memory_order_relaxed);
+      for (std::size_t i = 0; i < batch; i++) {
+        hashes[i] = KT::hash(keys[base + i]);
+        prefetch(&table->buckets[hashes[i] & table->size_mask]);
+      }
+      for (std::size_t i = 0; i < batch; i++) {
+        out[base + i] = contains_internal(keys[base + i], hashes[i]);
+      }
+    }
+  }
+
+  // Interleaves up to S_INTERLEAVE_WIDTH probes, one critical section per
+  // S_PREFETCH_BATCH keys to keep transactions small. While a migration runs
+  // the keys are looked up one at a time instead.
+  void contains_interleaved(const K *keys, const std::size_t n, bool *out,
+                            const std::size_t thread_id) {
+    for (std::size_t base = 0; base < n; base += S_PREFETCH_BATCH) {
+      const std::size_t batch = std::min(S_PREFETCH_BATCH, n - base);
+      std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+      if (m_next.load(std::memory_order_relaxed) != nullptr) {
+        for (std::size_t i = 0; i < batch; i++) {
+          out[base + i] =
+              contains_locked(keys[base + i], KT::hash(keys[base + i]));
+        }
+        continue;
+      }
+      Lookup lookup(m_table.load(std::memory_order_relaxed));
+      interleave_lookups<S_INTERLEAVE_WIDTH>(lookup, keys + base, batch,
+                                             out + base);
+    }
+  }
+
+  bool add(const K &key, const std::size_t thread_id) {
+    const std::size_t hash = KT::hash(key);
+    help_migration();
+    while (true) {
+      AddResult result;
+      std::size_t size;
+      bool migrating;
+      {
+        std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+        Table *table = m_table.load(std::memory_order_relaxed);
+        Table *next = m_next.load(std::memory_order_relaxed);
+        size = table->size;
+        migrating = next != nullptr;
+        std::size_t slot;
+        if (!migrating) {
+          result = table_add(table, key, hash, true);
+        } else if (old_contains(table, key, hash, slot)) {
+          result = AddResult::Present;
+        } else {
+          result = table_add(next, key, hash, true);
+        }
+      }
+      switch (result) {
+      case AddResult::Added:
+        m_thread_counts[thread_id].count.fetch_add(1,
+                                                   std::memory_order_relaxed);
+        return true;
+      case AddResult::Present:
+        return false;
+      case AddResult::Grow:
+        if (migrating) {
+          // Finish the migration and judge the new table on its own.
+          while (migrate_step()) {
+          }
+        } else if (count() > std::intptr_t(size >> 1)) {
+          resize(size << 1);
+        } else {
+          // Not worth growing, carry on without the probe limit.
+          std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+          Table *table = m_table.load(std::memory_order_relaxed);
+          if (m_next.load(std::memory_order_relaxed) != nullptr or
+              table->size != size) {
+            continue;
+          }
+          result = table_add(table, key, hash, false);
+          if (result == AddResult::Present) {
+            return false;
+          }
+          assert(result == AddResult::Added);
+          m_thread_counts[thread_id].count.fetch_add(
+              1, std::memory_order_relaxed);
+          return true;
+        }
+      }
+    }
+  }
+
+  bool remove(K key, const std::size_t thread_id) {
+    const std::size_t hash = KT::hash(key);
+    help_migration();
+    bool removed;
+    std::size_t size;
+    {
+      std::lock_guard<ElidedLock> m_lock_guard(m_lock);
+      Table *table = m_table.load(std::memory_order_relaxed);
+      Table *next = m_next.load(std::memory_order_relaxed);
+      size = table->size;
+      std::size_t slot;
+      if (next == nullptr) {
+        removed = table_remove(table, key, hash);
+      } else if (old_contains(table, key, hash, slot)) {
+        old_remove(table, slot);
+        removed = true;
+      } else {
+        removed = table_remove(next, key, hash);
+      }
+    }
+    if (removed) {
+      ThreadCount &thread_count = m_thread_counts[thread_id];
+      thread_count.count.fetch_sub(1, std::memory_order_relaxed);
+      if (++thread_count.removals % S_SHRINK_CHECK == 0 and
+          size > m_min_size and count() < std::intptr_t(size >> 3)) {
+        resize(size >> 1);
+      }
+    }
+    return removed;
+  }
+
   void print_table() {
     std::unordered_set<K> keys;
-    for (std::size_t i = 0; i < m_size.load(std::memory_order_relaxed); i++) {
-      K current_key = m_table[i];
-      if (current_key == KT::NullKey) {
+    Table *table = m_table.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < table->size; i++) {
+      K current_bucket = table->buckets[i];
+      if (current_bucket == KT::NullKey) {
         continue;
       }
+      const K current_key = Bucket::key(current_bucket);
       if (keys.find(current_key) != keys.end()) {
         std::cout << "ERROR: DUPLCIATE COPY OF KEY: " << current_key
                   << std::endl;
@@ -0,0 +1,123 @@
+#undef NDEBUG
+#include "allocators/glib_allocator.h"
+#include "allocators/intel_allocator.h"
+#include "allocators/jemalloc_allocator.h"
+#include "allocators/pool_allocator.h"
+#include "bench/arg_parsing.h"
+#include "bench/benchmark_config.h"
+#include "bench/benchmark_kcas.h"
+#include "bench/benchmark_summary.h"
+#include "mem-reclaimer/epoch.h"
+#include "mem-reclaimer/hazard_pointer.h"
+#include "mem-reclaimer/interval.h"
+#include "mem-reclaimer/leaky.h"
+#include "primitives/brown_kcas.h"
+#include "primitives/harris_kcas.h"
+#include <cassert>
+#include <cstdint>
+#include <sstream>
+
+using namespace concurrent_data_structures;
+
+namespace {
+
+// https://stackoverflow.com/a/3418285
+void replaceAll(std::string &str, const std::string &from,
+                const std::string &to) {
+  if (from.empty())
+    return;
+  size_t start_pos = 0;
+  while ((start_pos = str.find(from, start_pos)) != std::string::npos) {
+    str.replace(start_pos, from.length(), to);
+    start_pos += to.length();
+  }
+}
+} // namespace
+
+const std::string generate_file_name(const KCASBenchmarkConfig &config) {
+  std::stringstream file_name;
+  file_name << std::string("KCAS:") + get_kcas_name(config.kcas) +
+                   std::string(" Reclaimer:") +
+                   get_reclaimer_name(config.base.reclaimer)
+            << " A:" << get_allocator_name(config.base.allocator)
+            << " T:" << config.base.num_threads << " S:" << config.array_size
+            << " N:" << config.kcas_size << " O:" << config.overlap
+            << " U:" << config.updates << " K:" << config.htm_kcas
+            << " Y:" << config.base.background_reclamation
+            << std::string(".txt");
+  std::string human_file_name = file_name.str();
+  replaceAll(human_file_name, " ", "_");
+  return human_file_name;
+}
+
+template <template <class, class> class KCASSystem, class Allocator,
+          template <class> class Reclaimer>
+bool run_and_save(const KCASBenchmarkConfig &config) {
+  KCASBenchmark<Allocator, Reclaimer, KCASSystem> benchmark(config);
+  produce_summary(config, benchmark.bench(), generate_file_name(config),
+                  "kcas_keys.csv", "kcas_results.csv");
+  if (config.base.verify) {
+    assert(benchmark.test());
+  }
+  return true;
+}
+
+template <class Allocator, template <class> class Reclaimer>
+bool fix_kcas(const KCASBenchmarkConfig &config) {
+  switch (config.kcas) {
+  case KCASType::BROWN:
+    return run_and_save<BrownKCAS, Allocator, Reclaimer>(config);
+  case KCASType::HARRIS:
+    return run_and_save<HarrisKCAS, Allocator, Reclaimer>(config);
+  default:
+    return false;
+  }
+}
+
+template <template <class> class Reclaimer>
+bool fix_allocator(const KCASBenchmarkConfig &config) {
+  switch (config.base.allocator) {
+  case Allocator::Glibc:
+    return fix_kcas<GlibcAllocator, Reclaimer>(config);
+  case Allocator::JeMalloc:
+    return fix_kcas<JeMallocAllocator, Reclaimer>(config);
+  case Allocator::Intel:
+    return fix_kcas<IntelAllocator, Reclaimer>(config);
+  case Allocator::Pool:
+    return fix_kcas<PoolAllocator<JeMallocAllocator>, Reclaimer>(config);
+  default:
+    return false;
+  }
+}
+
+bool run(const KCASBenchmarkConfig &config) {
+  switch (config.base.reclaimer) {
+  case Reclaimer::Leaky:
+    return fix_allocator<LeakyReclaimer>(config);
+  case Reclaimer::Epoch:
+    return fix_allocator<EpochReclaimer>(config);
+  case Reclaimer::HazardPointer:
+    return fix_allocator<HazardPointerReclaimer>(config);
+  case Reclaimer::Interval:
+    return fix_allocator<IntervalReclaimer>(config);
+  default:
+    return false;
+  }
+}
+
+std::int32_t main(std::int32_t argc, char *argv[]) {
+
+  const KCASBenchmarkConfig config = parse_kcas_args(argc, argv);
+  if (config.base.papi_active) {
+    assert(PAPI_library_init(PAPI_VER_CURRENT) == PAPI_VER_CURRENT and
+           "Couldn't initialise PAPI library. Check installation.");
+  }
+  config.print(std::cout);
+  htm_kcas_enabled().store(config.htm_kcas);
+  background_reclamation_enabled().store(config.base.background_reclamation);
+  if (!run(config)) {
+    kcas_print_help_and_exit();
+  }
+  std::cout << "Finished." << std::endl;
+  return 0;
+}
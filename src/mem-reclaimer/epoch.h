@@ -17,13 +17,26 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "mem-reclaimer/reclaimer.h"
 #include "primitives/cache_utils.h"
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 namespace concurrent_data_structures {
 
+// A thread only tries to advance the epoch once every S_ADVANCE_PERIOD
+// operations, and then checks the epochs of at most S_SCAN_STRIDE threads,
+// carrying on from where its last attempt stopped. The epoch advances once
+// one thread has seen every thread reach it, so with many threads the cost
+// of checking them is spread over many operations rather than paid by each.
+//
+// With background reclamation on, the operation that finds a bag safe swaps
+// it for an empty one and a background thread frees the whole bag, so long
+// free loops stay off the operations' latency path.
 template <class Allocator>
 class EpochReclaimer : public ReclaimerAllocator<Allocator> {
 public:
@@ -37,26 +50,115 @@ public:
 
 private:
   static const std::size_t S_NUM_EPOCHS = 3;
+  static const std::size_t S_ADVANCE_PERIOD = 32;
+  static const std::size_t S_SCAN_STRIDE = 8;
+
+  // Only touched by its own thread, kept apart from the thread epochs that
+  // the others read.
+  struct ScanState {
+    std::size_t operations, epoch, next_thread;
+  };
+
+  typedef std::vector<EpochBase *> Bag;
+
+  // Safe bags wait in full until the background thread frees them, then go
+  // to empty to be swapped back in, so their capacity is reused.
+  struct Background {
+    std::mutex lock;
+    std::condition_variable ready;
+    std::vector<Bag> full, empty;
+    bool stopping;
+    std::thread thread;
+    Background() : stopping(false) {}
+  };
 
   const std::size_t m_num_threads;
   std::atomic_size_t m_global_epoch;
   CacheAligned<std::atomic_size_t> *m_thread_epochs;
+  CacheAligned<ScanState> *m_scan_states;
   std::vector<EpochBase *> **m_garbage_list;
+  // Null when garbage is freed inline.
+  Background *m_background;
 
-  bool try_increment_epoch(const std::size_t current) {
-    for (std::size_t t = 0; t < m_num_threads; t++) {
-      const std::size_t thread_epoch = m_thread_epochs[t].load();
+  // A thread seen at the current epoch stays there until it advances, so the
+  // threads checked by earlier attempts need not be checked again.
+  bool try_increment_epoch(const std::size_t current,
+                           const std::size_t thread_id) {
+    ScanState &scan = m_scan_states[thread_id];
+    if (scan.epoch != current) {
+      scan.epoch = current;
+      scan.next_thread = 0;
+    }
+    const std::size_t end =
+        std::min(scan.next_thread + S_SCAN_STRIDE, m_num_threads);
+    for (; scan.next_thread < end; scan.next_thread++) {
+      const std::size_t thread_epoch =
+          m_thread_epochs[scan.next_thread].load(std::memory_order_acquire);
       if (thread_epoch != current) {
         return false;
       }
     }
+    if (scan.next_thread != m_num_threads) {
+      return false;
+    }
+    scan.next_thread = 0;
     std::size_t temp_epoch = current;
-    return m_global_epoch.compare_exchange_weak(temp_epoch, current + 1);
+    return m_global_epoch.compare_exchange_strong(temp_epoch, current + 1,
+                                                  std::memory_order_acq_rel,
+                                                  std::memory_order_relaxed);
+  }
+
+  void hand_off(Bag &bag) {
+    if (bag.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> guard(m_background->lock);
+      m_background->full.emplace_back();
+      m_background->full.back().swap(bag);
+      if (!m_background->empty.empty()) {
+        bag.swap(m_background->empty.back());
+        m_background->empty.pop_back();
+      }
+    }
+    m_background->ready.notify_one();
+  }
+
+  // Takes every waiting bag at once and frees them outside the lock.
+  void background_routine() {
+    std::vector<Bag> batch;
+    std::unique_lock<std::mutex> guard(m_background->lock);
+    while (true) {
+      m_background->ready.wait(guard, [this]() {
+        return m_background->stopping or !m_background->full.empty();
+      });
+      if (m_background->full.empty()) {
+        return;
+      }
+      batch.swap(m_background->full);
+      guard.unlock();
+      for (std::size_t b = 0; b < batch.size(); b++) {
+        for (std::size_t i = 0; i < batch[b].size(); i++) {
+          Allocator::free(batch[b][i]);
+        }
+        batch[b].clear();
+      }
+      guard.lock();
+      for (std::size_t b = 0; b < batch.size(); b++) {
+        m_background->empty.emplace_back();
+        m_background->empty.back().swap(batch[b]);
+      }
+      batch.clear();
+    }
   }
 
   void clear_garbage(const std::size_t safe_epoch,
                      const std::size_t thread_id) {
     std::size_t index = safe_epoch % S_NUM_EPOCHS;
+    if (m_background != nullptr) {
+      hand_off(m_garbage_list[thread_id][index]);
+      return;
+    }
     for (std::size_t i = 0; i < m_garbage_list[thread_id][index].size(); i++) {
       Allocator::free(m_garbage_list[thread_id][index][i]);
     }
@@ -117,20 +219,40 @@ public:
         m_thread_epochs(
             static_cast<CacheAligned<std::atomic_size_t> *>(Allocator::malloc(
                 sizeof(CacheAligned<std::atomic_size_t>) * num_threads))),
+        m_scan_states(static_cast<CacheAligned<ScanState> *>(Allocator::malloc(
+            sizeof(CacheAligned<ScanState>) * num_threads))),
         m_garbage_list(
             static_cast<std::vector<EpochBase *> **>(Allocator::malloc(
-                sizeof(std::vector<EpochBase *> *) * num_threads))) {
+                sizeof(std::vector<EpochBase *> *) * num_threads))),
+        m_background(background_reclamation_enabled().load() ? new Background()
+                                                             : nullptr) {
     for (std::size_t t = 0; t < num_threads; t++) {
       m_garbage_list[t] = static_cast<std::vector<EpochBase *> *>(
           Allocator::malloc(sizeof(std::vector<EpochBase *>) * S_NUM_EPOCHS));
       m_thread_epochs[t].store(3, std::memory_order_relaxed);
+      m_scan_states[t].operations = 0;
+      m_scan_states[t].epoch = 3;
+      m_scan_states[t].next_thread = 0;
       for (std::size_t e = 0; e < S_NUM_EPOCHS; e++) {
         new (&m_garbage_list[t][e]) std::vector<EpochBase *>();
         m_garbage_list[t][e].reserve(200);
       }
     }
+    if (m_background != nullptr) {
+      m_background->thread =
+          std::thread(&EpochReclaimer::background_routine, this);
+    }
   }
   ~EpochReclaimer() {
+    if (m_background != nullptr) {
+      {
+        std::lock_guard<std::mutex> guard(m_background->lock);
+        m_background->stopping = true;
+      }
+      m_background->ready.notify_one();
+      m_background->thread.join();
+      delete m_background;
+    }
     std::cout << "Before: " << this->mallocs.load() << " " << this->frees.load()
               << " " << (this->mallocs.load() == this->frees.load())
               << std::endl;
@@ -149,25 +271,38 @@ public:
               << std::endl;
     Allocator::free(m_garbage_list);
     Allocator::free(m_thread_epochs);
+    Allocator::free(m_scan_states);
   }
 
   bool thread_init(const std::size_t thread_id) { return true; }
 
+  // Reading the new epoch acquires every unlink that preceded it, so this
+  // operation cannot reach a record retired two epochs back. Publishing with
+  // release orders the last operation's reads before the epoch is advanced
+  // past it.
   void enter(const std::size_t thread_id) {
-    const std::size_t epoch = m_thread_epochs[thread_id].load();
-    const std::size_t global_epoch = m_global_epoch.load();
+    const std::size_t epoch =
+        m_thread_epochs[thread_id].load(std::memory_order_relaxed);
+    const std::size_t global_epoch =
+        m_global_epoch.load(std::memory_order_acquire);
     if (epoch != global_epoch) {
       assert(global_epoch - epoch == 1);
       clear_garbage(global_epoch, thread_id);
-      m_thread_epochs[thread_id].store(global_epoch);
+      m_thread_epochs[thread_id].store(global_epoch,
+                                       std::memory_order_release);
     }
   }
 
   void exit(const std::size_t thread_id) {
-    const std::size_t epoch = m_thread_epochs[thread_id].load();
-    const std::size_t global_epoch = m_global_epoch.load();
+    if (++m_scan_states[thread_id].operations % S_ADVANCE_PERIOD != 0) {
+      return;
+    }
+    const std::size_t epoch =
+        m_thread_epochs[thread_id].load(std::memory_order_relaxed);
+    const std::size_t global_epoch =
+        m_global_epoch.load(std::memory_order_relaxed);
     if (epoch == global_epoch) {
-      try_increment_epoch(global_epoch);
+      try_increment_epoch(global_epoch, thread_id);
     }
   }
 
@@ -176,7 +311,8 @@ public:
   }
 
   void retire(const EpochHandle &handle, const std::size_t thread_id) {
-    const std::size_t epoch = m_thread_epochs[thread_id].load();
+    const std::size_t epoch =
+        m_thread_epochs[thread_id].load(std::memory_order_relaxed);
     m_garbage_list[thread_id][epoch % S_NUM_EPOCHS].push_back(handle.m_ptr);
   }
 };
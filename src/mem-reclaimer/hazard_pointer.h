@@ -0,0 +1,250 @@
+#pragma once
+
+/*
+Hazard pointer memory reclamation.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "mem-reclaimer/reclaimer.h"
+#include "primitives/cache_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+namespace concurrent_data_structures {
+
+// Each thread owns a fixed block of hazard slots, and every handle holds one
+// of them while it lives. A record is only freed once no slot names it, so
+// a stalled thread pins at most the records in its own slots, where with
+// epochs it holds up all reclamation.
+//
+// Retired records collect in a per-thread list. Once it reaches the scan
+// threshold, (S_SCAN_FACTOR + 1) times the number of slots, the thread
+// snapshots every slot, sorts them and frees each record not among them.
+// At most one record per slot survives a scan, so each scan frees at least
+// S_SCAN_FACTOR records per slot, and no thread holds more than the
+// threshold plus the slot count.
+template <class Allocator>
+class HazardPointerReclaimer : public ReclaimerAllocator<Allocator> {
+public:
+  class HazardBase {
+    static HazardBase *mask(const HazardBase *ptr) {
+      return reinterpret_cast<HazardBase *>(
+          reinterpret_cast<std::size_t>(ptr) & (~0x3));
+    }
+    friend class HazardPointerReclaimer;
+  };
+
+private:
+  typedef std::atomic<HazardBase *> HazardSlot;
+
+  // Fewest slots a thread gets, for callers nesting handles deeper than the
+  // table alone asks for, such as a table over Harris' K-CAS.
+  static const std::size_t S_MIN_SLOTS = 8;
+  // Free slots are tracked in one word per thread.
+  static const std::size_t S_MAX_SLOTS = sizeof(std::uint64_t) * 8;
+  static const std::size_t S_SCAN_FACTOR = 2;
+
+  struct ThreadState {
+    std::uint64_t free_slots;
+    std::vector<HazardBase *> retired;
+    std::vector<HazardBase *> hazards;
+    ThreadState(const std::size_t num_slots, const std::size_t threshold,
+                const std::size_t num_hazards)
+        : free_slots(num_slots == S_MAX_SLOTS
+                         ? ~std::uint64_t(0)
+                         : (std::uint64_t(1) << num_slots) - 1) {
+      retired.reserve(threshold);
+      hazards.reserve(num_hazards);
+    }
+  };
+
+  const std::size_t m_num_threads, m_num_slots, m_slot_stride,
+      m_scan_threshold;
+  HazardSlot *m_slots;
+  CacheAligned<ThreadState> *m_thread_states;
+
+  HazardSlot *slot_at(const std::size_t thread_id, const std::size_t slot) {
+    return &m_slots[thread_id * m_slot_stride + slot];
+  }
+
+  void scan(const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    // The retired records were unlinked before this fence, so a slot naming
+    // one after it was set before the record could be validated.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    state.hazards.clear();
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      for (std::size_t s = 0; s < m_num_slots; s++) {
+        HazardBase *hazard = slot_at(t, s)->load(std::memory_order_acquire);
+        if (hazard != nullptr) {
+          state.hazards.push_back(hazard);
+        }
+      }
+    }
+    std::sort(state.hazards.begin(), state.hazards.end());
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < state.retired.size(); i++) {
+      HazardBase *record = state.retired[i];
+      if (std::binary_search(state.hazards.begin(), state.hazards.end(),
+                             record)) {
+        state.retired[kept++] = record;
+      } else {
+        Allocator::free(record);
+      }
+    }
+    state.retired.resize(kept);
+  }
+
+public:
+  class HazardHandle {
+  private:
+    ThreadState *m_owner;
+    HazardSlot *m_slot;
+    std::uint64_t m_slot_bit;
+    HazardBase *m_ptr;
+
+    HazardHandle(ThreadState *owner, HazardSlot *slot,
+                 const std::uint64_t slot_bit)
+        : m_owner(owner), m_slot(slot), m_slot_bit(slot_bit),
+          m_ptr(nullptr) {}
+
+  public:
+    ~HazardHandle() {
+      if (m_owner != nullptr) {
+        m_slot->store(nullptr, std::memory_order_release);
+        m_owner->free_slots |= m_slot_bit;
+      }
+    }
+    HazardHandle(const HazardHandle &rhs) = delete;
+    HazardHandle &operator=(const HazardHandle &rhs) = delete;
+    HazardHandle(HazardHandle &&rhs)
+        : m_owner(rhs.m_owner), m_slot(rhs.m_slot), m_slot_bit(rhs.m_slot_bit),
+          m_ptr(rhs.m_ptr) {
+      rhs.m_owner = nullptr;
+    }
+    HazardHandle &operator=(HazardHandle &&rhs) {
+      std::swap(m_owner, rhs.m_owner);
+      std::swap(m_slot, rhs.m_slot);
+      std::swap(m_slot_bit, rhs.m_slot_bit);
+      std::swap(m_ptr, rhs.m_ptr);
+      return *this;
+    }
+
+    // For records the caller already knows to be safe, its own or ones
+    // another live handle protects.
+    void set(const HazardBase *ptr) {
+      m_ptr = HazardBase::mask(ptr);
+      m_slot->store(m_ptr, std::memory_order_release);
+    }
+
+    // Publishes f(ptr) and checks src still leads to it. If not, ptr is
+    // left at what src leads to now and the caller must try again.
+    template <class PtrType, class SourceType, typename Func>
+    bool try_protect(PtrType &ptr, const std::atomic<SourceType> &src, Func f) {
+      m_ptr = HazardBase::mask(f(ptr));
+      m_slot->store(m_ptr, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      const PtrType current = f(src.load(std::memory_order_acquire));
+      if (HazardBase::mask(current) == m_ptr) {
+        return true;
+      }
+      ptr = current;
+      return false;
+    }
+    template <class PtrType>
+    bool try_protect(PtrType &ptr, const std::atomic<PtrType> &src) noexcept {
+      return this->try_protect(ptr, src, [](PtrType ptr) { return ptr; });
+    }
+
+    template <class PtrType, class SourceType, typename Func>
+    PtrType get_protected(const std::atomic<SourceType> &src, Func f) {
+      PtrType ptr = f(src.load());
+      while (!try_protect(ptr, src, f))
+        ;
+      return ptr;
+    }
+    template <class PtrType>
+    PtrType get_protected(const std::atomic<PtrType> &src) noexcept {
+      return this->get_protected(src, [](PtrType ptr) { return ptr; });
+    }
+    friend class HazardPointerReclaimer;
+  };
+
+  typedef HazardBase RecordBase;
+  typedef HazardHandle RecordHandle;
+
+  HazardPointerReclaimer(const std::size_t num_threads,
+                         const std::size_t refs_per_thread)
+      : m_num_threads(num_threads),
+        m_num_slots(std::max(refs_per_thread, std::size_t(S_MIN_SLOTS))),
+        m_slot_stride((m_num_slots * sizeof(HazardSlot) + S_CACHE_ALIGNMENT -
+                       1) /
+                      S_CACHE_ALIGNMENT * S_CACHE_ALIGNMENT /
+                      sizeof(HazardSlot)),
+        m_scan_threshold((S_SCAN_FACTOR + 1) * m_num_slots * num_threads),
+        m_slots(static_cast<HazardSlot *>(Allocator::aligned_alloc(
+            S_CACHE_ALIGNMENT, sizeof(HazardSlot) * m_slot_stride *
+                                   num_threads))),
+        m_thread_states(static_cast<CacheAligned<ThreadState> *>(
+            Allocator::aligned_alloc(S_CACHE_ALIGNMENT,
+                                     sizeof(CacheAligned<ThreadState>) *
+                                         num_threads))) {
+    assert(m_num_slots <= S_MAX_SLOTS);
+    for (std::size_t i = 0; i < m_slot_stride * num_threads; i++) {
+      new (&m_slots[i]) HazardSlot(nullptr);
+    }
+    for (std::size_t t = 0; t < num_threads; t++) {
+      new (&m_thread_states[t]) CacheAligned<ThreadState>(
+          m_num_slots, m_scan_threshold, m_num_slots * num_threads);
+    }
+  }
+  ~HazardPointerReclaimer() {
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      ThreadState &state = m_thread_states[t];
+      for (std::size_t i = 0; i < state.retired.size(); i++) {
+        Allocator::free(state.retired[i]);
+      }
+      m_thread_states[t].~CacheAligned<ThreadState>();
+    }
+    Allocator::free(m_thread_states);
+    Allocator::free(m_slots);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  void enter(const std::size_t thread_id) {}
+
+  void exit(const std::size_t thread_id) {}
+
+  HazardHandle get_rec(const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    assert(state.free_slots != 0 and "Out of hazard slots.");
+    const std::size_t slot = __builtin_ctzll(state.free_slots);
+    const std::uint64_t slot_bit = std::uint64_t(1) << slot;
+    state.free_slots &= ~slot_bit;
+    return HazardHandle(&state, slot_at(thread_id, slot), slot_bit);
+  }
+
+  void retire(const HazardHandle &handle, const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    state.retired.push_back(handle.m_ptr);
+    if (state.retired.size() >= m_scan_threshold) {
+      scan(thread_id);
+    }
+  }
+};
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+/*
+Interval-based memory reclamation.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "mem-reclaimer/reclaimer.h"
+#include "primitives/cache_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace concurrent_data_structures {
+
+// Two global era interval-based reclamation. Every record notes the era it
+// was made in, and the era it was retired in. A thread reserves the interval
+// of eras from when its operation started to the latest era it has read a
+// pointer in, and a retired record is freed once its lifetime overlaps no
+// reserved interval.
+//
+// Protecting a pointer only loads the era and compares it with the end of
+// the thread's interval. Only when the era has moved on does the thread
+// extend its interval and fence. A stalled thread's interval stops growing,
+// so it holds back only records made before it stalled, however long it
+// stalls.
+//
+// The era advances every S_ERA_PERIOD retirements of a thread. Records take
+// their birth era when constructed, before it is known which reclaimer will
+// retire them, so the era is shared by every reclaimer over one allocator.
+template <class Allocator>
+class IntervalReclaimer : public ReclaimerAllocator<Allocator> {
+private:
+  static std::atomic<std::uint64_t> S_era;
+
+public:
+  class IntervalBase {
+    std::uint64_t m_birth_era;
+
+    static IntervalBase *mask(const IntervalBase *ptr) {
+      return reinterpret_cast<IntervalBase *>(
+          reinterpret_cast<std::size_t>(ptr) & (~0x3));
+    }
+
+  public:
+    IntervalBase() : m_birth_era(S_era.load(std::memory_order_acquire)) {}
+    friend class IntervalReclaimer;
+  };
+
+private:
+  static const std::uint64_t S_NO_ERA =
+      std::numeric_limits<std::uint64_t>::max();
+  static const std::size_t S_ERA_PERIOD = 64;
+  // Fewest retirements between scans. After a scan the next waits until the
+  // records kept have at least doubled, so records held back by a stalled
+  // thread are not scanned again on every retirement.
+  static const std::size_t S_SCAN_PERIOD = 128;
+
+  // Read by every scanning thread. An idle thread reserves no eras.
+  struct Reservation {
+    std::atomic<std::uint64_t> lower, upper;
+    Reservation() : lower(S_NO_ERA), upper(S_NO_ERA) {}
+  };
+
+  struct Retired {
+    IntervalBase *record;
+    std::uint64_t retire_era;
+  };
+
+  struct ThreadState {
+    Reservation *reservation;
+    // This thread's copy of reservation->upper.
+    std::uint64_t upper;
+    std::size_t depth, retirements, scan_at;
+    std::vector<Retired> retired;
+    std::vector<std::pair<std::uint64_t, std::uint64_t>> intervals;
+    ThreadState(Reservation *reservation, const std::size_t num_threads)
+        : reservation(reservation), upper(S_NO_ERA), depth(0),
+          retirements(0), scan_at(S_SCAN_PERIOD) {
+      retired.reserve(S_SCAN_PERIOD);
+      intervals.reserve(num_threads);
+    }
+
+    // The fence orders the reservation before any pointer read under it.
+    void extend(const std::uint64_t era) {
+      upper = era;
+      reservation->upper.store(era, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+  };
+
+  const std::size_t m_num_threads;
+  CacheAligned<Reservation> *m_reservations;
+  CacheAligned<ThreadState> *m_thread_states;
+
+  void scan(const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    // The retired records were unlinked before this fence, so a thread
+    // reserving after it cannot reach them.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    state.intervals.clear();
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      const std::uint64_t lower =
+          m_reservations[t].lower.load(std::memory_order_acquire);
+      const std::uint64_t upper =
+          m_reservations[t].upper.load(std::memory_order_acquire);
+      if (lower != S_NO_ERA) {
+        state.intervals.push_back(std::make_pair(lower, upper));
+      }
+    }
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < state.retired.size(); i++) {
+      const Retired retired = state.retired[i];
+      bool reserved = false;
+      for (std::size_t r = 0; r < state.intervals.size(); r++) {
+        if (retired.record->m_birth_era <= state.intervals[r].second and
+            retired.retire_era >= state.intervals[r].first) {
+          reserved = true;
+          break;
+        }
+      }
+      if (reserved) {
+        state.retired[kept++] = retired;
+      } else {
+        Allocator::free(retired.record);
+      }
+    }
+    state.retired.resize(kept);
+    state.scan_at = std::max(kept + S_SCAN_PERIOD, kept * 2);
+  }
+
+public:
+  class IntervalHandle {
+  private:
+    ThreadState *m_state;
+    IntervalBase *m_ptr;
+
+    IntervalHandle(ThreadState *state) : m_state(state), m_ptr(nullptr) {}
+
+  public:
+    ~IntervalHandle() {}
+    IntervalHandle(const IntervalHandle &rhs) = delete;
+    IntervalHandle &operator=(const IntervalHandle &rhs) = delete;
+    IntervalHandle(IntervalHandle &&rhs)
+        : m_state(rhs.m_state), m_ptr(rhs.m_ptr) {
+      rhs.m_ptr = nullptr;
+    }
+    IntervalHandle &operator=(IntervalHandle &&rhs) {
+      std::swap(m_state, rhs.m_state);
+      std::swap(m_ptr, rhs.m_ptr);
+      return *this;
+    }
+
+    void set(const IntervalBase *ptr) { m_ptr = IntervalBase::mask(ptr); }
+
+    // ptr was read before the era, so if the era is still the end of the
+    // interval ptr was read within it. Otherwise the interval is extended
+    // and src read again under it. If src has moved on, ptr is left at what
+    // it leads to now and the caller must try again.
+    template <class PtrType, class SourceType, typename Func>
+    bool try_protect(PtrType &ptr, const std::atomic<SourceType> &src, Func f) {
+      std::uint64_t era = S_era.load(std::memory_order_acquire);
+      if (era == m_state->upper) {
+        m_ptr = IntervalBase::mask(f(ptr));
+        return true;
+      }
+      PtrType current;
+      do {
+        m_state->extend(era);
+        current = f(src.load(std::memory_order_acquire));
+        era = S_era.load(std::memory_order_acquire);
+      } while (era != m_state->upper);
+      m_ptr = IntervalBase::mask(current);
+      if (m_ptr == IntervalBase::mask(f(ptr))) {
+        return true;
+      }
+      ptr = current;
+      return false;
+    }
+    template <class PtrType>
+    bool try_protect(PtrType &ptr, const std::atomic<PtrType> &src) noexcept {
+      return this->try_protect(ptr, src, [](PtrType ptr) { return ptr; });
+    }
+
+    template <class PtrType, class SourceType, typename Func>
+    PtrType get_protected(const std::atomic<SourceType> &src, Func f) {
+      PtrType ptr = f(src.load());
+      while (!try_protect(ptr, src, f))
+        ;
+      return ptr;
+    }
+    template <class PtrType>
+    PtrType get_protected(const std::atomic<PtrType> &src) noexcept {
+      return this->get_protected(src, [](PtrType ptr) { return ptr; });
+    }
+    friend class IntervalReclaimer;
+  };
+
+  typedef IntervalBase RecordBase;
+  typedef IntervalHandle RecordHandle;
+
+  IntervalReclaimer(const std::size_t num_threads,
+                    const std::size_t refs_per_thread)
+      : m_num_threads(num_threads),
+        m_reservations(static_cast<CacheAligned<Reservation> *>(
+            Allocator::aligned_alloc(S_CACHE_ALIGNMENT,
+                                     sizeof(CacheAligned<Reservation>) *
+                                         num_threads))),
+        m_thread_states(static_cast<CacheAligned<ThreadState> *>(
+            Allocator::aligned_alloc(S_CACHE_ALIGNMENT,
+                                     sizeof(CacheAligned<ThreadState>) *
+                                         num_threads))) {
+    for (std::size_t t = 0; t < num_threads; t++) {
+      new (&m_reservations[t]) CacheAligned<Reservation>();
+      new (&m_thread_states[t])
+          CacheAligned<ThreadState>(&m_reservations[t], num_threads);
+    }
+  }
+  ~IntervalReclaimer() {
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      ThreadState &state = m_thread_states[t];
+      for (std::size_t i = 0; i < state.retired.size(); i++) {
+        Allocator::free(state.retired[i].record);
+      }
+      m_thread_states[t].~CacheAligned<ThreadState>();
+      m_reservations[t].~CacheAligned<Reservation>();
+    }
+    Allocator::free(m_thread_states);
+    Allocator::free(m_reservations);
+  }
+
+  bool thread_init(const std::size_t thread_id) { return true; }
+
+  // Pins may nest, only the outermost reserves and releases.
+  void enter(const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    if (state.depth++ != 0) {
+      return;
+    }
+    const std::uint64_t era = S_era.load(std::memory_order_acquire);
+    state.reservation->lower.store(era, std::memory_order_relaxed);
+    state.extend(era);
+  }
+
+  void exit(const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    if (--state.depth != 0) {
+      return;
+    }
+    state.upper = S_NO_ERA;
+    state.reservation->lower.store(S_NO_ERA, std::memory_order_release);
+    state.reservation->upper.store(S_NO_ERA, std::memory_order_release);
+  }
+
+  IntervalHandle get_rec(const std::size_t thread_id) {
+    return IntervalHandle(&m_thread_states[thread_id]);
+  }
+
+  void retire(const IntervalHandle &handle, const std::size_t thread_id) {
+    ThreadState &state = m_thread_states[thread_id];
+    state.retired.push_back(
+        Retired{handle.m_ptr, S_era.load(std::memory_order_acquire)});
+    if (++state.retirements % S_ERA_PERIOD == 0) {
+      S_era.fetch_add(1, std::memory_order_acq_rel);
+    }
+    if (state.retired.size() >= state.scan_at) {
+      scan(thread_id);
+    }
+  }
+};
+
+template <class Allocator>
+std::atomic<std::uint64_t> IntervalReclaimer<Allocator>::S_era(1);
+}
@@ -23,7 +23,9 @@ namespace concurrent_data_structures {
 namespace {
 static const std::map<Reclaimer, std::string> reclaimer_map{
     std::make_pair(Reclaimer::Leaky, "Leaky"),
-    std::make_pair(Reclaimer::Epoch, "Epoch")};
+    std::make_pair(Reclaimer::Epoch, "Epoch"),
+    std::make_pair(Reclaimer::HazardPointer, "Hazard Pointer"),
+    std::make_pair(Reclaimer::Interval, "Interval")};
 }
 
 const std::string get_reclaimer_name(const Reclaimer reclaimer) {
@@ -23,9 +23,16 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 namespace concurrent_data_structures {
 
-enum class Reclaimer { Leaky, Epoch };
+enum class Reclaimer { Leaky, Epoch, HazardPointer, Interval };
 const std::string get_reclaimer_name(const Reclaimer reclaimer);
 
+// Process wide switch for handing safe garbage to a background thread to
+// free, rather than freeing it inline. Read when a reclaimer is built.
+inline std::atomic<bool> &background_reclamation_enabled() {
+  static std::atomic<bool> enabled{false};
+  return enabled;
+}
+
 template <class Allocator> class ReclaimerAllocator {
 public:
   std::atomic_size_t mallocs, frees;
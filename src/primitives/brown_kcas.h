@@ -20,10 +20,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 #include "mem-reclaimer/reclaimer.h"
+#include "primitives/kcas_fast_path.h"
+#include "primitives/kcas_read_set.h"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <new>
 #include <type_traits>
 
 namespace concurrent_data_structures {
@@ -35,13 +38,19 @@ private:
   static const std::size_t S_KCAS_TAG = 0x1;
   static const std::size_t S_RDCSS_TAG = 0x2;
 
-  // 8 Bits
+  // 12 bits, so up to 4096 threads.
   static const std::size_t S_THREAD_ID_SHIFT = 2;
-  static const std::size_t S_THREAD_ID_MASK = (1 << 8) - 1;
-
-  // 54 bits
-  static const std::size_t S_SEQUENCE_SHIFT = 10;
-  static const std::size_t S_SEQUENCE_MASK = (std::size_t(1) << 54) - 1;
+  static const std::size_t S_THREAD_ID_BITS = 12;
+  static const std::size_t S_THREAD_ID_MASK =
+      (std::size_t(1) << S_THREAD_ID_BITS) - 1;
+
+  // 50 bits. A helper can only be fooled by a sequence number if it stalls
+  // while the owner runs 2^50 more K-CAS operations, days at any real rate.
+  static const std::size_t S_SEQUENCE_SHIFT =
+      S_THREAD_ID_SHIFT + S_THREAD_ID_BITS;
+  static const std::size_t S_SEQUENCE_BITS = 64 - S_SEQUENCE_SHIFT;
+  static const std::size_t S_SEQUENCE_MASK =
+      (std::size_t(1) << S_SEQUENCE_BITS) - 1;
 
   enum class TagType {
     NONE,
@@ -52,7 +61,7 @@ private:
   struct KCASDescriptorStatus {
     static const std::uintptr_t UNDECIDED = 0, SUCCEEDED = 1, FAILED = 2;
     std::uintptr_t status : 8;
-    std::uintptr_t sequence_number : 54;
+    std::uintptr_t sequence_number : S_SEQUENCE_BITS;
 
     explicit KCASDescriptorStatus() : status(UNDECIDED), sequence_number(0) {}
     explicit KCASDescriptorStatus(const std::uintptr_t status,
@@ -152,7 +161,7 @@ private:
         TaggedPointer::get_sequence_number(ptr);
     RDCSSDescriptor *snapshot_target = &m_rdcss_descs[thread_id];
     const std::size_t before_sequence = snapshot_target->sequence_bits.load();
-    if (before_sequence != sequence_number) {
+    if ((before_sequence & S_SEQUENCE_MASK) != sequence_number) {
       assert(my_thread_id != thread_id);
       return false;
     }
@@ -164,7 +173,7 @@ private:
     snapshot->status_location = snapshot_target->status_location;
     // Check our sequence number again.
     const std::size_t after_sequence = snapshot_target->sequence_bits.load();
-    if (after_sequence != sequence_number) {
+    if ((after_sequence & S_SEQUENCE_MASK) != sequence_number) {
       assert(my_thread_id != thread_id);
       return false;
     }
@@ -246,6 +255,9 @@ public:
   class KCASDescriptor;
 
 private:
+  // Most K-CAS operations are short shifts, their entries live inside the
+  // descriptor. Longer ones spill into an overflow segment of DescriptorSize.
+  static const std::size_t S_INLINE_ENTRIES = 8;
   static const std::size_t DescriptorSize = 10000;
 
 public:
@@ -268,20 +280,64 @@ public:
     friend class KCASDescriptor;
   };
 
+  // Words read through record_value, for validate to check again.
+  template <class ValType>
+  using ReadSet = KCASReadSet<Allocator, KCASEntry<ValType>, ValType>;
+
   class KCASDescriptor {
   private:
     std::size_t m_descriptor_size;
     std::atomic<KCASDescriptorStatus> m_status;
     std::size_t m_num_entries;
-    DescriptorEntry m_entries[DescriptorSize];
+    // Either m_inline or m_overflow, always contiguous so they can be sorted.
+    DescriptorEntry *m_entries;
+    // Allocated the first time a K-CAS outgrows m_inline and kept until the
+    // descriptor is destroyed, as helpers may still be reading it.
+    DescriptorEntry *m_overflow;
+    std::size_t m_overflow_size;
+    DescriptorEntry m_inline[S_INLINE_ENTRIES];
 
     KCASDescriptor()
         : m_descriptor_size(DescriptorSize), m_status(KCASDescriptorStatus{}),
-          m_num_entries(0) {}
+          m_num_entries(0), m_entries(m_inline), m_overflow(nullptr),
+          m_overflow_size(0) {}
+    ~KCASDescriptor() {
+      if (m_overflow != nullptr) {
+        Allocator::free(m_overflow);
+      }
+    }
     KCASDescriptor(const KCASDescriptor &rhs) = delete;
     KCASDescriptor &operator=(const KCASDescriptor &rhs) = delete;
     KCASDescriptor &operator=(KCASDescriptor &&rhs) = delete;
 
+    // Points m_entries at storage for num_entries, leaving its contents
+    // undefined. Only grows the overflow segment of a private snapshot.
+    void reserve(const std::size_t num_entries) {
+      if (num_entries <= S_INLINE_ENTRIES) {
+        m_entries = m_inline;
+        return;
+      }
+      if (m_overflow_size < num_entries) {
+        if (m_overflow != nullptr) {
+          Allocator::free(m_overflow);
+        }
+        m_overflow = static_cast<DescriptorEntry *>(
+            Allocator::malloc(sizeof(DescriptorEntry) * num_entries));
+        m_overflow_size = num_entries;
+      }
+      m_entries = m_overflow;
+    }
+
+    DescriptorEntry &next_entry() {
+      const std::size_t cur_entry = m_num_entries++;
+      assert(cur_entry < m_descriptor_size);
+      if (cur_entry == S_INLINE_ENTRIES) {
+        reserve(m_descriptor_size);
+        std::copy(m_inline, m_inline + S_INLINE_ENTRIES, m_entries);
+      }
+      return m_entries[cur_entry];
+    }
+
     void increment_sequence() {
       KCASDescriptorStatus current_status =
           m_status.load(std::memory_order_relaxed);
@@ -316,11 +372,10 @@ public:
           KCASEntry<ValType>::to_raw_bits(desired);
       TaggedPointer desired_desc{desired_raw_bits << KCASShift};
       assert(TaggedPointer::is_bits(desired_desc));
-      const std::size_t cur_entry = m_num_entries++;
-      assert(cur_entry < m_descriptor_size);
-      m_entries[cur_entry].before = before_desc;
-      m_entries[cur_entry].desired = desired_desc;
-      m_entries[cur_entry].location = &location->m_entry;
+      DescriptorEntry &entry = next_entry();
+      entry.before = before_desc;
+      entry.desired = desired_desc;
+      entry.location = &location->m_entry;
     }
     template <class PtrType>
     void add_ptr(const KCASEntry<PtrType> *location, const PtrType &before,
@@ -332,19 +387,20 @@ public:
           KCASEntry<PtrType>::to_raw_bits(desired);
       TaggedPointer desired_desc{desired_raw_bits};
       assert(TaggedPointer::is_bits(desired_desc));
-      const std::size_t cur_entry = m_num_entries++;
-      assert(cur_entry < m_descriptor_size);
-      m_entries[cur_entry].before = before_desc;
-      m_entries[cur_entry].desired = desired_desc;
-      m_entries[cur_entry].location = &location->m_entry;
+      DescriptorEntry &entry = next_entry();
+      entry.before = before_desc;
+      entry.desired = desired_desc;
+      entry.location = &location->m_entry;
     }
     friend class BrownKCAS;
     template <class T> friend class CacheAligned;
   };
 
 private:
-  CacheAligned<KCASDescriptor> m_kcas_descs[144];
-  CacheAligned<RDCSSDescriptor> m_rdcss_descs[144];
+  // One of each per thread, indexed by the thread id in tagged pointers.
+  CacheAligned<KCASDescriptor> *m_kcas_descs;
+  CacheAligned<RDCSSDescriptor> *m_rdcss_descs;
+  KCASFastPath m_fast_path;
 
   bool try_snapshot(KCASDescriptor *snapshot, TaggedPointer ptr,
                     const std::size_t my_thread_id) {
@@ -356,13 +412,21 @@ private:
     const KCASDescriptorStatus before_status =
         snapshot_target->m_status.load(std::memory_order_acquire);
     const std::size_t num_entries = snapshot_target->m_num_entries;
+    const DescriptorEntry *entries = snapshot_target->m_entries;
     if (before_status.sequence_number != sequence_number) {
       //      assert(my_thread_id != thread_id);
       return false;
     }
-    for (std::size_t i = 0; i < num_entries; i++) {
-      snapshot->m_entries[i] = snapshot_target->m_entries[i];
+    // A torn read of a descriptor being refilled, the sequence check below
+    // would fail anyway but the copy must stay in bounds.
+    if (num_entries > (entries == snapshot_target->m_inline
+                           ? S_INLINE_ENTRIES
+                           : snapshot_target->m_overflow_size)) {
+      return false;
     }
+    // Only the entries in use are copied, usually just the inline ones.
+    snapshot->reserve(num_entries);
+    std::copy(entries, entries + num_entries, snapshot->m_entries);
     const KCASDescriptorStatus after_status = snapshot_target->m_status.load();
     if (after_status.sequence_number != sequence_number) {
       //      assert(my_thread_id != thread_id);
@@ -383,6 +447,9 @@ private:
     // This is the descriptor we're trying to complete.
     // We also have a snapshot of it as an argument.
     KCASDescriptor *original_desc = &m_kcas_descs[descriptor_thread_id];
+    if (help) {
+      m_fast_path.count_help(my_thread_id);
+    }
 
     // We have two windows into the state:
     // The first is the tagptr which has a state embeded within it.
@@ -461,25 +528,46 @@ private:
   }
 
 public:
+  static const std::size_t S_MAX_THREADS = S_THREAD_ID_MASK + 1;
+
   BrownKCAS(const std::size_t threads, MemReclaimer *reclaimer)
-      : m_num_threads(threads), m_descriptor_size(DescriptorSize) /*,
+      : m_num_threads(threads), m_descriptor_size(DescriptorSize),
         m_kcas_descs(static_cast<CacheAligned<KCASDescriptor> *>(
-            Allocator::malloc(sizeof(CacheAligned<KCASDescriptor>) * threads))),
-        m_rdcss_descs(
-            static_cast<CacheAligned<RDCSSDescriptor> *>(Allocator::malloc(
-                sizeof(CacheAligned<RDCSSDescriptor>) * threads)))*/ {
+            Allocator::aligned_alloc(
+                S_CACHE_ALIGNMENT,
+                sizeof(CacheAligned<KCASDescriptor>) * threads))),
+        m_rdcss_descs(static_cast<CacheAligned<RDCSSDescriptor> *>(
+            Allocator::aligned_alloc(
+                S_CACHE_ALIGNMENT,
+                sizeof(CacheAligned<RDCSSDescriptor>) * threads))),
+        m_fast_path(threads) {
+    assert(threads <= S_MAX_THREADS);
     for (std::size_t i = 0; i < m_num_threads; i++) {
+      new (&m_kcas_descs[i]) CacheAligned<KCASDescriptor>();
+      new (&m_rdcss_descs[i]) CacheAligned<RDCSSDescriptor>();
       m_kcas_descs[i].m_status.store(KCASDescriptorStatus{});
       m_kcas_descs[i].m_num_entries = 0;
       m_kcas_descs[i].m_descriptor_size = m_descriptor_size;
+      m_rdcss_descs[i].sequence_bits.store(0, std::memory_order_relaxed);
+    }
+  }
+  ~BrownKCAS() {
+    for (std::size_t i = 0; i < m_num_threads; i++) {
+      m_kcas_descs[i].~CacheAligned<KCASDescriptor>();
     }
+    Allocator::free(m_kcas_descs);
+    Allocator::free(m_rdcss_descs);
   }
+  BrownKCAS(const BrownKCAS &rhs) = delete;
+  BrownKCAS &operator=(const BrownKCAS &rhs) = delete;
 
   KCASDescriptor *create_descriptor(const std::size_t descriptor_size,
                                     const std::size_t thread_id) {
     // Increment the status sequence number.
+    assert(descriptor_size <= m_descriptor_size);
     m_kcas_descs[thread_id].increment_sequence();
     m_kcas_descs[thread_id].m_num_entries = 0;
+    m_kcas_descs[thread_id].m_entries = m_kcas_descs[thread_id].m_inline;
     return &m_kcas_descs[thread_id];
   }
 
@@ -487,6 +575,12 @@ public:
 
   bool cas(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
            KCASDescriptor *desc) {
+    const KCASOutcome outcome = m_fast_path.apply(
+        thread_id, desc->m_entries, desc->m_num_entries,
+        &DescriptorEntry::location, &TaggedPointer::raw_bits);
+    if (outcome != KCASOutcome::Fallback) {
+      return outcome == KCASOutcome::Succeeded;
+    }
     std::sort(
         desc->m_entries, desc->m_entries + desc->m_num_entries,
         [](const DescriptorEntry &lhs, const DescriptorEntry &rhs) -> bool {
@@ -499,6 +593,13 @@ public:
     return cas_internal(thread_id, ptr, desc);
   }
 
+  KCASStats stats() const { return m_fast_path.stats(); }
+
+  // K-CAS operations of others this thread has set out to finish so far.
+  std::uint64_t helps(const std::size_t thread_id) const {
+    return m_fast_path.helps(thread_id);
+  }
+
   template <class ValType>
   ValType
   read_value(const std::size_t my_thread_id, ReclaimerPin<MemReclaimer> &pin,
@@ -510,6 +611,7 @@ public:
           this->rdcss_read(&location->m_entry, my_thread_id, memory_order);
       // Could still be a K-CAS descriptor.
       if (TaggedPointer::is_kcas(desc)) {
+        m_fast_path.count_descriptor_read(my_thread_id);
         KCASDescriptor descriptor_snapshot;
         if (try_snapshot(&descriptor_snapshot, desc, my_thread_id)) {
           cas_internal(my_thread_id, desc, &descriptor_snapshot, true);
@@ -521,6 +623,37 @@ public:
     }
   }
 
+  // Reads a value and records it in the read set.
+  template <class ValType>
+  ValType record_value(const std::size_t thread_id,
+                       ReclaimerPin<MemReclaimer> &pin,
+                       const KCASEntry<ValType> *location,
+                       ReadSet<ValType> &reads) {
+    const ValType value = read_value(thread_id, pin, location);
+    reads.add(location, value);
+    return value;
+  }
+
+  // Whether every recorded word still holds the value it was read with, in
+  // one pass over the set. A plain word is checked with a single load, only
+  // words holding descriptors go through read_value to be helped along.
+  template <class ValType>
+  bool validate(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
+                const ReadSet<ValType> &reads) {
+    for (std::size_t i = 0; i < reads.size(); i++) {
+      const TaggedPointer current = reads[i].location->m_entry.load();
+      const ValType value =
+          TaggedPointer::is_bits(current)
+              ? ValType(KCASEntry<ValType>::from_raw_bits(current.raw_bits) >>
+                        KCASShift)
+              : read_value(thread_id, pin, reads[i].location);
+      if (value != reads[i].value) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   template <class PtrType>
   PtrType
   read_ptr(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
@@ -531,6 +664,7 @@ public:
       TaggedPointer desc = this->rdcss_read(location, thread_id, memory_order);
       // Could still be a K-CAS descriptor.
       if (TaggedPointer::is_kcas(desc)) {
+        m_fast_path.count_descriptor_read(thread_id);
         KCASDescriptor descriptor_snapshot;
         if (try_snapshot(&descriptor_snapshot, desc, thread_id)) {
           cas_internal(thread_id, desc, &descriptor_snapshot, true);
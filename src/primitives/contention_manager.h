@@ -0,0 +1,242 @@
+#pragma once
+
+/*
+Contention managers for retrying failed K-CAS operations.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "primitives/cache_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <immintrin.h>
+#include <thread>
+
+namespace concurrent_data_structures {
+
+// What a contention manager did, summed over threads. Retries counts failed
+// K-CAS operations, backoffs the ones followed by a wait and backoff spins
+// the pauses spent waiting.
+struct ContentionStats {
+  std::uint64_t retries, backoffs, backoff_spins;
+  ContentionStats() : retries(0), backoffs(0), backoff_spins(0) {}
+
+  ContentionStats since(const ContentionStats &earlier) const {
+    ContentionStats delta = *this;
+    delta.retries -= earlier.retries;
+    delta.backoffs -= earlier.backoffs;
+    delta.backoff_spins -= earlier.backoff_spins;
+    return delta;
+  }
+};
+
+// Per-thread state and counters shared by the managers. A manager is told
+// when an update begins and about every K-CAS it commits or fails, along with
+// the number of K-CAS operations the thread has helped so far, and decides
+// how long to wait before the update retries.
+class ContentionManagerBase {
+protected:
+  static const std::uint64_t S_SPINS_BEFORE_YIELD = 1 << 10;
+
+  struct ThreadState {
+    std::atomic<std::uint64_t> retries, backoffs, backoff_spins;
+    // Owned by the thread, only the karma is read by others.
+    std::atomic<std::uint64_t> karma;
+    std::uint64_t window, helps_at_start, random;
+  };
+
+  const std::size_t m_num_threads;
+  CacheAligned<ThreadState> *m_threads;
+
+  static void count(std::atomic<std::uint64_t> &counter,
+                    const std::uint64_t amount = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount,
+                  std::memory_order_relaxed);
+  }
+
+  // xorshift64, enough to spread out threads that failed together.
+  static std::uint64_t next_random(ThreadState &state) {
+    state.random ^= state.random << 13;
+    state.random ^= state.random >> 7;
+    state.random ^= state.random << 17;
+    return state.random;
+  }
+
+  static void pause(const std::uint64_t spin) {
+    if (spin < S_SPINS_BEFORE_YIELD) {
+      _mm_pause();
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  void spin(ThreadState &state, const std::uint64_t spins) {
+    count(state.backoffs);
+    count(state.backoff_spins, spins);
+    for (std::uint64_t s = 0; s < spins; s++) {
+      pause(s);
+    }
+  }
+
+public:
+  ContentionManagerBase(const std::size_t threads)
+      : m_num_threads(threads),
+        m_threads(new CacheAligned<ThreadState>[threads]) {
+    for (std::size_t t = 0; t < threads; t++) {
+      m_threads[t].retries.store(0, std::memory_order_relaxed);
+      m_threads[t].backoffs.store(0, std::memory_order_relaxed);
+      m_threads[t].backoff_spins.store(0, std::memory_order_relaxed);
+      m_threads[t].karma.store(0, std::memory_order_relaxed);
+      m_threads[t].window = 0;
+      m_threads[t].helps_at_start = 0;
+      m_threads[t].random = 0x9e3779b97f4a7c15ull * (t + 1);
+    }
+  }
+  ~ContentionManagerBase() { delete[] m_threads; }
+  ContentionManagerBase(const ContentionManagerBase &rhs) = delete;
+  ContentionManagerBase &operator=(const ContentionManagerBase &rhs) = delete;
+
+  ContentionStats stats() const {
+    ContentionStats stats;
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      stats.retries += m_threads[t].retries.load(std::memory_order_relaxed);
+      stats.backoffs += m_threads[t].backoffs.load(std::memory_order_relaxed);
+      stats.backoff_spins +=
+          m_threads[t].backoff_spins.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+};
+
+// Retries straight away, only counting the retries.
+class NoContentionManager : public ContentionManagerBase {
+public:
+  NoContentionManager(const std::size_t threads)
+      : ContentionManagerBase(threads) {}
+
+  void begin(const std::size_t thread_id, const std::uint64_t helps) {}
+
+  void succeeded(const std::size_t thread_id, const std::uint64_t helps) {}
+
+  void failed(const std::size_t thread_id, const std::uint64_t helps) {
+    count(m_threads[thread_id].retries);
+  }
+};
+
+// Waits a random time below a window that doubles with every failure of the
+// same update.
+class ExponentialBackoffManager : public ContentionManagerBase {
+private:
+  static const std::uint64_t S_MIN_WINDOW = 1 << 3;
+  static const std::uint64_t S_MAX_WINDOW = 1 << 10;
+
+protected:
+  void backoff(ThreadState &state) {
+    state.window = state.window == 0
+                       ? S_MIN_WINDOW
+                       : std::min(state.window << 1, std::uint64_t(S_MAX_WINDOW));
+    spin(state, next_random(state) & (state.window - 1));
+  }
+
+public:
+  ExponentialBackoffManager(const std::size_t threads)
+      : ContentionManagerBase(threads) {}
+
+  void begin(const std::size_t thread_id, const std::uint64_t helps) {
+    m_threads[thread_id].window = 0;
+  }
+
+  void succeeded(const std::size_t thread_id, const std::uint64_t helps) {}
+
+  void failed(const std::size_t thread_id, const std::uint64_t helps) {
+    ThreadState &state = m_threads[thread_id];
+    count(state.retries);
+    backoff(state);
+  }
+};
+
+// Karma: every failure of an update raises its thread's priority. A thread
+// that fails waits while another thread has more karma, so the update that
+// has lost most often gets to go first. The wait is bounded as the richer
+// thread may have been descheduled.
+class KarmaManager : public ContentionManagerBase {
+private:
+  static const std::uint64_t S_MAX_WAIT = 1 << 11;
+  static const std::uint64_t S_CHECK_INTERVAL = 1 << 4;
+
+  bool outranked(const std::size_t thread_id, const std::uint64_t karma) {
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      if (t != thread_id and
+          m_threads[t].karma.load(std::memory_order_relaxed) > karma) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+public:
+  KarmaManager(const std::size_t threads) : ContentionManagerBase(threads) {}
+
+  void begin(const std::size_t thread_id, const std::uint64_t helps) {
+    m_threads[thread_id].karma.store(0, std::memory_order_relaxed);
+  }
+
+  void succeeded(const std::size_t thread_id, const std::uint64_t helps) {
+    m_threads[thread_id].karma.store(0, std::memory_order_relaxed);
+  }
+
+  void failed(const std::size_t thread_id, const std::uint64_t helps) {
+    ThreadState &state = m_threads[thread_id];
+    count(state.retries);
+    const std::uint64_t karma =
+        state.karma.load(std::memory_order_relaxed) + 1;
+    state.karma.store(karma, std::memory_order_relaxed);
+    std::uint64_t spins = 0;
+    while (spins < S_MAX_WAIT and outranked(thread_id, karma)) {
+      for (std::uint64_t s = 0; s < S_CHECK_INTERVAL; s++, spins++) {
+        pause(spins);
+      }
+    }
+    if (spins != 0) {
+      count(state.backoffs);
+      count(state.backoff_spins, spins);
+    }
+  }
+};
+
+// Retries straight away until the update has helped S_HELP_LIMIT other
+// K-CAS operations, then backs off exponentially. Helping is what turns a
+// hot region into a storm, so a thread that keeps finding others in its way
+// steps aside and leaves them to finish.
+class HelpingLimitManager : public ExponentialBackoffManager {
+private:
+  static const std::uint64_t S_HELP_LIMIT = 4;
+
+public:
+  HelpingLimitManager(const std::size_t threads)
+      : ExponentialBackoffManager(threads) {}
+
+  void begin(const std::size_t thread_id, const std::uint64_t helps) {
+    m_threads[thread_id].window = 0;
+    m_threads[thread_id].helps_at_start = helps;
+  }
+
+  void failed(const std::size_t thread_id, const std::uint64_t helps) {
+    ThreadState &state = m_threads[thread_id];
+    count(state.retries);
+    if (helps - state.helps_at_start >= S_HELP_LIMIT) {
+      backoff(state);
+    }
+  }
+};
+}
@@ -20,6 +20,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 #include "mem-reclaimer/reclaimer.h"
+#include "primitives/kcas_fast_path.h"
+#include "primitives/kcas_read_set.h"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
@@ -184,6 +186,7 @@ private:
 
   static const std::size_t KCASShift = 2;
   MemReclaimer *m_reclaimer;
+  KCASFastPath m_fast_path;
 
   bool cas_internal(const std::size_t thread_id, const DescriptorUnion desc,
                     ReclaimerPin<MemReclaimer> &pin, RecordHandle &found_kcas,
@@ -192,6 +195,9 @@ private:
     assert(DescriptorUnion::is_kcas(desc));
     KCASDescriptor *kcas_descriptor =
         DescriptorUnion::mask_bits(desc).kcas_descriptor;
+    if (help) {
+      m_fast_path.count_help(thread_id);
+    }
     // If there is work to do, go ahead!
     // If there is work to do, go ahead!
     const std::size_t num_entries = kcas_descriptor->m_num_entries;
@@ -277,6 +283,10 @@ public:
     friend class KCASDescriptor;
   };
 
+  // Words read through record_value, for validate to check again.
+  template <class ValType>
+  using ReadSet = KCASReadSet<Allocator, KCASEntry<ValType>, ValType>;
+
   class KCASDescriptor : public RecordBase {
   private:
     std::size_t state, thread_id;
@@ -334,7 +344,7 @@ public:
   // we find, 1 for our RDCSS, nd 1 for any RDCSS descriptors
   // we find trying to install our own.
   HarrisKCAS(const std::size_t threads, MemReclaimer *reclaimer)
-      : m_reclaimer(reclaimer) {}
+      : m_reclaimer(reclaimer), m_fast_path(threads) {}
 
   KCASDescriptor *create_descriptor(const std::size_t descriptor_size,
                                     const std::size_t thread_id) {
@@ -352,6 +362,14 @@ public:
 
   bool cas(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
            KCASDescriptor *desc) {
+    // A descriptor committed on a fast path was never published.
+    const KCASOutcome outcome = m_fast_path.apply(
+        thread_id, desc->m_descriptors, desc->m_num_entries,
+        &EntryPayload::data_location, &DescriptorUnion::bits);
+    if (outcome != KCASOutcome::Fallback) {
+      free_descriptor(desc);
+      return outcome == KCASOutcome::Succeeded;
+    }
     std::sort(desc->m_descriptors, desc->m_descriptors + desc->m_num_entries,
               [](const EntryPayload &lhs, const EntryPayload &rhs) -> bool {
                 return lhs.data_location < rhs.data_location;
@@ -367,6 +385,13 @@ public:
     return res;
   }
 
+  KCASStats stats() const { return m_fast_path.stats(); }
+
+  // K-CAS operations of others this thread has set out to finish so far.
+  std::uint64_t helps(const std::size_t thread_id) const {
+    return m_fast_path.helps(thread_id);
+  }
+
   template <class ValType>
   ValType
   read_value(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
@@ -382,6 +407,7 @@ public:
           &location->m_entry, memory_order, found_kcas);
       // Could still be a K-CAS descriptor.
       if (DescriptorUnion::is_kcas(desc)) {
+        m_fast_path.count_descriptor_read(thread_id);
         cas_internal(thread_id, desc, pin, found_kcas, our_rdcss, found_rdcss,
                      true);
         continue;
@@ -392,6 +418,39 @@ public:
     }
   }
 
+  // Reads a value and records it in the read set.
+  template <class ValType>
+  ValType record_value(const std::size_t thread_id,
+                       ReclaimerPin<MemReclaimer> &pin,
+                       const KCASEntry<ValType> *location,
+                       ReadSet<ValType> &reads) {
+    const ValType value = read_value(thread_id, pin, location);
+    reads.add(location, value);
+    return value;
+  }
+
+  // Whether every recorded word still holds the value it was read with, in
+  // one pass over the set. A plain word is checked with a single load, only
+  // words holding descriptors go through read_value to be helped along.
+  template <class ValType>
+  bool validate(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
+                const ReadSet<ValType> &reads) {
+    for (std::size_t i = 0; i < reads.size(); i++) {
+      DescriptorUnion current = reads[i].location->m_entry.load();
+      ValType value;
+      if (DescriptorUnion::is_bits(current)) {
+        current.bits >>= KCASShift;
+        value = KCASEntry<ValType>::from_union(current);
+      } else {
+        value = read_value(thread_id, pin, reads[i].location);
+      }
+      if (value != reads[i].value) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   template <class PtrType>
   PtrType
   read_ptr(const std::size_t thread_id, ReclaimerPin<MemReclaimer> &pin,
@@ -405,6 +464,7 @@ public:
           RDCSSDescriptor::rdcss_read(location, memory_order, found_kcas);
       // Could still be a K-CAS descriptor.
       if (DescriptorUnion::is_kcas(desc)) {
+        m_fast_path.count_descriptor_read(thread_id);
         cas_internal(thread_id, desc, pin, found_kcas, our_rdcss, found_rdcss,
                      true);
         continue;
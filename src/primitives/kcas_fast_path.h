@@ -0,0 +1,257 @@
+#pragma once
+
+/*
+Fast paths committing K-CAS without descriptors.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "primitives/cache_utils.h"
+#include "primitives/locks.h"
+#include <atomic>
+#include <cpuid.h>
+#include <cstdint>
+#include <immintrin.h>
+
+namespace concurrent_data_structures {
+
+// How K-CAS operations were committed, summed over threads. Helps counts
+// the times a thread set out to finish another thread's K-CAS, descriptor
+// reads the reads that found a word holding a K-CAS descriptor.
+struct KCASStats {
+  std::uint64_t operations, dcas_commits, dcas_failures, htm_commits,
+      htm_failures, htm_aborts, fallbacks, helps, descriptor_reads;
+  KCASStats()
+      : operations(0), dcas_commits(0), dcas_failures(0), htm_commits(0),
+        htm_failures(0), htm_aborts(0), fallbacks(0), helps(0),
+        descriptor_reads(0) {}
+
+  KCASStats since(const KCASStats &earlier) const {
+    KCASStats delta = *this;
+    delta.operations -= earlier.operations;
+    delta.dcas_commits -= earlier.dcas_commits;
+    delta.dcas_failures -= earlier.dcas_failures;
+    delta.htm_commits -= earlier.htm_commits;
+    delta.htm_failures -= earlier.htm_failures;
+    delta.htm_aborts -= earlier.htm_aborts;
+    delta.fallbacks -= earlier.fallbacks;
+    delta.helps -= earlier.helps;
+    delta.descriptor_reads -= earlier.descriptor_reads;
+    return delta;
+  }
+};
+
+// Process wide switch for the HTM fast path, so runs can compare it against
+// the software protocol alone. Read when a K-CAS system is built.
+inline std::atomic<bool> &htm_kcas_enabled() {
+  static std::atomic<bool> enabled{true};
+  return enabled;
+}
+
+// Whether cmpxchg16b is available, from CPUID leaf 1.
+inline bool dcas_supported() {
+  static const bool supported = [] {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    return (ecx & bit_CMPXCHG16B) != 0;
+  }();
+  return supported;
+}
+
+enum class KCASOutcome { Succeeded, Failed, Fallback };
+
+// Tries to commit a K-CAS without installing any descriptors, before the
+// software protocol runs. Entries need location, before and desired fields,
+// the words a raw bits field with the two low bits tagging descriptors.
+//
+// Two entries on the halves of one 16 byte aligned pair are committed with a
+// single cmpxchg16b. Anything else up to S_MAX_ENTRIES is applied in one RTM
+// transaction which reads every word, so a descriptor being installed over
+// any of them aborts it. A word already holding a descriptor sends the K-CAS
+// to the software protocol, which helps it along. Words holding a different
+// value fail the K-CAS straight away, which is linearizable as both paths
+// read all the words atomically. Readers need no changes, committed words
+// are plain values.
+//
+// It also keeps the per-thread counters of the software protocol, so one
+// object holds every K-CAS statistic.
+class KCASFastPath {
+private:
+  static const std::uint32_t S_MAX_ATTEMPTS = 3;
+  // Longer descriptors would only abort on capacity.
+  static const std::size_t S_MAX_ENTRIES = 64;
+  static const unsigned int S_DESCRIPTOR_FOUND = 0xfe;
+  static const std::uintptr_t S_DESCRIPTOR_BITS = 0x3;
+  static const std::uintptr_t S_PAIR_ALIGNMENT = 16;
+
+  __extension__ typedef unsigned __int128 Pair;
+
+  struct Counters {
+    std::atomic<std::uint64_t> operations, dcas_commits, dcas_failures,
+        htm_commits, htm_failures, htm_aborts, fallbacks, helps,
+        descriptor_reads;
+  };
+
+  const bool m_dcas, m_htm;
+  const std::size_t m_num_threads;
+  CacheAligned<Counters> *m_counters;
+
+  static void count(std::atomic<std::uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  }
+
+  template <class Word> static bool is_pair(const std::atomic<Word> *low,
+                                            const std::atomic<Word> *high) {
+    return high == low + 1 and
+           (reinterpret_cast<std::uintptr_t>(low) & (S_PAIR_ALIGNMENT - 1)) ==
+               0;
+  }
+
+  template <class Entry, class Word>
+  __attribute__((target("cx16"))) KCASOutcome
+  dcas(Counters &counters, const Entry &low, const Entry &high,
+       std::atomic<Word> *Entry::*location, std::uintptr_t Word::*bits) {
+    const Pair expected =
+        Pair(low.before.*bits) | (Pair(high.before.*bits) << 64);
+    const Pair desired =
+        Pair(low.desired.*bits) | (Pair(high.desired.*bits) << 64);
+    const Pair found = __sync_val_compare_and_swap(
+        reinterpret_cast<Pair *>(low.*location), expected, desired);
+    if (found == expected) {
+      count(counters.dcas_commits);
+      return KCASOutcome::Succeeded;
+    }
+    if (((std::uintptr_t(found) | std::uintptr_t(found >> 64)) &
+         S_DESCRIPTOR_BITS) != 0) {
+      return KCASOutcome::Fallback;
+    }
+    count(counters.dcas_failures);
+    return KCASOutcome::Failed;
+  }
+
+  template <class Entry, class Word>
+  __attribute__((target("rtm"))) KCASOutcome
+  htm(Counters &counters, const Entry *entries, const std::size_t num_entries,
+      std::atomic<Word> *Entry::*location, std::uintptr_t Word::*bits) {
+    for (std::uint32_t attempt = 0; attempt < S_MAX_ATTEMPTS; attempt++) {
+      const unsigned int status = _xbegin();
+      if (status == _XBEGIN_STARTED) {
+        for (std::size_t i = 0; i < num_entries; i++) {
+          const Word current =
+              (entries[i].*location)->load(std::memory_order_relaxed);
+          if ((current.*bits & S_DESCRIPTOR_BITS) != 0) {
+            _xabort(S_DESCRIPTOR_FOUND);
+          }
+          if (current.*bits != entries[i].before.*bits) {
+            _xend();
+            count(counters.htm_failures);
+            return KCASOutcome::Failed;
+          }
+        }
+        for (std::size_t i = 0; i < num_entries; i++) {
+          (entries[i].*location)
+              ->store(entries[i].desired, std::memory_order_relaxed);
+        }
+        _xend();
+        count(counters.htm_commits);
+        return KCASOutcome::Succeeded;
+      }
+      count(counters.htm_aborts);
+      if (!(status & _XABORT_CONFLICT) or (status & _XABORT_EXPLICIT)) {
+        break;
+      }
+    }
+    return KCASOutcome::Fallback;
+  }
+
+public:
+  KCASFastPath(const std::size_t threads)
+      : m_dcas(dcas_supported()),
+        m_htm(htm_supported() and htm_kcas_enabled().load()),
+        m_num_threads(threads),
+        m_counters(new CacheAligned<Counters>[threads]) {
+    for (std::size_t t = 0; t < threads; t++) {
+      m_counters[t].operations.store(0, std::memory_order_relaxed);
+      m_counters[t].dcas_commits.store(0, std::memory_order_relaxed);
+      m_counters[t].dcas_failures.store(0, std::memory_order_relaxed);
+      m_counters[t].htm_commits.store(0, std::memory_order_relaxed);
+      m_counters[t].htm_failures.store(0, std::memory_order_relaxed);
+      m_counters[t].htm_aborts.store(0, std::memory_order_relaxed);
+      m_counters[t].fallbacks.store(0, std::memory_order_relaxed);
+      m_counters[t].helps.store(0, std::memory_order_relaxed);
+      m_counters[t].descriptor_reads.store(0, std::memory_order_relaxed);
+    }
+  }
+  ~KCASFastPath() { delete[] m_counters; }
+  KCASFastPath(const KCASFastPath &rhs) = delete;
+  KCASFastPath &operator=(const KCASFastPath &rhs) = delete;
+
+  template <class Entry, class Word>
+  KCASOutcome apply(const std::size_t thread_id, const Entry *entries,
+                    const std::size_t num_entries,
+                    std::atomic<Word> *Entry::*location,
+                    std::uintptr_t Word::*bits) {
+    Counters &counters = m_counters[thread_id];
+    count(counters.operations);
+    KCASOutcome outcome = KCASOutcome::Fallback;
+    if (m_dcas and num_entries == 2 and
+        is_pair(entries[0].*location, entries[1].*location)) {
+      outcome = dcas(counters, entries[0], entries[1], location, bits);
+    } else if (m_dcas and num_entries == 2 and
+               is_pair(entries[1].*location, entries[0].*location)) {
+      outcome = dcas(counters, entries[1], entries[0], location, bits);
+    } else if (m_htm and num_entries <= S_MAX_ENTRIES) {
+      outcome = htm(counters, entries, num_entries, location, bits);
+    }
+    if (outcome == KCASOutcome::Fallback) {
+      count(counters.fallbacks);
+    }
+    return outcome;
+  }
+
+  void count_help(const std::size_t thread_id) {
+    count(m_counters[thread_id].helps);
+  }
+
+  void count_descriptor_read(const std::size_t thread_id) {
+    count(m_counters[thread_id].descriptor_reads);
+  }
+
+  std::uint64_t helps(const std::size_t thread_id) const {
+    return m_counters[thread_id].helps.load(std::memory_order_relaxed);
+  }
+
+  KCASStats stats() const {
+    KCASStats stats;
+    for (std::size_t t = 0; t < m_num_threads; t++) {
+      const Counters &counters = m_counters[t];
+      stats.operations += counters.operations.load(std::memory_order_relaxed);
+      stats.dcas_commits +=
+          counters.dcas_commits.load(std::memory_order_relaxed);
+      stats.dcas_failures +=
+          counters.dcas_failures.load(std::memory_order_relaxed);
+      stats.htm_commits += counters.htm_commits.load(std::memory_order_relaxed);
+      stats.htm_failures +=
+          counters.htm_failures.load(std::memory_order_relaxed);
+      stats.htm_aborts += counters.htm_aborts.load(std::memory_order_relaxed);
+      stats.fallbacks += counters.fallbacks.load(std::memory_order_relaxed);
+      stats.helps += counters.helps.load(std::memory_order_relaxed);
+      stats.descriptor_reads +=
+          counters.descriptor_reads.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+};
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+Read sets for validating multi-word K-CAS snapshots.
+Copyright (C) 2018  Robert Kelly
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+namespace concurrent_data_structures {
+
+// The words a reader depends on, each with the value it saw. A K-CAS system
+// records into it with record_value and checks it with validate, which
+// re-reads the recorded words directly and stops at the first one that
+// changed. The first S_INLINE_READS live inside the set, so short probes
+// never touch the heap. Longer ones spill to a buffer that is kept across
+// clear, so a retrying reader allocates at most once.
+template <class Allocator, class Entry, class ValType> class KCASReadSet {
+public:
+  struct Read {
+    const Entry *location;
+    ValType value;
+  };
+
+private:
+  static const std::size_t S_INLINE_READS = 16;
+
+  Read *m_reads;
+  std::size_t m_size, m_capacity;
+  Read m_inline[S_INLINE_READS];
+
+  void grow() {
+    const std::size_t capacity = m_capacity << 1;
+    Read *reads = static_cast<Read *>(Allocator::malloc(sizeof(Read) * capacity));
+    std::copy(m_reads, m_reads + m_size, reads);
+    if (m_reads != m_inline) {
+      Allocator::free(m_reads);
+    }
+    m_reads = reads;
+    m_capacity = capacity;
+  }
+
+public:
+  KCASReadSet() : m_reads(m_inline), m_size(0), m_capacity(S_INLINE_READS) {}
+  ~KCASReadSet() {
+    if (m_reads != m_inline) {
+      Allocator::free(m_reads);
+    }
+  }
+  KCASReadSet(const KCASReadSet &rhs) = delete;
+  KCASReadSet &operator=(const KCASReadSet &rhs) = delete;
+
+  void add(const Entry *location, const ValType &value) {
+    if (m_size == m_capacity) {
+      grow();
+    }
+    m_reads[m_size++] = Read{location, value};
+  }
+
+  void clear() { m_size = 0; }
+
+  std::size_t size() const { return m_size; }
+
+  const Read &operator[](const std::size_t index) const {
+    assert(index < m_size);
+    return m_reads[index];
+  }
+
+  const Read &back() const {
+    assert(m_size > 0);
+    return m_reads[m_size - 1];
+  }
+};
+}
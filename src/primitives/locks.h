@@ -18,10 +18,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 
 
+#include <algorithm>
 #include <atomic>
+#include <cassert>
+#include <cpuid.h>
+#include <cstdint>
 #include <cstdlib>
 #include <immintrin.h>
 #include <pthread.h>
+#include <thread>
 
 namespace concurrent_data_structures {
 
@@ -47,58 +52,259 @@ public:
   void lock() { pthread_mutex_lock(&m_lock); }
   void unlock() { pthread_mutex_unlock(&m_lock); }
 };
-}
 
-class alignas(128) ElidedLock {
+// FIFO spin lock. Waiters back off in proportion to how far they are from
+// the front of the queue, so the owner's release is not fighting every
+// waiter for the line. Long waits yield, as with more threads than cores the
+// next owner may not be running.
+class alignas(128) TicketLock {
 private:
-  static const std::size_t MAX_RETRIES = 20;
-  std::atomic_bool m_lock;
+  static const std::uint32_t S_SPINS_BEFORE_YIELD = 1 << 8;
+  std::atomic<std::uint32_t> m_next, m_owner;
 
 public:
-  ElidedLock() { m_lock.store(false, std::memory_order_relaxed); }
-  ElidedLock &operator=(const ElidedLock &rhs) {
-    m_lock.store(rhs.m_lock.load(std::memory_order_relaxed),
+  TicketLock() {
+    m_next.store(0, std::memory_order_relaxed);
+    m_owner.store(0, std::memory_order_relaxed);
+  }
+  TicketLock &operator=(const TicketLock &rhs) {
+    m_next.store(rhs.m_next.load(std::memory_order_relaxed),
                  std::memory_order_relaxed);
+    m_owner.store(rhs.m_owner.load(std::memory_order_relaxed),
+                  std::memory_order_relaxed);
     return *this;
   }
+
   void lock() {
-    for (std::size_t i = 0; i < MAX_RETRIES; i++) {
+    const std::uint32_t ticket =
+        m_next.fetch_add(1, std::memory_order_relaxed);
+    for (std::uint32_t spins = 0;;) {
+      const std::uint32_t owner = m_owner.load(std::memory_order_acquire);
+      if (owner == ticket) {
+        return;
+      }
+      for (std::uint32_t i = ticket - owner; i > 0; i--, spins++) {
+        _mm_pause();
+      }
+      if (spins >= S_SPINS_BEFORE_YIELD) {
+        spins = 0;
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  void unlock() {
+    m_owner.store(m_owner.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+  }
+
+  bool is_locked() const {
+    return m_next.load(std::memory_order_relaxed) !=
+           m_owner.load(std::memory_order_relaxed);
+  }
+};
+
+// Abort causes seen by an ElidedLock, along with how often it fell back to
+// taking the lock and its retry budget when sampled.
+struct ElisionStats {
+  std::uint64_t conflict_aborts, capacity_aborts, explicit_aborts,
+      nested_aborts, other_aborts, fallbacks, retry_budget;
+  ElisionStats()
+      : conflict_aborts(0), capacity_aborts(0), explicit_aborts(0),
+        nested_aborts(0), other_aborts(0), fallbacks(0), retry_budget(0) {}
+
+  // Counts accumulated since an earlier sample. The budget is kept.
+  ElisionStats since(const ElisionStats &earlier) const {
+    ElisionStats delta = *this;
+    delta.conflict_aborts -= earlier.conflict_aborts;
+    delta.capacity_aborts -= earlier.capacity_aborts;
+    delta.explicit_aborts -= earlier.explicit_aborts;
+    delta.nested_aborts -= earlier.nested_aborts;
+    delta.other_aborts -= earlier.other_aborts;
+    delta.fallbacks -= earlier.fallbacks;
+    return delta;
+  }
+};
+
+// Whether restricted transactional memory can be used, read from CPUID leaf 7
+// once. Microcode that disables TSX either clears the RTM bit or sets
+// RTM_ALWAYS_ABORT, where every transaction would abort.
+inline bool htm_supported() {
+  static const bool supported = [] {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+    const unsigned int rtm = 1 << 11, rtm_always_abort = 1 << 11;
+    return (ebx & rtm) != 0 and (edx & rtm_always_abort) == 0;
+  }();
+  return supported;
+}
+}
+
+// Lock elision, falling back to a ticket lock. Transactions subscribe to the
+// ticket lock by reading it, so taking it aborts them. Whether transactions
+// are tried at all is settled once per lock, from htm_supported. On CPUs
+// without TSX, or with it disabled, the lock is a plain ticket lock.
+//
+// The retry budget adapts: it halves whenever an acquisition spends all of it
+// and creeps back up by one per commit. Capacity and nested aborts will
+// not succeed on retry, so they take the lock at once, and a capacity abort
+// also sends the next few acquisitions straight to the lock. Aborts caused by
+// the lock being held wait for it to be released and retry without spending
+// budget, so one thread falling back does not drag the others onto the lock
+// after it. Abort causes are counted per lock, off the transactional path.
+class alignas(128) ElidedLock {
+private:
+  static const std::uint32_t S_MAX_RETRIES = 20;
+  static const std::uint32_t S_MAX_BUSY_WAITS = 64;
+  static const std::uint32_t S_CAPACITY_SKIPS = 8;
+  static const unsigned int S_LOCK_BUSY = 0xff;
+
+  struct alignas(128) Policy {
+    std::atomic<std::uint32_t> retries, skips;
+  };
+
+  struct alignas(128) Counters {
+    std::atomic<std::uint64_t> conflict_aborts, capacity_aborts,
+        explicit_aborts, nested_aborts, other_aborts, fallbacks;
+  };
+
+  concurrent_data_structures::TicketLock m_lock;
+  bool m_elide;
+  Policy m_policy;
+  Counters m_counters;
+
+  static void count(std::atomic<std::uint64_t> &counter) {
+    counter.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void reset() {
+    m_policy.retries.store(S_MAX_RETRIES, std::memory_order_relaxed);
+    m_policy.skips.store(0, std::memory_order_relaxed);
+    m_counters.conflict_aborts.store(0, std::memory_order_relaxed);
+    m_counters.capacity_aborts.store(0, std::memory_order_relaxed);
+    m_counters.explicit_aborts.store(0, std::memory_order_relaxed);
+    m_counters.nested_aborts.store(0, std::memory_order_relaxed);
+    m_counters.other_aborts.store(0, std::memory_order_relaxed);
+    m_counters.fallbacks.store(0, std::memory_order_relaxed);
+  }
+
+  __attribute__((target("rtm"))) bool try_elide() {
+    const std::uint32_t skips =
+        m_policy.skips.load(std::memory_order_relaxed);
+    if (skips > 0) {
+      m_policy.skips.store(skips - 1, std::memory_order_relaxed);
+      return false;
+    }
+    const std::uint32_t budget =
+        m_policy.retries.load(std::memory_order_relaxed);
+    std::uint32_t attempt = 0, busy_waits = 0;
+    while (attempt < budget) {
       unsigned int status = _xbegin();
       if (status == _XBEGIN_STARTED) {
-        if (!m_lock.load(std::memory_order_relaxed)) {
-          return;
+        if (!m_lock.is_locked()) {
+          return true;
         } else {
-          _xabort(0xff);
+          _xabort(S_LOCK_BUSY);
         }
       }
-      if ((status & _XABORT_EXPLICIT) && _XABORT_CODE(status) == 0xff) {
+      if ((status & _XABORT_EXPLICIT) and
+          _XABORT_CODE(status) == S_LOCK_BUSY) {
+        count(m_counters.explicit_aborts);
         // Wait for lock to be free.
-        while (m_lock.load(std::memory_order_relaxed)) {
+        while (m_lock.is_locked()) {
           _mm_pause();
         }
+        if (++busy_waits >= S_MAX_BUSY_WAITS) {
+          attempt++;
+        }
+        continue;
       }
-      if (!(status & _XABORT_RETRY) and
-          !((status & _XABORT_EXPLICIT) and _XABORT_CODE(status) == 0xff)) {
+      if (status & _XABORT_NESTED) {
+        count(m_counters.nested_aborts);
         break;
       }
+      if (status & _XABORT_CAPACITY) {
+        count(m_counters.capacity_aborts);
+        m_policy.skips.store(S_CAPACITY_SKIPS, std::memory_order_relaxed);
+        break;
+      }
+      if (status & _XABORT_CONFLICT) {
+        count(m_counters.conflict_aborts);
+      } else {
+        count(m_counters.other_aborts);
+        if (!(status & _XABORT_RETRY)) {
+          break;
+        }
+      }
+      // Back off before retrying, longer on each attempt.
+      attempt++;
+      for (std::uint32_t i = 1u << std::min(attempt, 6u); i > 0; i--) {
+        _mm_pause();
+      }
+    }
+    if (attempt == budget and budget > 1) {
+      m_policy.retries.store(budget >> 1, std::memory_order_relaxed);
+    }
+    return false;
+  }
+
+  __attribute__((target("rtm"))) bool try_commit() {
+    if (!m_lock.is_locked() and _xtest()) {
+      _xend();
+      // Only written below the cap, so steady state commits leave it be.
+      const std::uint32_t budget =
+          m_policy.retries.load(std::memory_order_relaxed);
+      if (budget < S_MAX_RETRIES) {
+        m_policy.retries.store(budget + 1, std::memory_order_relaxed);
+      }
+      return true;
     }
+    return false;
+  }
 
-    while (true) {
-      bool value = m_lock.load(std::memory_order_relaxed);
-      if (!value and
-          m_lock.compare_exchange_weak(value, true, std::memory_order_acquire,
-                                       std::memory_order_relaxed)) {
+public:
+  ElidedLock() : m_elide(concurrent_data_structures::htm_supported()) {
+    reset();
+  }
+  ElidedLock &operator=(const ElidedLock &rhs) {
+    m_lock = rhs.m_lock;
+    m_elide = rhs.m_elide;
+    reset();
+    return *this;
+  }
+
+  void lock() {
+    if (m_elide) {
+      if (try_elide()) {
         return;
       }
-      _mm_pause();
+      count(m_counters.fallbacks);
     }
+    m_lock.lock();
   }
 
   void unlock() {
-    if (!m_lock.load(std::memory_order_relaxed) and _xtest()) {
-      _xend();
-    } else {
-      m_lock.store(false, std::memory_order_release);
+    if (m_elide and try_commit()) {
+      return;
     }
+    m_lock.unlock();
+  }
+
+  concurrent_data_structures::ElisionStats stats() const {
+    concurrent_data_structures::ElisionStats stats;
+    stats.conflict_aborts =
+        m_counters.conflict_aborts.load(std::memory_order_relaxed);
+    stats.capacity_aborts =
+        m_counters.capacity_aborts.load(std::memory_order_relaxed);
+    stats.explicit_aborts =
+        m_counters.explicit_aborts.load(std::memory_order_relaxed);
+    stats.nested_aborts =
+        m_counters.nested_aborts.load(std::memory_order_relaxed);
+    stats.other_aborts = m_counters.other_aborts.load(std::memory_order_relaxed);
+    stats.fallbacks = m_counters.fallbacks.load(std::memory_order_relaxed);
+    stats.retry_budget = m_policy.retries.load(std::memory_order_relaxed);
+    return stats;
   }
 };